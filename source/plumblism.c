@@ -1,9 +1,188 @@
+#define _POSIX_C_SOURCE 200809L
+#ifndef _DEFAULT_SOURCE
+# define _DEFAULT_SOURCE // syscall(2), for io_uring
+#endif
 #include "plumblism.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <assert.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+# define PLUMBLISM_POSIX
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <sys/uio.h>
+#endif
+
+#if defined(PLUMBLISM_POSIX) && !defined(PLUMBLISM_NO_THREADS)
+# define PLUMBLISM_THREADS
+# include <pthread.h>
+#endif
+
+#if defined(__linux__) && defined(PLUMBLISM_POSIX) && !defined(PLUMBLISM_NO_URING)
+# if defined(__has_include)
+#  if __has_include(<linux/io_uring.h>)
+#   define PLUMBLISM_URING
+#   include <errno.h>
+#   include <linux/io_uring.h>
+#   include <sys/syscall.h>
+#  endif
+# endif
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define PLUMBLISM_X86
+# include <immintrin.h>
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+# define PLUMBLISM_BIG_ENDIAN
+#endif
+
+
+// --- Statistics
+/* Everything is counted into the calling thread's record of the outermost public call,
+ *  which is added to the totals (and handed to the callback) once that call returns.
+ * Without `PLUMBLISM_STATS` all of it compiles away.
+ */
+#ifdef PLUMBLISM_STATS
+# include <time.h>
+
+typedef enum {
+    STATS_HEADER,
+    STATS_DATA,
+    STATS_WRITE,
+} stats_kind_t;
+
+static __thread pnm_stats_t stats_call;
+static __thread int         stats_depth;
+static __thread uint64_t    stats_start;
+static __thread long        stats_offset;
+
+static pnm_stats_t          stats_total;
+static pnm_stats_callback_t stats_callback;
+static void *               stats_user;
+
+static inline
+uint64_t stats_now(void) {
+  #ifdef PLUMBLISM_POSIX
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000u + t.tv_nsec;
+  #else
+    return 0;
+  #endif
+}
+
+static
+void stats_begin(FILE * f) {
+    if (stats_depth++) { return; }
+
+    memset(&stats_call, 0, sizeof(stats_call));
+    stats_offset = ftell(f);
+    stats_start  = stats_now();
+}
+
+/* `bytes` is what a write call returned; reads are measured on `f`.
+ */
+static
+void stats_end(const char * call, stats_kind_t kind, FILE * f, long long samples, long long bytes) {
+    if (--stats_depth) { return; }
+
+    const uint64_t elapsed = stats_now() - stats_start;
+
+    stats_call.calls = 1;
+    switch (kind) {
+        case STATS_HEADER:
+        case STATS_DATA: {
+            const long offset = ftell(f);
+            if (stats_offset != -1
+            &&  offset >= stats_offset) {
+                stats_call.bytes_read = offset - stats_offset;
+            }
+            stats_call.samples_read = (samples > 0 ? samples : 0);
+            if (kind == STATS_HEADER) {
+                stats_call.header_ns = elapsed;
+            } else {
+                stats_call.data_ns = elapsed;
+            }
+        } break;
+        case STATS_WRITE: {
+            stats_call.bytes_written   = (bytes   > 0 ? bytes   : 0);
+            stats_call.samples_written = (samples > 0 ? samples : 0);
+            stats_call.format_ns       = (elapsed > stats_call.write_ns ? elapsed - stats_call.write_ns : 0);
+        } break;
+    }
+
+    const uint64_t * from = (const uint64_t *)&stats_call;
+    uint64_t       * to   = (uint64_t *)&stats_total;
+    for (size_t i = 0; i < sizeof(pnm_stats_t) / sizeof(uint64_t); i++) {
+        __atomic_fetch_add(&to[i], from[i], __ATOMIC_RELAXED);
+    }
+
+    const pnm_stats_callback_t callback = __atomic_load_n(&stats_callback, __ATOMIC_ACQUIRE);
+    if (callback) { callback(call, &stats_call, __atomic_load_n(&stats_user, __ATOMIC_RELAXED)); }
+}
+
+# define STATS_ADD(field, n)                             (stats_call.field += (n))
+# define STATS_BEGIN(f)                                  stats_begin(f)
+# define STATS_END(call, kind, f, samples, bytes)        stats_end(call, kind, f, samples, bytes)
+#else
+# define STATS_ADD(field, n)                             ((void)0)
+# define STATS_BEGIN(f)                                  ((void)0)
+# define STATS_END(call, kind, f, samples, bytes)        ((void)0)
+#endif
+
+void set_pnm_stats_callback(pnm_stats_callback_t callback, void * user) {
+  #ifdef PLUMBLISM_STATS
+    __atomic_store_n(&stats_user, user, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats_callback, callback, __ATOMIC_RELEASE);
+  #else
+    (void)callback;
+    (void)user;
+  #endif
+}
+
+void get_pnm_stats(pnm_stats_t * stats) {
+    memset(stats, 0, sizeof(*stats));
+  #ifdef PLUMBLISM_STATS
+    const uint64_t * from = (const uint64_t *)&stats_total;
+    uint64_t       * to   = (uint64_t *)stats;
+    for (size_t i = 0; i < sizeof(pnm_stats_t) / sizeof(uint64_t); i++) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+  #endif
+}
+
+void reset_pnm_stats(void) {
+  #ifdef PLUMBLISM_STATS
+    uint64_t * to = (uint64_t *)&stats_total;
+    for (size_t i = 0; i < sizeof(pnm_stats_t) / sizeof(uint64_t); i++) {
+        __atomic_store_n(&to[i], 0, __ATOMIC_RELAXED);
+    }
+  #endif
+}
+
+/* `fwrite`, with the time spent in it told apart from formatting.
+ */
+static inline
+size_t stats_fwrite(const void * p, size_t size, size_t n, FILE * f) {
+  #ifdef PLUMBLISM_STATS
+    const uint64_t start = stats_now();
+    const size_t r = fwrite(p, size, n, f);
+    STATS_ADD(write_ns, stats_now() - start);
+    return r;
+  #else
+    return fwrite(p, size, n, f);
+  #endif
+}
+
 /* Every problem is a parsing problem, if you hate yourself enough.
  *                                      - Anon; all rights reserved
  */
@@ -44,6 +223,9 @@ pnm_type_t get_pnm_type(FILE * f) {
  
     if (magic[0] != 'P') { return PNM_FORMAT_ERROR; }
 
+    if (magic[1] == 'f') { return PNM_GRE_FLOAT; }
+    if (magic[1] == 'F') { return PNM_PIX_FLOAT; }
+
     return (pnm_type_t)(magic[1] - '0'); // c++ism
 }
 
@@ -66,7 +248,7 @@ int lex_field_co(FILE * f) {
                         BEGIN(IN_NUMBER);
                         goto digit;
                     } break;
-                    case '#': BEGIN(IN_COMMENT); break;
+                    case '#': STATS_ADD(comment_bytes, 1); BEGIN(IN_COMMENT); break;
                     case WSNL: { ; } break;
                     default: return -1;
                 }
@@ -89,6 +271,7 @@ int lex_field_co(FILE * f) {
             } break;
 
             case IN_COMMENT: {
+                STATS_ADD(comment_bytes, 1);
                 if (c == '\n') { BEGIN(INITIAL); }
             } break;
         }
@@ -97,251 +280,4176 @@ int lex_field_co(FILE * f) {
     return -1;
 }
 
+// --- Tokenizer
+/* Bulk counterpart of `lex_field_co` for the data section of P2/P3.
+ * The input is read in large blocks and handed to a kernel
+ *  which lexes as many samples out of memory as it can.
+ * Kernels stop at comments, which are skipped with `memchr`,
+ *  and at the end of the block, where an unfinished number is
+ *  moved to the front and the block is refilled behind it.
+ */
+typedef enum {
+    LEX_DONE,       // all requested samples were produced
+    LEX_MORE,       // ran out of input, resume at `*stop`
+    LEX_COMMENT,    // `*stop` points to a '#'
+    LEX_ERROR,
+} lex_status_t;
+
+typedef lex_status_t (*lex_block_fn)(const char * s, const char * e, int * b, int n, int * r, const char ** stop);
+
+static const int lex_block_size = 1 << 16;
+static const int lex_pad        = 8;
+
+static inline
+bool is_wsnl(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline
+bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
 static
-int lex_data(FILE * f, int * b, int size) {
-    int r = 0;
+lex_status_t lex_block_scalar(const char * s, const char * e, int * b, int n, int * r, const char ** stop) {
+    lex_status_t status = LEX_MORE;
+    int r_ = *r;
+
+    while (r_ < n) {
+        while (s < e && is_wsnl(*s)) { ++s; }
+        if (s == e) { break; }
+        if (*s == '#') {
+            status = LEX_COMMENT;
+            break;
+        }
+
+        const char * t = s;
+        while (t < e && is_digit(*t)) { ++t; }
+
+        if (t == s
+        ||  t - s >= digit_buffer_size) {
+            status = LEX_ERROR;
+            break;
+        }
+        if (t == e) { break; } // the number might go on in the next block
+        if (!is_wsnl(*t)) {
+            status = LEX_ERROR;
+            break;
+        }
+
+        int v = 0;
+        for (; s < t; s++) { v = v * 10 + (*s - '0'); }
+        b[r_++] = v;
 
-    for (int i = 0; i < size; i++) {
-        if (r >= size) { break; }
-        b[r++] = lex_field_co(f);
+        s = t + 1;
     }
 
-    assert(r == size);
-    return r;
+    if (r_ == n) { status = LEX_DONE; }
+
+    *r    = r_;
+    *stop = s;
+    return status;
 }
 
+#ifdef PLUMBLISM_X86
+/* The vector kernels classify 64 bytes at a time into digit and "other" masks.
+ * As long as a window holds nothing but digits and whitespace,
+ *  numbers start where a digit follows a non-digit and end on the first non-digit.
+ * Windows with anything else in them (comments, garbage) are left to the scalar kernel.
+ * Numbers of up to 8 digits are converted several at once with multiply-adds
+ *  over their digits, right aligned in a 64 bit lane, most significant first.
+ */
+typedef void (*lex_classify_fn)(const char * s, uint64_t * digit, uint64_t * other);
+typedef void (*lex_convert_fn)(const char * const * ends, const int * lens, int * b, int n);
 
-// --- Readers
-int read_pnm_header(FILE * f, pnm_type_t type, int * w, int * h, int * intensity) {
-    int w_, h_, intensity_;
+static inline
+uint64_t lex_load_digits(const char * end, int len) {
+    uint64_t x;
+    memcpy(&x, end - 8, sizeof(x));
+    return x & (~0ULL << (8 * (8 - len))) & 0x0F0F0F0F0F0F0F0FULL;
+}
 
-    rewind(f);
-    fgetc(f);
-    fgetc(f);
+static inline
+int lex_convert_one(const char * end, int len) {
+    int v = 0;
+    for (const char * s = end - len; s < end; s++) { v = v * 10 + (*s - '0'); }
+    return v;
+}
 
-    w_ = lex_field_co(f); if (w_ == -1) { return -1; }
-    h_ = lex_field_co(f); if (h_ == -1) { return -1; }
-    if (type == PNM_BIT_ASCII
-    ||  type == PNM_BIT_BINARY) {
-        intensity_ = 1;
-    } else {
-        intensity_ = lex_field_co(f);
-        if (intensity_ == -1) { return -1; }
+static inline __attribute__((always_inline))
+lex_status_t lex_block_simd(
+    const char * s,
+    const char * e,
+    int * b,
+    int n,
+    int * r,
+    const char ** stop,
+    lex_classify_fn classify,
+    lex_convert_fn convert
+) {
+    const char * const lo = s;
+    const char * tok  = NULL;   // start of a number running into the next window
+    const char * last = NULL;   // end of the last number converted
+    uint64_t carry = 0;
+    int r_ = *r;
+
+    const char * ends[32];
+    int lens[32];
+
+    while (e - s >= 64
+    &&     r_ < n) {
+        uint64_t digit, other;
+        classify(s, &digit, &other);
+        if (other) { break; }
+
+        const uint64_t previous = (digit << 1) | carry;
+        uint64_t starts = digit & ~previous;
+        uint64_t stops  = ~digit & previous;
+        carry = digit >> 63;
+
+        int k = 0;
+        while (stops
+        &&     r_ + k < n) {
+            if (!tok) {
+                tok = s + __builtin_ctzll(starts);
+                starts &= starts - 1;
+            }
+            const char * t = s + __builtin_ctzll(stops);
+            stops &= stops - 1;
+
+            ends[k] = t;
+            lens[k] = t - tok;
+            last    = t;
+            if (lens[k] >= digit_buffer_size) {
+                *r    = r_;
+                *stop = tok;
+                return LEX_ERROR;
+            }
+            if (t - 8 < lo) {
+                // Too close to the start to load a whole lane
+                b[r_++] = lex_convert_one(t, lens[k]);
+            } else {
+                ++k;
+            }
+            tok = NULL;
+        }
+
+        convert(ends, lens, b + r_, k);
+        r_ += k;
+
+        if (r_ == n) {
+            *r    = r_;
+            *stop = last + 1;
+            return LEX_DONE;
+        }
+
+        if (starts) { tok = s + __builtin_ctzll(starts); }
+        s += 64;
     }
 
-    if (w        ) { *w         = w_        ; }
-    if (h        ) { *h         = h_        ; }
-    if (intensity) { *intensity = intensity_; }
+    *r = r_;
+    return lex_block_scalar(tok ? tok : s, e, b, n, r, stop);
+}
 
-    int bytes_per_pixel = 0;
-  #pragma GCC diagnostic push
-  #pragma GCC diagnostic ignored "-Wswitch"
-    switch (type) {
-        case PNM_BIT_ASCII:
-        case PNM_BIT_BINARY:
-        case PNM_GRE_ASCII:
-        case PNM_GRE_BINARY:
-            bytes_per_pixel = 1;
-            break;
-        case PNM_PIX_ASCII:
-        case PNM_PIX_BINARY:
-            bytes_per_pixel = 3;
-            break;
+# ifdef __SSE2__
+static inline
+void lex_classify_sse2(const char * s, uint64_t * digit, uint64_t * other) {
+    const __m128i below_0 = _mm_set1_epi8('0' - 1);
+    const __m128i above_9 = _mm_set1_epi8('9' + 1);
+    const __m128i below_t = _mm_set1_epi8('\t' - 1);
+    const __m128i above_r = _mm_set1_epi8('\r' + 1);
+    const __m128i space   = _mm_set1_epi8(' ');
+
+    uint64_t d = 0;
+    uint64_t o = 0;
+    for (int i = 0; i < 4; i++) {
+        const __m128i c = _mm_loadu_si128((const __m128i *)(s + 16 * i));
+        const __m128i is_d = _mm_and_si128(_mm_cmpgt_epi8(c, below_0), _mm_cmplt_epi8(c, above_9));
+        const __m128i is_w = _mm_or_si128(
+            _mm_and_si128(_mm_cmpgt_epi8(c, below_t), _mm_cmplt_epi8(c, above_r)),
+            _mm_cmpeq_epi8(c, space)
+        );
+        d |= (uint64_t)(uint16_t)_mm_movemask_epi8(is_d) << (16 * i);
+        o |= (uint64_t)(uint16_t)~_mm_movemask_epi8(_mm_or_si128(is_d, is_w)) << (16 * i);
     }
-  #pragma GCC diagnostic pop
 
-    return w_ * h_ * bytes_per_pixel;
+    *digit = d;
+    *other = o;
+}
+
+static inline
+void lex_convert_sse2(const char * const * ends, const int * lens, int * b, int n) {
+    const __m128i zero      = _mm_setzero_si128();
+    const __m128i by_10     = _mm_set1_epi32(0x0001000A);
+    const __m128i by_100    = _mm_set1_epi32(0x00010064);
+    const __m128i by_10000  = _mm_set1_epi32(10000);
+
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        if (lens[i] > 8 || lens[i+1] > 8) {
+            b[i]   = lex_convert_one(ends[i],   lens[i]);
+            b[i+1] = lex_convert_one(ends[i+1], lens[i+1]);
+            continue;
+        }
+        const __m128i v = _mm_set_epi64x(
+            lex_load_digits(ends[i+1], lens[i+1]),
+            lex_load_digits(ends[i],   lens[i])
+        );
+        const __m128i d01 = _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), by_10);
+        const __m128i d23 = _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), by_10);
+        const __m128i q   = _mm_madd_epi16(_mm_packs_epi32(d01, d23), by_100);
+        const __m128i x   = _mm_add_epi64(_mm_mul_epu32(q, by_10000), _mm_srli_epi64(q, 32));
+        b[i]   = _mm_cvtsi128_si32(x);
+        b[i+1] = _mm_cvtsi128_si32(_mm_srli_si128(x, 8));
+    }
+    for (; i < n; i++) {
+        b[i] = lex_convert_one(ends[i], lens[i]);
+    }
 }
 
 static
-int read_pnm_bit_ascii_data(FILE * f, int * b, int size) {
-    int r = 0;
+lex_status_t lex_block_sse2(const char * s, const char * e, int * b, int n, int * r, const char ** stop) {
+    return lex_block_simd(s, e, b, n, r, stop, lex_classify_sse2, lex_convert_sse2);
+}
+# endif
 
-    int c;
-    state_t state = INITIAL;
-    while ((c = fgetc(f)) != EOF) {
-        if (r >= size) { break; }
-      #pragma GCC diagnostic push
-      #pragma GCC diagnostic ignored "-Wswitch"
-        switch (state) {
-            case INITIAL: {
-                switch (c) {
-                    case '0': case '1': {
-                        b[r++] = c - '0';
-                    } break;
-                    case WSNL: { ; } break;
-                    case '#': { BEGIN(IN_COMMENT); } break;
-                    default: return -1;
-                }
-            } break;
+static inline __attribute__((target("avx2")))
+void lex_classify_avx2(const char * s, uint64_t * digit, uint64_t * other) {
+    const __m256i below_0 = _mm256_set1_epi8('0' - 1);
+    const __m256i above_9 = _mm256_set1_epi8('9' + 1);
+    const __m256i below_t = _mm256_set1_epi8('\t' - 1);
+    const __m256i above_r = _mm256_set1_epi8('\r' + 1);
+    const __m256i space   = _mm256_set1_epi8(' ');
 
-            case IN_COMMENT: {
-                if (c == '\n') { BEGIN(INITIAL); }
-            } break;
-        }
-      #pragma GCC diagnostic pop
+    uint64_t d = 0;
+    uint64_t o = 0;
+    for (int i = 0; i < 2; i++) {
+        const __m256i c = _mm256_loadu_si256((const __m256i *)(s + 32 * i));
+        const __m256i is_d = _mm256_and_si256(_mm256_cmpgt_epi8(c, below_0), _mm256_cmpgt_epi8(above_9, c));
+        const __m256i is_w = _mm256_or_si256(
+            _mm256_and_si256(_mm256_cmpgt_epi8(c, below_t), _mm256_cmpgt_epi8(above_r, c)),
+            _mm256_cmpeq_epi8(c, space)
+        );
+        d |= (uint64_t)(uint32_t)_mm256_movemask_epi8(is_d) << (32 * i);
+        o |= (uint64_t)(uint32_t)~_mm256_movemask_epi8(_mm256_or_si256(is_d, is_w)) << (32 * i);
     }
 
-    assert(r == size);
-    return r;
+    *digit = d;
+    *other = o;
 }
 
-static
-int read_pnm_bit_binary_data(FILE * f, int * b, int size) {
-    int r = 0;
-    
-    int c;
-    while ((c = fgetc(f)) != EOF) {
-        for (int i = 0; i < 8; i++) {
-            if (r >= size) { break; }
-            b[r++] = (c >> (7-i)) & 0x1;
+static inline __attribute__((target("avx2")))
+void lex_convert_avx2(const char * const * ends, const int * lens, int * b, int n) {
+    const __m256i by_10    = _mm256_set1_epi16(0x010A);
+    const __m256i by_100   = _mm256_set1_epi32(0x00010064);
+    const __m256i by_10000 = _mm256_set1_epi32(10000);
+
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        if ((lens[i] | lens[i+1] | lens[i+2] | lens[i+3]) > 8) {
+            for (int h = i; h < i + 4; h++) { b[h] = lex_convert_one(ends[h], lens[h]); }
+            continue;
         }
+        const __m256i v = _mm256_set_epi64x(
+            lex_load_digits(ends[i+3], lens[i+3]),
+            lex_load_digits(ends[i+2], lens[i+2]),
+            lex_load_digits(ends[i+1], lens[i+1]),
+            lex_load_digits(ends[i],   lens[i])
+        );
+        const __m256i q = _mm256_madd_epi16(_mm256_maddubs_epi16(v, by_10), by_100);
+        const __m256i x = _mm256_add_epi64(_mm256_mul_epu32(q, by_10000), _mm256_srli_epi64(q, 32));
+        // Gather the low dword of every lane
+        const __m256i packed = _mm256_permutevar8x32_epi32(x, _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0));
+        _mm_storeu_si128((__m128i *)(b + i), _mm256_castsi256_si128(packed));
+    }
+    for (; i < n; i++) {
+        b[i] = lex_convert_one(ends[i], lens[i]);
     }
+}
 
-    assert(r == size);
-    return r;
+static __attribute__((target("avx2")))
+lex_status_t lex_block_avx2(const char * s, const char * e, int * b, int n, int * r, const char ** stop) {
+    return lex_block_simd(s, e, b, n, r, stop, lex_classify_avx2, lex_convert_avx2);
 }
+#endif
+
+static pnm_simd_t simd_level = PNM_SIMD_AUTO;
 
 static
-int read_pnm_gray_ascii_data(FILE * f, int * b, int size) {
-    return lex_data(f, b, size);
+pnm_simd_t pnm_simd_supported(void) {
+  #ifdef PLUMBLISM_X86
+    if (__builtin_cpu_supports("avx2")) { return PNM_SIMD_AVX2; }
+  # ifdef __SSE2__
+    return PNM_SIMD_SSE2;
+  # endif
+  #endif
+    return PNM_SIMD_SCALAR;
 }
 
-static inline
-int read_pnm_gray_binary_data(FILE * f, int * b, int size) {
-    int r = 0;
+pnm_simd_t pnm_set_simd(pnm_simd_t level) {
+    const pnm_simd_t supported = pnm_simd_supported();
 
-    int c;
-    while ((c = fgetc(f)) != EOF) {
-        if (r >= size) { break; }
-        b[r++] = c;
+    if (level == PNM_SIMD_AUTO
+    ||  level > supported) {
+        level = supported;
     }
+    simd_level = level;
 
-    assert(r == size);
-    return r;
+    return level;
 }
 
 static
-int read_pnm_pix_ascii_data(FILE * f, int * b, int size) {
-    const int i = lex_data(f, b, size);
-    return (i % 3 == 0 ? i : -2);
+pnm_simd_t pnm_simd(void) {
+    if (simd_level == PNM_SIMD_AUTO) { pnm_set_simd(PNM_SIMD_AUTO); }
+    return simd_level;
 }
 
 static
-int read_pnm_pix_binary_data(FILE * f, int * b, int size) {
-    return read_pnm_gray_binary_data(f, b, size);
-}
-
-int read_pnm_data(FILE * f, pnm_type_t type, int * b, int size) {
+lex_block_fn lex_block_kernel(void) {
   #pragma GCC diagnostic push
   #pragma GCC diagnostic ignored "-Wswitch"
-    switch (type) {
-        case PNM_BIT_ASCII:  return read_pnm_bit_ascii_data(f, b, size);
-        case PNM_GRE_ASCII:  return read_pnm_gray_ascii_data(f, b, size);
-        case PNM_PIX_ASCII:  return read_pnm_pix_ascii_data(f, b, size);
-        case PNM_BIT_BINARY: return read_pnm_bit_binary_data(f, b, size);
-        case PNM_GRE_BINARY: return read_pnm_gray_binary_data(f, b, size);
-        case PNM_PIX_BINARY: return read_pnm_pix_binary_data(f, b, size);
+    switch (pnm_simd()) {
+      #ifdef PLUMBLISM_X86
+        case PNM_SIMD_AVX2: return lex_block_avx2;
+      # ifdef __SSE2__
+        case PNM_SIMD_SSE2: return lex_block_sse2;
+      # endif
+      #endif
     }
   #pragma GCC diagnostic pop
 
-    return -1;
+    return lex_block_scalar;
 }
 
-
-// --- Writers
+/* `lex_data` for streams which cannot be seeked,
+ *  where whatever is read past the last sample could not be given back.
+ * Goes field by field instead, stopping right behind it.
+ */
 static
-int write_pnm_bit_ascii_data(FILE * f, const int * b, int w, int h) {
+int lex_data_co(FILE * f, int * b, int size) {
     int r = 0;
 
-    for (int i = 0; i < w*h; i++) {
-        r += fprintf(f, "%d ", b[i]);
-        if ((i + 1) % w == 0) {
-            r += (fputc('\n', f), 1);
+    while (r < size) {
+        const int i = lex_field_co(f);
+        if (i < 0) {
+            if (!feof(f)) { return -1; }
+            break;
         }
+        b[r++] = i;
     }
 
+    // Like `lex_data`
+    if (r < size) { memset(b + r, 0, (size_t)(size - r) * sizeof(int)); }
+
     return r;
 }
 
 static
-int write_pnm_bit_binary_data(FILE * f, const int * b, int w, int h) {
+int lex_data(FILE * f, int * b, int size) {
+    if (ftell(f) == -1) { return lex_data_co(f, b, size); }
+
+    const lex_block_fn kernel = lex_block_kernel();
+
+    // Padded in front, so the vector kernels can always load 8 bytes behind a number
+    char * block = (char *)malloc(lex_pad + lex_block_size + 1);
+    if (!block) { return -1; }
+    memset(block, ' ', lex_pad);
+
+    char * const base = block + lex_pad;
+    const char * s = base;
+    const char * e = base;
+
+    lex_status_t status = LEX_MORE;
+    bool in_comment = false;
+    bool eof        = false;
     int r = 0;
 
-    for (int i = 0; i < w*h; i += 8) {
-        int v = 0;
-        for (int h = 0; h < 8; h++) {
-            v |= (b[i+h] << (7-h));
+    while (r < size) {
+        if (in_comment) {
+            const char * nl = (const char *)memchr(s, '\n', e - s);
+            const char * t  = (nl ? nl + 1 : e);
+            STATS_ADD(comment_bytes, t - s);
+            s = t;
+            in_comment = (nl == NULL);
+        }
+
+        if (!in_comment) {
+            status = kernel(s, e, b, size, &r, &s);
+            if (status == LEX_DONE
+            ||  status == LEX_ERROR) {
+                break;
+            }
+            if (status == LEX_COMMENT) {
+                in_comment = true;
+                continue;
+            }
+        }
+
+        if (eof) { break; }
+
+        // Keep the unfinished tail and refill behind it.
+        //  The first read is sized after the request,
+        //   so that small reads do not overshoot by a whole block.
+        const size_t tail = e - s;
+        memmove(base, s, tail);
+
+        size_t want = lex_block_size - tail;
+        if (want > (size_t)(size - r) * 4 + 64) { want = (size_t)(size - r) * 4 + 64; }
+
+        const size_t got = fread(base + tail, 1, want, f);
+        s = base;
+        e = base + tail + got;
+
+        if (got == 0) {
+            // A newline at the end of the file terminates the last number
+            eof = true;
+            *(base + tail) = '\n';
+            e += 1;
         }
-        r += (fputc(v, f), 1);
     }
 
+    // Give back what was read ahead
+    const long leftover = (long)(e - s) - (eof ? 1 : 0);
+    if (leftover > 0
+    &&  fseek(f, -leftover, SEEK_CUR) != 0) {
+        status = LEX_ERROR;
+    }
+
+    free(block);
+
+    if (status == LEX_ERROR) { return -1; }
+
+    // Truncated data yields a short count, the missing samples are zeroed
+    if (r < size) { memset(b + r, 0, (size_t)(size - r) * sizeof(int)); }
+
     return r;
 }
 
+
+// --- Block I/O
+/* Binary data is moved with large `fread`/`fwrite` calls,
+ *  instead of a (locked) stdio call per byte.
+ * Widening to ints happens in place:
+ *  the bytes are read into the last quarter of the destination
+ *  and spread out front to back, which never overtakes the unread input.
+ */
+static const int io_block_size = 1 << 16;
+
 static
-int write_pnm_gray_ascii_data(FILE * f, const int * b, int w, int h) {
-    return write_pnm_bit_ascii_data(f, b, w, h);
+void widen_u8_scalar(int * d, const uint8_t * s, int n) {
+    for (int i = 0; i < n; i++) { d[i] = s[i]; }
 }
 
 static
-int write_pnm_gray_binary_data(FILE * f, const int * b, int w, int h) {
-    int r = 0;
+void narrow_u8_scalar(uint8_t * d, const int * s, int n) {
+    for (int i = 0; i < n; i++) { d[i] = s[i]; }
+}
 
-    for (int i = 0; i < w*h; i++) { r += (fputc(b[i], f), 1); }
+#ifdef PLUMBLISM_X86
+# ifdef __SSE2__
+static
+void widen_u8_sse2(int * d, const uint8_t * s, int n) {
+    const __m128i zero = _mm_setzero_si128();
 
-    return r;
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i c  = _mm_loadu_si128((const __m128i *)(s + i));
+        const __m128i lo = _mm_unpacklo_epi8(c, zero);
+        const __m128i hi = _mm_unpackhi_epi8(c, zero);
+        _mm_storeu_si128((__m128i *)(d + i +  0), _mm_unpacklo_epi16(lo, zero));
+        _mm_storeu_si128((__m128i *)(d + i +  4), _mm_unpackhi_epi16(lo, zero));
+        _mm_storeu_si128((__m128i *)(d + i +  8), _mm_unpacklo_epi16(hi, zero));
+        _mm_storeu_si128((__m128i *)(d + i + 12), _mm_unpackhi_epi16(hi, zero));
+    }
+    widen_u8_scalar(d + i, s + i, n - i);
 }
 
 static
-int write_pnm_pix_ascii_data(FILE * f, const int * b, int w, int h) {
-    int r = 0;
+void narrow_u8_sse2(uint8_t * d, const int * s, int n) {
+    const __m128i low_byte = _mm_set1_epi32(0xFF);
 
-    for (int i = 0; i < w*h; i++) {
-        r += fprintf(f, "%d %d %d  ", 
-            b[0], 
-            b[1], 
-            b[2]
-        );
-        b += 3;
-        if ((i + 1) % w == 0) {
-            r += fprintf(f, "\n");
-        }
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i *)(s + i +  0)), low_byte);
+        const __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i *)(s + i +  4)), low_byte);
+        const __m128i c = _mm_and_si128(_mm_loadu_si128((const __m128i *)(s + i +  8)), low_byte);
+        const __m128i e = _mm_and_si128(_mm_loadu_si128((const __m128i *)(s + i + 12)), low_byte);
+        _mm_storeu_si128((__m128i *)(d + i), _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, e)));
     }
-
-    return r;
+    narrow_u8_scalar(d + i, s + i, n - i);
 }
+# endif
 
-static
-int write_pnm_pix_binary_data(FILE * f, const int * b, int w, int h) {
-    return write_pnm_gray_binary_data(f, b, w*3, h);
+static __attribute__((target("avx2")))
+void widen_u8_avx2(int * d, const uint8_t * s, int n) {
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i c = _mm256_loadu_si256((const __m256i *)(s + i));
+        const __m128i lo = _mm256_castsi256_si128(c);
+        const __m128i hi = _mm256_extracti128_si256(c, 1);
+        _mm256_storeu_si256((__m256i *)(d + i +  0), _mm256_cvtepu8_epi32(lo));
+        _mm256_storeu_si256((__m256i *)(d + i +  8), _mm256_cvtepu8_epi32(_mm_srli_si128(lo, 8)));
+        _mm256_storeu_si256((__m256i *)(d + i + 16), _mm256_cvtepu8_epi32(hi));
+        _mm256_storeu_si256((__m256i *)(d + i + 24), _mm256_cvtepu8_epi32(_mm_srli_si128(hi, 8)));
+    }
+    widen_u8_scalar(d + i, s + i, n - i);
 }
 
-int write_pnm_file(FILE * f, pnm_type_t type, const int * b, int w, int h, int intensity) {
-    int r = 0;
+static __attribute__((target("avx2")))
+void narrow_u8_avx2(uint8_t * d, const int * s, int n) {
+    const __m256i low_byte = _mm256_set1_epi32(0xFF);
+    const __m256i order    = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
 
-    char magic[] = "PX";
-    magic[1] = '0' + type;
-    r += (fputs(magic, f), 2);
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i a = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(s + i +  0)), low_byte);
+        const __m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(s + i +  8)), low_byte);
+        const __m256i c = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(s + i + 16)), low_byte);
+        const __m256i e = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(s + i + 24)), low_byte);
+        // Packing works per 128 bit lane, so the dwords come out interleaved
+        const __m256i p = _mm256_packus_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, e));
+        _mm256_storeu_si256((__m256i *)(d + i), _mm256_permutevar8x32_epi32(p, order));
+    }
+    narrow_u8_scalar(d + i, s + i, n - i);
+}
+#endif
 
-    if (type == PNM_BIT_ASCII
-    ||  type == PNM_BIT_BINARY) {
-        r += fprintf(f, "\n%d %d\n", w, h);
-    } else {
-        r += fprintf(f, "\n%d %d %d\n", w, h, intensity);
+static
+void widen_u8(int * d, const uint8_t * s, int n) {
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored "-Wswitch"
+    switch (pnm_simd()) {
+      #ifdef PLUMBLISM_X86
+        case PNM_SIMD_AVX2: widen_u8_avx2(d, s, n); return;
+      # ifdef __SSE2__
+        case PNM_SIMD_SSE2: widen_u8_sse2(d, s, n); return;
+      # endif
+      #endif
     }
+  #pragma GCC diagnostic pop
 
+    widen_u8_scalar(d, s, n);
+}
+
+static
+void narrow_u8(uint8_t * d, const int * s, int n) {
   #pragma GCC diagnostic push
   #pragma GCC diagnostic ignored "-Wswitch"
-    switch (type) {
-        case PNM_BIT_ASCII:  r += write_pnm_bit_ascii_data   (f, b, w, h); break;
-        case PNM_GRE_ASCII:  r += write_pnm_gray_ascii_data  (f, b, w, h); break;
-        case PNM_PIX_ASCII:  r += write_pnm_pix_ascii_data   (f, b, w, h); break;
-        case PNM_BIT_BINARY: r += write_pnm_bit_binary_data  (f, b, w, h); break;
-        case PNM_GRE_BINARY: r += write_pnm_gray_binary_data (f, b, w, h); break;
-        case PNM_PIX_BINARY: r += write_pnm_pix_binary_data  (f, b, w, h); break;
+    switch (pnm_simd()) {
+      #ifdef PLUMBLISM_X86
+        case PNM_SIMD_AVX2: narrow_u8_avx2(d, s, n); return;
+      # ifdef __SSE2__
+        case PNM_SIMD_SSE2: narrow_u8_sse2(d, s, n); return;
+      # endif
+      #endif
     }
   #pragma GCC diagnostic pop
 
+    narrow_u8_scalar(d, s, n);
+}
+
+/* Read `size` bytes and widen them into `b`.
+ */
+static
+int read_bytes_as_ints(FILE * f, int * b, int size) {
+    uint8_t * const tail = (uint8_t *)b + (size_t)size * (sizeof(int) - 1);
+
+    const int r = fread(tail, 1, size, f);
+    widen_u8(b, tail, r);
+
+    return r;
+}
+
+/* Narrow `n` ints to bytes and write them, one block at a time.
+ */
+static
+int write_ints_as_bytes(FILE * f, const int * b, int n) {
+    uint8_t * block = (uint8_t *)malloc(n < io_block_size ? n : io_block_size);
+    if (!block) { return -1; }
+
+    int r = 0;
+    for (int i = 0; i < n; i += io_block_size) {
+        const int c = (n - i < io_block_size ? n - i : io_block_size);
+        narrow_u8(block, b + i, c);
+        r += stats_fwrite(block, 1, c, f);
+    }
+
+    free(block);
+
     return r;
 }
+
+/* Samples of images with an intensity above 255 are 2 byte big-endian words.
+ * Decoding swaps each byte pair (and widens to ints where needed);
+ *  the vector kernels exist for x86 only, which is always little-endian,
+ *  the scalar ones go through the bytes and work on any host.
+ * Widening in place works just like for single bytes,
+ *  with the words read into the second half of the destination.
+ */
+static
+void widen_u16be_scalar(int * d, const uint8_t * s, int n) {
+    for (int i = 0; i < n; i++) { d[i] = (s[2*i] << 8) | s[2*i+1]; }
+}
+
+static
+void narrow_u16be_scalar(uint8_t * d, const int * s, int n) {
+    for (int i = 0; i < n; i++) {
+        d[2*i]   = (s[i] >> 8) & 0xFF;
+        d[2*i+1] =  s[i]       & 0xFF;
+    }
+}
+
+static
+void decode_u16be_scalar(uint16_t * d, const uint8_t * s, int n) {
+    for (int i = 0; i < n; i++) { d[i] = (s[2*i] << 8) | s[2*i+1]; }
+}
+
+static
+void encode_u16be_scalar(uint8_t * d, const uint16_t * s, int n) {
+    for (int i = 0; i < n; i++) {
+        const uint16_t v = s[i];
+        d[2*i]   = v >> 8;
+        d[2*i+1] = v & 0xFF;
+    }
+}
+
+#ifdef PLUMBLISM_X86
+# ifdef __SSE2__
+static inline
+__m128i swap_u16_sse2(__m128i v) {
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+/* `_mm_packs_epi32` saturates, so the low 16 bits are sign extended first,
+ *  which makes the pack truncate instead.
+ */
+static inline
+__m128i pack_low_u16_sse2(__m128i a, __m128i b) {
+    return _mm_packs_epi32(
+        _mm_srai_epi32(_mm_slli_epi32(a, 16), 16),
+        _mm_srai_epi32(_mm_slli_epi32(b, 16), 16)
+    );
+}
+
+static
+void widen_u16be_sse2(int * d, const uint8_t * s, int n) {
+    const __m128i zero = _mm_setzero_si128();
+
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m128i w = swap_u16_sse2(_mm_loadu_si128((const __m128i *)(s + 2*i)));
+        _mm_storeu_si128((__m128i *)(d + i + 0), _mm_unpacklo_epi16(w, zero));
+        _mm_storeu_si128((__m128i *)(d + i + 4), _mm_unpackhi_epi16(w, zero));
+    }
+    widen_u16be_scalar(d + i, s + 2*i, n - i);
+}
+
+static
+void narrow_u16be_sse2(uint8_t * d, const int * s, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m128i a = _mm_loadu_si128((const __m128i *)(s + i + 0));
+        const __m128i b = _mm_loadu_si128((const __m128i *)(s + i + 4));
+        _mm_storeu_si128((__m128i *)(d + 2*i), swap_u16_sse2(pack_low_u16_sse2(a, b)));
+    }
+    narrow_u16be_scalar(d + 2*i, s + i, n - i);
+}
+
+static
+void decode_u16be_sse2(uint16_t * d, const uint8_t * s, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm_storeu_si128((__m128i *)(d + i), swap_u16_sse2(_mm_loadu_si128((const __m128i *)(s + 2*i))));
+    }
+    decode_u16be_scalar(d + i, s + 2*i, n - i);
+}
+
+static
+void encode_u16be_sse2(uint8_t * d, const uint16_t * s, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm_storeu_si128((__m128i *)(d + 2*i), swap_u16_sse2(_mm_loadu_si128((const __m128i *)(s + i))));
+    }
+    encode_u16be_scalar(d + 2*i, s + i, n - i);
+}
+# endif
+
+static __attribute__((target("avx2"))) inline
+__m256i swap_u16_avx2(__m256i v) {
+    const __m256i order = _mm256_setr_epi8(
+        1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+        1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14
+    );
+    return _mm256_shuffle_epi8(v, order);
+}
+
+static __attribute__((target("avx2")))
+void widen_u16be_avx2(int * d, const uint8_t * s, int n) {
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m256i w = swap_u16_avx2(_mm256_loadu_si256((const __m256i *)(s + 2*i)));
+        _mm256_storeu_si256((__m256i *)(d + i + 0), _mm256_cvtepu16_epi32(_mm256_castsi256_si128(w)));
+        _mm256_storeu_si256((__m256i *)(d + i + 8), _mm256_cvtepu16_epi32(_mm256_extracti128_si256(w, 1)));
+    }
+    widen_u16be_scalar(d + i, s + 2*i, n - i);
+}
+
+static __attribute__((target("avx2")))
+void narrow_u16be_avx2(uint8_t * d, const int * s, int n) {
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m256i a = _mm256_loadu_si256((const __m256i *)(s + i + 0));
+        const __m256i b = _mm256_loadu_si256((const __m256i *)(s + i + 8));
+        // See `pack_low_u16_sse2`; the lanes come out interleaved like in `narrow_u8_avx2`
+        const __m256i p = _mm256_packs_epi32(
+            _mm256_srai_epi32(_mm256_slli_epi32(a, 16), 16),
+            _mm256_srai_epi32(_mm256_slli_epi32(b, 16), 16)
+        );
+        _mm256_storeu_si256((__m256i *)(d + 2*i), swap_u16_avx2(_mm256_permute4x64_epi64(p, _MM_SHUFFLE(3, 1, 2, 0))));
+    }
+    narrow_u16be_scalar(d + 2*i, s + i, n - i);
+}
+
+static __attribute__((target("avx2")))
+void decode_u16be_avx2(uint16_t * d, const uint8_t * s, int n) {
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm256_storeu_si256((__m256i *)(d + i), swap_u16_avx2(_mm256_loadu_si256((const __m256i *)(s + 2*i))));
+    }
+    decode_u16be_scalar(d + i, s + 2*i, n - i);
+}
+
+static __attribute__((target("avx2")))
+void encode_u16be_avx2(uint8_t * d, const uint16_t * s, int n) {
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm256_storeu_si256((__m256i *)(d + 2*i), swap_u16_avx2(_mm256_loadu_si256((const __m256i *)(s + i))));
+    }
+    encode_u16be_scalar(d + 2*i, s + i, n - i);
+}
+#endif
+
+static
+void widen_u16be(int * d, const uint8_t * s, int n) {
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored "-Wswitch"
+    switch (pnm_simd()) {
+      #ifdef PLUMBLISM_X86
+        case PNM_SIMD_AVX2: widen_u16be_avx2(d, s, n); return;
+      # ifdef __SSE2__
+        case PNM_SIMD_SSE2: widen_u16be_sse2(d, s, n); return;
+      # endif
+      #endif
+    }
+  #pragma GCC diagnostic pop
+
+    widen_u16be_scalar(d, s, n);
+}
+
+static
+void narrow_u16be(uint8_t * d, const int * s, int n) {
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored "-Wswitch"
+    switch (pnm_simd()) {
+      #ifdef PLUMBLISM_X86
+        case PNM_SIMD_AVX2: narrow_u16be_avx2(d, s, n); return;
+      # ifdef __SSE2__
+        case PNM_SIMD_SSE2: narrow_u16be_sse2(d, s, n); return;
+      # endif
+      #endif
+    }
+  #pragma GCC diagnostic pop
+
+    narrow_u16be_scalar(d, s, n);
+}
+
+/* `d` and `s` may be the same buffer.
+ */
+static
+void decode_u16be(uint16_t * d, const uint8_t * s, int n) {
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored "-Wswitch"
+    switch (pnm_simd()) {
+      #ifdef PLUMBLISM_X86
+        case PNM_SIMD_AVX2: decode_u16be_avx2(d, s, n); return;
+      # ifdef __SSE2__
+        case PNM_SIMD_SSE2: decode_u16be_sse2(d, s, n); return;
+      # endif
+      #endif
+    }
+  #pragma GCC diagnostic pop
+
+    decode_u16be_scalar(d, s, n);
+}
+
+static
+void encode_u16be(uint8_t * d, const uint16_t * s, int n) {
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored "-Wswitch"
+    switch (pnm_simd()) {
+      #ifdef PLUMBLISM_X86
+        case PNM_SIMD_AVX2: encode_u16be_avx2(d, s, n); return;
+      # ifdef __SSE2__
+        case PNM_SIMD_SSE2: encode_u16be_sse2(d, s, n); return;
+      # endif
+      #endif
+    }
+  #pragma GCC diagnostic pop
+
+    encode_u16be_scalar(d, s, n);
+}
+
+/* Read `size` big-endian words and widen them into `b`.
+ * Returns the number of words read.
+ */
+static
+int read_words_as_ints(FILE * f, int * b, int size) {
+    uint8_t * const tail = (uint8_t *)b + (size_t)size * (sizeof(int) - 2);
+
+    const int r = fread(tail, 2, size, f);
+    widen_u16be(b, tail, r);
+
+    return r;
+}
+
+/* Narrow `n` ints to big-endian words and write them, one block at a time.
+ */
+static
+int write_ints_as_words(FILE * f, const int * b, int n) {
+    uint8_t * block = (uint8_t *)malloc((size_t)(n < io_block_size ? n : io_block_size) * 2);
+    if (!block) { return -1; }
+
+    int r = 0;
+    for (int i = 0; i < n; i += io_block_size) {
+        const int c = (n - i < io_block_size ? n - i : io_block_size);
+        narrow_u16be(block, b + i, c);
+        r += stats_fwrite(block, 1, (size_t)c * 2, f);
+    }
+
+    free(block);
+
+    return r;
+}
+
+/* Reverse the byte order of `n` 4 byte words in place (PFM floats).
+ */
+static
+void swap_u32_scalar(uint8_t * b, int n) {
+    for (int i = 0; i < n; i++) {
+        uint8_t * p = b + 4*i;
+        const uint8_t t0 = p[0];
+        const uint8_t t1 = p[1];
+        p[0] = p[3];
+        p[1] = p[2];
+        p[2] = t1;
+        p[3] = t0;
+    }
+}
+
+#ifdef PLUMBLISM_X86
+# ifdef __SSE2__
+static
+void swap_u32_sse2(uint8_t * b, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        // Swap the bytes of each half, then the halves
+        const __m128i v = swap_u16_sse2(_mm_loadu_si128((const __m128i *)(b + 4*i)));
+        const __m128i s = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128((__m128i *)(b + 4*i), s);
+    }
+    swap_u32_scalar(b + 4*i, n - i);
+}
+# endif
+
+static __attribute__((target("avx2")))
+void swap_u32_avx2(uint8_t * b, int n) {
+    const __m256i order = _mm256_setr_epi8(
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+    );
+
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *)(b + 4*i));
+        _mm256_storeu_si256((__m256i *)(b + 4*i), _mm256_shuffle_epi8(v, order));
+    }
+    swap_u32_scalar(b + 4*i, n - i);
+}
+#endif
+
+static
+void swap_u32(uint8_t * b, int n) {
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored "-Wswitch"
+    switch (pnm_simd()) {
+      #ifdef PLUMBLISM_X86
+        case PNM_SIMD_AVX2: swap_u32_avx2(b, n); return;
+      # ifdef __SSE2__
+        case PNM_SIMD_SSE2: swap_u32_sse2(b, n); return;
+      # endif
+      #endif
+    }
+  #pragma GCC diagnostic pop
+
+    swap_u32_scalar(b, n);
+}
+
+
+// --- Bits
+/* P4 rows are packed MSB first and padded to a byte boundary.
+ * Unpacking to bytes is a table lookup per input byte,
+ *  unpacking to ints and packing are done with vector compares and sign masks.
+ */
+#define BIT_SPREAD(v) {                                 \
+    ((v) >> 7) & 1, ((v) >> 6) & 1, ((v) >> 5) & 1,    \
+    ((v) >> 4) & 1, ((v) >> 3) & 1, ((v) >> 2) & 1,    \
+    ((v) >> 1) & 1,  (v)       & 1,                     \
+}
+#define BIT_SPREAD4(v)  BIT_SPREAD(v),     BIT_SPREAD((v)+1),    BIT_SPREAD((v)+2),    BIT_SPREAD((v)+3)
+#define BIT_SPREAD16(v) BIT_SPREAD4(v),    BIT_SPREAD4((v)+4),   BIT_SPREAD4((v)+8),   BIT_SPREAD4((v)+12)
+#define BIT_SPREAD64(v) BIT_SPREAD16(v),   BIT_SPREAD16((v)+16), BIT_SPREAD16((v)+32), BIT_SPREAD16((v)+48)
+static const uint8_t bit_spread[256][8] = {
+    BIT_SPREAD64(0), BIT_SPREAD64(64), BIT_SPREAD64(128), BIT_SPREAD64(192),
+};
+#undef BIT_SPREAD64
+#undef BIT_SPREAD16
+#undef BIT_SPREAD4
+#undef BIT_SPREAD
+
+static
+void unpack_bits_u8(uint8_t * d, const uint8_t * s, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) { memcpy(d + i, bit_spread[s[i / 8]], 8); }
+    for (; i < n; i++) { d[i] = bit_spread[s[i / 8]][i % 8]; }
+}
+
+static
+void unpack_bits_scalar(int * d, const uint8_t * s, int n) {
+    for (int i = 0; i < n; i++) { d[i] = bit_spread[s[i / 8]][i % 8]; }
+}
+
+static
+void pack_bits_scalar(uint8_t * d, const int * s, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        int v = 0;
+        for (int h = 0; h < 8; h++) { v |= (s[i+h] & 0x1) << (7-h); }
+        d[i / 8] = v;
+    }
+    if (i < n) {
+        int v = 0;
+        for (int h = 0; i + h < n; h++) { v |= (s[i+h] & 0x1) << (7-h); }
+        d[i / 8] = v;
+    }
+}
+
+#ifdef PLUMBLISM_X86
+# ifdef __SSE2__
+static
+void unpack_bits_sse2(int * d, const uint8_t * s, int n) {
+    const __m128i hi = _mm_setr_epi32(0x80, 0x40, 0x20, 0x10);
+    const __m128i lo = _mm_setr_epi32(0x08, 0x04, 0x02, 0x01);
+
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m128i v = _mm_set1_epi32(s[i / 8]);
+        _mm_storeu_si128((__m128i *)(d + i + 0), _mm_srli_epi32(_mm_cmpeq_epi32(_mm_and_si128(v, hi), hi), 31));
+        _mm_storeu_si128((__m128i *)(d + i + 4), _mm_srli_epi32(_mm_cmpeq_epi32(_mm_and_si128(v, lo), lo), 31));
+    }
+    unpack_bits_scalar(d + i, s + i / 8, n - i);
+}
+
+static
+void pack_bits_sse2(uint8_t * d, const int * s, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        // Reversed, so that the first pixel lands in the top bit
+        const __m128i a = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(s + i + 0)), _MM_SHUFFLE(0, 1, 2, 3));
+        const __m128i b = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(s + i + 4)), _MM_SHUFFLE(0, 1, 2, 3));
+        d[i / 8] = (_mm_movemask_ps(_mm_castsi128_ps(_mm_slli_epi32(a, 31))) << 4)
+                 |  _mm_movemask_ps(_mm_castsi128_ps(_mm_slli_epi32(b, 31)))
+        ;
+    }
+    pack_bits_scalar(d + i / 8, s + i, n - i);
+}
+# endif
+
+static __attribute__((target("avx2")))
+void unpack_bits_avx2(int * d, const uint8_t * s, int n) {
+    const __m256i m = _mm256_setr_epi32(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256i v = _mm256_set1_epi32(s[i / 8]);
+        _mm256_storeu_si256((__m256i *)(d + i), _mm256_srli_epi32(_mm256_cmpeq_epi32(_mm256_and_si256(v, m), m), 31));
+    }
+    unpack_bits_scalar(d + i, s + i / 8, n - i);
+}
+
+static __attribute__((target("avx2")))
+void pack_bits_avx2(uint8_t * d, const int * s, int n) {
+    const __m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256i v = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i *)(s + i)), reverse);
+        d[i / 8] = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_slli_epi32(v, 31)));
+    }
+    pack_bits_scalar(d + i / 8, s + i, n - i);
+}
+#endif
+
+/* Unpack the first `n` bits of `s` into `d`.
+ */
+static
+void unpack_bits(int * d, const uint8_t * s, int n) {
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored "-Wswitch"
+    switch (pnm_simd()) {
+      #ifdef PLUMBLISM_X86
+        case PNM_SIMD_AVX2: unpack_bits_avx2(d, s, n); return;
+      # ifdef __SSE2__
+        case PNM_SIMD_SSE2: unpack_bits_sse2(d, s, n); return;
+      # endif
+      #endif
+    }
+  #pragma GCC diagnostic pop
+
+    unpack_bits_scalar(d, s, n);
+}
+
+/* Pack the lowest bit of `n` ints into `d`, zero padding the last byte.
+ */
+static
+void pack_bits(uint8_t * d, const int * s, int n) {
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored "-Wswitch"
+    switch (pnm_simd()) {
+      #ifdef PLUMBLISM_X86
+        case PNM_SIMD_AVX2: pack_bits_avx2(d, s, n); return;
+      # ifdef __SSE2__
+        case PNM_SIMD_SSE2: pack_bits_sse2(d, s, n); return;
+      # endif
+      #endif
+    }
+  #pragma GCC diagnostic pop
+
+    pack_bits_scalar(d, s, n);
+}
+
+/* `read_pnm_data` is given neither the width, which P4 needs for the padding,
+ *  nor the intensity, which tells P5 and P6 samples to be bytes or words.
+ * Whatever parses a header records both, along with the stream and the position of its data;
+ *  reads picking up from there look them up and move the position along.
+ * Every stream has a record of its own, the oldest one making room once they are all taken.
+ * A stream which was moved elsewhere in the meantime has nothing on record,
+ *  the readers go back to its first header then (see `derive_pnm_header`).
+ */
+typedef struct {
+    FILE * f;
+    long at;        // where the next read is expected to start; -1 if `f` is not seekable
+    int w;          // samples per row for PAM
+    int intensity;
+    float scale;    // PFM only
+} header_record_t;
+
+#define HEADER_RECORDS 16
+
+static __thread header_record_t header_records[HEADER_RECORDS];
+static __thread int             header_records_next;
+
+static
+header_record_t * find_pnm_header(FILE * f) {
+    for (int i = 0; i < HEADER_RECORDS; i++) {
+        if (header_records[i].f == f) { return &header_records[i]; }
+    }
+
+    return NULL;
+}
+
+static
+void record_pnm_header(FILE * f, int w, int intensity, float scale) {
+    header_record_t * record = find_pnm_header(f);
+    if (!record) {
+        record = &header_records[header_records_next];
+        header_records_next = (header_records_next + 1) % HEADER_RECORDS;
+    }
+
+    record->f         = f;
+    record->at        = ftell(f);
+    record->w         = w;
+    record->intensity = intensity;
+    record->scale     = scale;
+}
+
+static
+bool recall_pnm_header(FILE * f, int * w, int * intensity, float * scale) {
+    const header_record_t * record = find_pnm_header(f);
+    if (!record
+    ||  record->at != ftell(f)) {
+        return false;
+    }
+
+    if (w        ) { *w         = record->w        ; }
+    if (intensity) { *intensity = record->intensity; }
+    if (scale    ) { *scale     = record->scale    ; }
+
+    return true;
+}
+
+static
+void advance_pnm_header(FILE * f) {
+    header_record_t * record = find_pnm_header(f);
+    if (record) { record->at = ftell(f); }
+}
+
+/* Read P4 rows of width `w` until `size` samples are decoded,
+ *  through `unpack` (an `unpack_bits` or `unpack_bits_u8` alike).
+ */
+static
+int read_bit_rows(FILE * f, void * b, int sample_width, int size, int w, void (*unpack)(void *, const uint8_t *, int)) {
+    // No rows to speak of; a header of "P4 0 5" is still well formed
+    if (w < 1) { return 0; }
+
+    const int stride = (w + 7) / 8;
+    const int rows   = (stride < io_block_size ? io_block_size / stride : 1);
+
+    uint8_t * block = (uint8_t *)malloc((size_t)rows * stride);
+    if (!block) { return -1; }
+
+    int r = 0;
+    while (r < size) {
+        const int want = ((size - r) + w - 1) / w;
+        const int got  = fread(block, stride, want < rows ? want : rows, f);
+        if (got == 0) { break; }
+
+        for (int y = 0; y < got; y++) {
+            const int n = (size - r < w ? size - r : w);
+            unpack((char *)b + (size_t)r * sample_width, block + (size_t)y * stride, n);
+            r += n;
+        }
+    }
+
+    free(block);
+
+    return r;
+}
+
+static
+void unpack_bits_int_(void * d, const uint8_t * s, int n) {
+    unpack_bits((int *)d, s, n);
+}
+
+static
+void unpack_bits_u8_(void * d, const uint8_t * s, int n) {
+    unpack_bits_u8((uint8_t *)d, s, n);
+}
+
+static
+void unpack_bits_u16_(void * d, const uint8_t * s, int n) {
+    uint16_t * d16 = (uint16_t *)d;
+    for (int i = 0; i < n; i++) { d16[i] = bit_spread[s[i / 8]][i % 8]; }
+}
+
+
+// --- Formatting
+/* ASCII data is formatted by hand into a block, a row at a time,
+ *  and written out in large chunks, instead of an `fprintf` per sample.
+ * Numbers are converted two digits at a time from a table.
+ */
+static const char digit_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899"
+;
+
+// "-2147483648 "
+static const int format_sample_max = 12;
+
+static inline
+char * format_int(char * p, int v) {
+    unsigned u = v;
+    if (v < 0) {
+        *p++ = '-';
+        u = 0u - u;
+    }
+
+    if (u < 10) {
+        *p++ = '0' + u;
+        return p;
+    }
+    if (u < 100) {
+        memcpy(p, digit_pairs + 2 * u, 2);
+        return p + 2;
+    }
+    if (u < 1000) {
+        *p++ = '0' + u / 100;
+        memcpy(p, digit_pairs + 2 * (u % 100), 2);
+        return p + 2;
+    }
+
+    char t[10];
+    char * q = t + sizeof(t);
+    while (u >= 100) {
+        q -= 2;
+        memcpy(q, digit_pairs + 2 * (u % 100), 2);
+        u /= 100;
+    }
+    if (u < 10) {
+        *--q = '0' + u;
+    } else {
+        q -= 2;
+        memcpy(q, digit_pairs + 2 * u, 2);
+    }
+
+    const int n = t + sizeof(t) - q;
+    memcpy(p, q, n);
+    return p + n;
+}
+
+/* Row formatters; each matches what the `fprintf` based writers used to emit.
+ * `p` must have room for `format_row_max` bytes.
+ */
+static
+char * format_bit_row(char * p, const int * b, int w) {
+    for (int i = 0; i < w; i++) {
+        if ((unsigned)b[i] < 2) {
+            p[0] = '0' + b[i];
+            p[1] = ' ';
+            p += 2;
+        } else {
+            p = format_int(p, b[i]);
+            *p++ = ' ';
+        }
+    }
+    *p++ = '\n';
+
+    return p;
+}
+
+static
+char * format_gray_row(char * p, const int * b, int w) {
+    for (int i = 0; i < w; i++) {
+        p = format_int(p, b[i]);
+        *p++ = ' ';
+    }
+    *p++ = '\n';
+
+    return p;
+}
+
+static
+char * format_pix_row(char * p, const int * b, int w) {
+    for (int i = 0; i < w; i++) {
+        p = format_int(p, b[0]); *p++ = ' ';
+        p = format_int(p, b[1]); *p++ = ' ';
+        p = format_int(p, b[2]); *p++ = ' ';
+        *p++ = ' ';
+        b += 3;
+    }
+    *p++ = '\n';
+
+    return p;
+}
+
+typedef char * (*format_row_fn)(char * p, const int * b, int w);
+
+static inline
+size_t format_row_max(int w, int channels) {
+    return (size_t)w * channels * format_sample_max + w + 1;
+}
+
+static
+int write_formatted_rows(FILE * f, const int * b, int w, int h, int channels, format_row_fn format_row) {
+    const size_t row_max = format_row_max(w, channels);
+    const size_t size    = (row_max > (size_t)io_block_size ? row_max : (size_t)io_block_size);
+
+    char * block = (char *)malloc(size);
+    if (!block) { return -1; }
+
+    int r = 0;
+    char * p = block;
+    for (int y = 0; y < h; y++) {
+        if ((size_t)(block + size - p) < row_max) {
+            r += stats_fwrite(block, 1, p - block, f);
+            p = block;
+        }
+        p = format_row(p, b + (size_t)y * w * channels, w);
+    }
+    r += stats_fwrite(block, 1, p - block, f);
+
+    free(block);
+
+    return r;
+}
+
+
+// --- Readers
+static inline
+int pnm_channels(pnm_type_t type) {
+    return (type == PNM_PIX_ASCII || type == PNM_PIX_BINARY) ? 3 : 1;
+}
+
+static inline
+bool is_pnm_ascii(pnm_type_t type) {
+    return type == PNM_BIT_ASCII || type == PNM_GRE_ASCII || type == PNM_PIX_ASCII;
+}
+
+/* Parse the header fields following the magic, which is assumed to have been consumed.
+ */
+static
+int parse_pnm_header_fields(FILE * f, pnm_type_t type, int * w, int * h, int * intensity) {
+    *w = lex_field_co(f); if (*w == -1) { return -1; }
+    *h = lex_field_co(f); if (*h == -1) { return -1; }
+    if (type == PNM_BIT_ASCII
+    ||  type == PNM_BIT_BINARY) {
+        *intensity = 1;
+    } else {
+        *intensity = lex_field_co(f);
+        if (*intensity == -1) { return -1; }
+    }
+
+    return 0;
+}
+
+static
+int parse_pnm_header(FILE * f, pnm_type_t type, int * w, int * h, int * intensity) {
+    rewind(f);
+    fgetc(f);
+    fgetc(f);
+
+    if (parse_pnm_header_fields(f, type, w, h, intensity) == -1) { return -1; }
+    record_pnm_header(f, *w, *intensity, 0);
+
+    return 0;
+}
+
+/* PAM headers are lines of a keyword and a value, closed by "ENDHDR".
+ * TUPLTYPE may be repeated, its values are joined with spaces.
+ */
+static
+int parse_pam_int(const char * s) {
+    char * end;
+    const long v = strtol(s, &end, 10);
+    if (end == s
+    ||  *end != '\0'
+    ||  v < 1
+    ||  v > INT_MAX) {
+        return -1;
+    }
+
+    return v;
+}
+
+static
+int parse_pam_header_fields(FILE * f, pnm_pam_t * pam) {
+    pam->w     = -1;
+    pam->h     = -1;
+    pam->depth = -1;
+    pam->maxval = -1;
+    pam->tuple_type[0] = '\0';
+
+    char line[sizeof(pam->tuple_type) + 16];
+    for (;;) {
+        int n = 0;
+        int c;
+        while ((c = fgetc(f)) != EOF && c != '\n') {
+            if (n == (int)sizeof(line) - 1) { return -1; }
+            line[n++] = c;
+        }
+        if (c == EOF) { return -1; }
+        while (n > 0 && is_wsnl(line[n-1])) { --n; }
+        line[n] = '\0';
+
+        char * keyword = line;
+        while (is_wsnl(*keyword)) { ++keyword; }
+        if (*keyword == '#'
+        ||  *keyword == '\0') {
+            continue;
+        }
+
+        char * value = keyword;
+        while (*value != '\0' && !is_wsnl(*value)) { ++value; }
+        const size_t keyword_size = value - keyword;
+        while (is_wsnl(*value)) { ++value; }
+
+      #define IS_KEYWORD(s) (keyword_size == sizeof(s) - 1 && !memcmp(keyword, s, keyword_size))
+        if (IS_KEYWORD("ENDHDR")) {
+            break;
+        } else if (IS_KEYWORD("WIDTH")) {
+            pam->w = parse_pam_int(value);
+        } else if (IS_KEYWORD("HEIGHT")) {
+            pam->h = parse_pam_int(value);
+        } else if (IS_KEYWORD("DEPTH")) {
+            pam->depth = parse_pam_int(value);
+        } else if (IS_KEYWORD("MAXVAL")) {
+            pam->maxval = parse_pam_int(value);
+        } else if (IS_KEYWORD("TUPLTYPE")) {
+            const size_t used = strlen(pam->tuple_type);
+            const size_t more = strlen(value);
+            if (used + (used != 0) + more >= sizeof(pam->tuple_type)) { return -1; }
+            if (used != 0) { pam->tuple_type[used] = ' '; }
+            memcpy(pam->tuple_type + used + (used != 0), value, more + 1);
+        } else {
+            return -1;
+        }
+      #undef IS_KEYWORD
+    }
+
+    if (pam->w < 1
+    ||  pam->h < 1
+    ||  pam->depth < 1
+    ||  pam->maxval < 1
+    ||  pam->maxval > 65535) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static
+int parse_pam_header(FILE * f, pnm_pam_t * pam) {
+    rewind(f);
+    fgetc(f);
+    fgetc(f);
+
+    if (parse_pam_header_fields(f, pam) == -1) { return -1; }
+    // Laid out like P5, with rows of `w * depth` samples
+    record_pnm_header(f, pam->w * pam->depth, pam->maxval, 0);
+
+    return 0;
+}
+
+int read_pam_header(FILE * f, pnm_pam_t * pam) {
+    if (parse_pam_header(f, pam) == -1) { return -1; }
+
+    const long long size = (long long)pam->w * pam->h * pam->depth;
+    if (size > INT_MAX) { return -1; }
+
+    return size;
+}
+
+/* The geometry of a PNM or PAM header; `channels` is the depth for PAM.
+ * Unlike `read_pnm_header`, this puts no limit on the size of the raster,
+ *  for the callers which never hold all of it in a single buffer.
+ */
+static
+int parse_raster_header(FILE * f, pnm_type_t type, int * w, int * h, int * channels, int * intensity) {
+    if (type == PNM_PAM) {
+        pnm_pam_t pam;
+        if (parse_pam_header(f, &pam) == -1) { return -1; }
+
+        *w         = pam.w;
+        *h         = pam.h;
+        *channels  = pam.depth;
+        *intensity = pam.maxval;
+
+        return 0;
+    }
+
+    if (parse_pnm_header(f, type, w, h, intensity) == -1) { return -1; }
+    *channels = pnm_channels(type);
+
+    return 0;
+}
+
+static
+int read_pnm_header_(FILE * f, pnm_type_t type, int * w, int * h, int * intensity) {
+    int w_, h_, channels, intensity_;
+
+    if (parse_raster_header(f, type, &w_, &h_, &channels, &intensity_) == -1) { return -1; }
+
+    if (w        ) { *w         = w_        ; }
+    if (h        ) { *h         = h_        ; }
+    if (intensity) { *intensity = intensity_; }
+
+    // Too large to be held in a single buffer; see `pnm_stream_t`
+    const long long size = (long long)w_ * h_ * channels;
+    if (size > INT_MAX) { return -1; }
+
+    return size;
+}
+
+/* With nothing on record, the width and intensity of the first header of the stream,
+ *  as it was before the records; guessed from `size` where that cannot be read.
+ */
+static
+void derive_pnm_header(FILE * f, pnm_type_t type, int size, int * w, int * intensity) {
+    *w         = size;
+    *intensity = 255;
+
+    const long at = ftell(f);
+    if (at == -1) { return; }
+
+    int w_, h_, channels, intensity_;
+    if (parse_raster_header(f, type, &w_, &h_, &channels, &intensity_) != -1) {
+        // Rows of `w * depth` samples for PAM, like `parse_pam_header` records
+        if (type == PNM_PAM) { w_ *= channels; }
+        if (w_ >= 1) { *w = w_; }
+        *intensity = intensity_;
+    }
+    fseek(f, at, SEEK_SET);
+}
+
+static
+int read_pnm_bit_ascii_data(FILE * f, int * b, int size) {
+    int r = 0;
+
+    int c;
+    state_t state = INITIAL;
+    while (r < size
+    &&    (c = fgetc(f)) != EOF) {
+      #pragma GCC diagnostic push
+      #pragma GCC diagnostic ignored "-Wswitch"
+        switch (state) {
+            case INITIAL: {
+                switch (c) {
+                    case '0': case '1': {
+                        b[r++] = c - '0';
+                    } break;
+                    case WSNL: { ; } break;
+                    case '#': { STATS_ADD(comment_bytes, 1); BEGIN(IN_COMMENT); } break;
+                    default: return -1;
+                }
+            } break;
+
+            case IN_COMMENT: {
+                STATS_ADD(comment_bytes, 1);
+                if (c == '\n') { BEGIN(INITIAL); }
+            } break;
+        }
+      #pragma GCC diagnostic pop
+    }
+
+    assert(r == size);
+    return r;
+}
+
+static
+int read_pnm_bit_binary_data(FILE * f, int * b, int size, int w) {
+    const int r = read_bit_rows(f, b, sizeof(int), size, w, unpack_bits_int_);
+
+    assert(r == size);
+    return r;
+}
+
+static
+int read_pnm_gray_ascii_data(FILE * f, int * b, int size) {
+    return lex_data(f, b, size);
+}
+
+static inline
+int read_pnm_gray_binary_data(FILE * f, int * b, int size, int intensity) {
+    const int r = (intensity > 255
+                    ? read_words_as_ints(f, b, size)
+                    : read_bytes_as_ints(f, b, size)
+    );
+
+    assert(r == size);
+    return r;
+}
+
+static
+int read_pnm_pix_ascii_data(FILE * f, int * b, int size) {
+    const int i = lex_data(f, b, size);
+    return (i % 3 == 0 ? i : -2);
+}
+
+static
+int read_pnm_pix_binary_data(FILE * f, int * b, int size, int intensity) {
+    return read_pnm_gray_binary_data(f, b, size, intensity);
+}
+
+/* `read_pnm_data` for callers which already know the header.
+ */
+static
+int read_pnm_raster(FILE * f, pnm_type_t type, int * b, int size, int w, int intensity) {
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored "-Wswitch"
+    switch (type) {
+        case PNM_BIT_ASCII:  return read_pnm_bit_ascii_data(f, b, size);
+        case PNM_GRE_ASCII:  return read_pnm_gray_ascii_data(f, b, size);
+        case PNM_PIX_ASCII:  return read_pnm_pix_ascii_data(f, b, size);
+        case PNM_BIT_BINARY: return read_pnm_bit_binary_data(f, b, size, w);
+        case PNM_GRE_BINARY: return read_pnm_gray_binary_data(f, b, size, intensity);
+        case PNM_PIX_BINARY: return read_pnm_pix_binary_data(f, b, size, intensity);
+        // Laid out just like P5, only with `depth` samples per pixel
+        case PNM_PAM:        return read_pnm_gray_binary_data(f, b, size, intensity);
+    }
+  #pragma GCC diagnostic pop
+
+    return -1;
+}
+
+int read_pnm_header(FILE * f, pnm_type_t type, int * w, int * h, int * intensity) {
+    STATS_BEGIN(f);
+    const int r = read_pnm_header_(f, type, w, h, intensity);
+    STATS_END("read_pnm_header", STATS_HEADER, f, 0, 0);
+
+    return r;
+}
+
+int read_pnm_data(FILE * f, pnm_type_t type, int * b, int size) {
+    STATS_BEGIN(f);
+
+    int w = size, intensity = 255;
+    if (!recall_pnm_header(f, &w, &intensity, NULL)
+    &&  !is_pnm_ascii(type)) {
+        derive_pnm_header(f, type, size, &w, &intensity);
+    }
+
+    const int r = read_pnm_raster(f, type, b, size, w, intensity);
+    advance_pnm_header(f);
+
+    STATS_END("read_pnm_data", STATS_DATA, f, r, 0);
+
+    return r;
+}
+
+
+// --- Floats
+/* PFM is raw 4 byte floats after a three line header.
+ * The sign of the scale factor on the third line gives the byte order,
+ *  negative meaning little-endian.
+ * Floats in the host's order are moved as is, others are swapped row by row.
+ * Rows are stored bottom to top; every row gets its own `fread`/`fwrite`,
+ *  straight from or to where it belongs in the buffer.
+ */
+static inline
+int pfm_channels(pnm_type_t type) {
+    return (type == PNM_PIX_FLOAT ? 3 : 1);
+}
+
+static inline
+bool is_pfm_native(float scale) {
+  #ifdef PLUMBLISM_BIG_ENDIAN
+    return scale > 0;
+  #else
+    return scale < 0;
+  #endif
+}
+
+static
+int parse_pfm_header(FILE * f, int * w, int * h, float * scale) {
+    rewind(f);
+    fgetc(f);
+    fgetc(f);
+
+    *w = lex_field_co(f); if (*w < 1) { return -1; }
+    *h = lex_field_co(f); if (*h < 1) { return -1; }
+
+    // The scale is not an integer; it ends with a single whitespace like the rest
+    char buffer[32];
+    int n = 0;
+
+    int c;
+    while ((c = fgetc(f)) != EOF && is_wsnl(c)) { ; }
+    while (c != EOF && !is_wsnl(c)) {
+        if (n == (int)sizeof(buffer) - 1) { return -1; }
+        buffer[n++] = c;
+        c = fgetc(f);
+    }
+    buffer[n] = '\0';
+
+    char * end;
+    *scale = strtof(buffer, &end);
+    if (n == 0
+    ||  *end != '\0'
+    ||  *scale == 0) {
+        return -1;
+    }
+
+    record_pnm_header(f, *w, 0, *scale);
+
+    return 0;
+}
+
+int read_pfm_header(FILE * f, pnm_type_t type, int * w, int * h, float * scale) {
+    int w_, h_;
+    float scale_;
+
+    if (parse_pfm_header(f, &w_, &h_, &scale_) == -1) { return -1; }
+
+    if (w    ) { *w     = w_; }
+    if (h    ) { *h     = h_; }
+    if (scale) { *scale = (scale_ < 0 ? -scale_ : scale_); }
+
+    const long long size = (long long)w_ * h_ * pfm_channels(type);
+    if (size > INT_MAX) { return -1; }
+
+    return size;
+}
+
+int read_pfm_data(FILE * f, pnm_type_t type, float * b, int size) {
+    // Like `read_pnm_data`, with `derive_pnm_header` done for PFM
+    int w;
+    float scale;
+    if (!recall_pnm_header(f, &w, NULL, &scale)) {
+        w     = size / pfm_channels(type);
+        scale = -1;
+      #ifdef PLUMBLISM_BIG_ENDIAN
+        scale = 1;
+      #endif
+
+        const long at = ftell(f);
+        if (at != -1) {
+            int w_, h_;
+            float scale_;
+            if (parse_pfm_header(f, &w_, &h_, &scale_) != -1) {
+                w     = w_;
+                scale = scale_;
+            }
+            fseek(f, at, SEEK_SET);
+        }
+    }
+
+    const int row_size = w * pfm_channels(type);
+    const int rows     = (row_size > 0 ? size / row_size : 0);
+
+    int r = 0;
+    for (int y = rows - 1; y >= 0; y--) {
+        float * row = b + (size_t)y * row_size;
+        const int got = fread(row, sizeof(float), row_size, f);
+        if (!is_pfm_native(scale)) { swap_u32((uint8_t *)row, got); }
+        r += got;
+        if (got < row_size) { break; }
+    }
+    advance_pnm_header(f);
+
+    assert(r == size);
+    return r;
+}
+
+int write_pfm_file(FILE * f, pnm_type_t type, const float * b, int w, int h, float scale) {
+    if (type != PNM_GRE_FLOAT
+    &&  type != PNM_PIX_FLOAT) {
+        return -1;
+    }
+
+    if (scale < 0) { scale = -scale; }
+    if (scale == 0) { scale = 1; }
+  #ifndef PLUMBLISM_BIG_ENDIAN
+    scale = -scale;
+  #endif
+
+    // The scale is padded with leading zeros,
+    //  so that the floats of a mapped file end up aligned
+    char header[64];
+    const int prefix = snprintf(header, sizeof(header), "P%c\n%d %d\n", (type == PNM_PIX_FLOAT ? 'F' : 'f'), w, h);
+    const int number = snprintf(NULL, 0, "%.9g\n", scale);
+    const int pad    = (4 - (prefix + number) % 4) % 4;
+    snprintf(header + prefix, sizeof(header) - prefix, "%s%.*d%.9g\n",
+        (scale < 0 ? "-" : ""),
+        pad, 0,
+        (scale < 0 ? -scale : scale)
+    );
+
+    int r = fputs(header, f) == EOF ? 0 : (int)strlen(header);
+
+    const int row_size = w * pfm_channels(type);
+    for (int y = h - 1; y >= 0; y--) {
+        r += stats_fwrite(b + (size_t)y * row_size, sizeof(float), row_size, f) * sizeof(float);
+    }
+
+    return r;
+}
+
+
+// --- Mapping
+static
+size_t pnm_binary_stride(pnm_type_t type, int w, int intensity) {
+    const size_t bytes_per_sample = (intensity > 255 ? 2 : 1);
+
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored "-Wswitch"
+    switch (type) {
+        case PNM_BIT_BINARY: return ((size_t)w + 7) / 8;
+        case PNM_GRE_BINARY: return (size_t)w * bytes_per_sample;
+        case PNM_PIX_BINARY: return (size_t)w * bytes_per_sample * 3;
+        case PNM_PAM:        return (size_t)w * bytes_per_sample; // `w` times the depth
+        case PNM_GRE_FLOAT:  return (size_t)w * sizeof(float);
+        case PNM_PIX_FLOAT:  return (size_t)w * sizeof(float) * 3;
+    }
+  #pragma GCC diagnostic pop
+
+    return 0;
+}
+
+int open_pnm_map(pnm_map_t * m, const char * path) {
+  #ifdef PLUMBLISM_POSIX
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) { return -1; }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1
+    ||  st.st_size < 3) {
+        close(fd);
+        return -1;
+    }
+
+    void * map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) { return -1; }
+
+    // The header is parsed with the regular lexer, through a stream over the mapping.
+    //  (glibc does not copy the buffer, so this is cheap)
+    pnm_type_t type = PNM_FORMAT_ERROR;
+    int w = 0, h = 0, intensity = 0;
+    float scale = 0;
+    int depth = 1;
+    long offset = -1;
+    size_t stride = 0;
+
+    FILE * hf = fmemopen(map, st.st_size, "r");
+    if (!hf) { goto fail; }
+
+    // Large rasters are what mapping is for, so the geometry is not capped like by `read_pnm_header`
+    type = get_pnm_type(hf);
+    if (type == PNM_BIT_BINARY
+    ||  type == PNM_GRE_BINARY
+    ||  type == PNM_PIX_BINARY
+    ||  type == PNM_PAM) {
+        int channels;
+        if (parse_raster_header(hf, type, &w, &h, &channels, &intensity) != -1) {
+            if (type == PNM_PAM) { depth = channels; }
+            offset = ftell(hf);
+        }
+    } else
+    if (type == PNM_GRE_FLOAT
+    ||  type == PNM_PIX_FLOAT) {
+        if (parse_pfm_header(hf, &w, &h, &scale) != -1) {
+            offset = ftell(hf);
+        }
+    }
+    fclose(hf);
+
+    stride = pnm_binary_stride(type, w * depth, intensity);
+    if (offset < 0
+    ||  w < 1 || h < 1
+    ||  (long long)w * depth > INT_MAX
+    ||  (size_t)offset + stride * h > (size_t)st.st_size) {
+        goto fail;
+    }
+
+    posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    m->type      = type;
+    m->w         = w;
+    m->h         = h;
+    m->intensity = intensity;
+    m->scale     = scale;
+    m->stride    = stride;
+    m->size      = stride * h;
+    m->data      = (const unsigned char *)map + offset;
+    m->map_      = map;
+    m->map_size_ = st.st_size;
+
+    return 0;
+
+  fail:
+    munmap(map, st.st_size);
+    return -1;
+  #else
+    (void)m;
+    (void)path;
+    return -1;
+  #endif
+}
+
+const float * get_pfm_map_row(const pnm_map_t * m, int y) {
+    if ((m->type != PNM_GRE_FLOAT && m->type != PNM_PIX_FLOAT)
+    ||  !is_pfm_native(m->scale)
+    ||  y < 0
+    ||  y >= m->h) {
+        return NULL;
+    }
+
+    const unsigned char * row = m->data + (size_t)(m->h - 1 - y) * m->stride;
+    if ((uintptr_t)row % sizeof(float) != 0) { return NULL; }
+
+    return (const float *)row;
+}
+
+void close_pnm_map(pnm_map_t * m) {
+  #ifdef PLUMBLISM_POSIX
+    if (m->map_) { munmap(m->map_, m->map_size_); }
+  #endif
+    m->map_      = NULL;
+    m->map_size_ = 0;
+    m->data      = NULL;
+}
+
+
+// --- Writers
+static
+int write_pnm_bit_ascii_data(FILE * f, const int * b, int w, int h) {
+    return write_formatted_rows(f, b, w, h, 1, format_bit_row);
+}
+
+static
+int write_pnm_bit_binary_data(FILE * f, const int * b, int w, int h) {
+    // Like `read_bit_rows`
+    if (w < 1) { return 0; }
+
+    const int stride = (w + 7) / 8;
+    const int rows   = (stride < io_block_size ? io_block_size / stride : 1);
+
+    uint8_t * block = (uint8_t *)malloc((size_t)rows * stride);
+    if (!block) { return -1; }
+
+    int r = 0;
+    for (int y = 0; y < h; y += rows) {
+        const int n = (h - y < rows ? h - y : rows);
+        for (int i = 0; i < n; i++) {
+            pack_bits(block + (size_t)i * stride, b + (size_t)(y + i) * w, w);
+        }
+        r += stats_fwrite(block, stride, n, f) * stride;
+    }
+
+    free(block);
+
+    return r;
+}
+
+static
+int write_pnm_gray_ascii_data(FILE * f, const int * b, int w, int h) {
+    return write_formatted_rows(f, b, w, h, 1, format_gray_row);
+}
+
+static
+int write_pnm_gray_binary_data(FILE * f, const int * b, int w, int h, int intensity) {
+    return (intensity > 255
+            ? write_ints_as_words(f, b, w*h)
+            : write_ints_as_bytes(f, b, w*h)
+    );
+}
+
+static
+int write_pnm_pix_ascii_data(FILE * f, const int * b, int w, int h) {
+    return write_formatted_rows(f, b, w, h, 3, format_pix_row);
+}
+
+static
+int write_pnm_pix_binary_data(FILE * f, const int * b, int w, int h, int intensity) {
+    return write_pnm_gray_binary_data(f, b, w*3, h, intensity);
+}
+
+static
+int write_pnm_header(FILE * f, pnm_type_t type, int w, int h, int intensity) {
+    int r = 0;
+
+    char magic[] = "PX";
+    magic[1] = '0' + type;
+    r += (fputs(magic, f), 2);
+
+    if (type == PNM_BIT_ASCII
+    ||  type == PNM_BIT_BINARY) {
+        r += fprintf(f, "\n%d %d\n", w, h);
+    } else {
+        r += fprintf(f, "\n%d %d %d\n", w, h, intensity);
+    }
+
+    return r;
+}
+
+static
+int write_pnm_data(FILE * f, pnm_type_t type, const int * b, int w, int h, int intensity) {
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored "-Wswitch"
+    switch (type) {
+        case PNM_BIT_ASCII:  return write_pnm_bit_ascii_data   (f, b, w, h);
+        case PNM_GRE_ASCII:  return write_pnm_gray_ascii_data  (f, b, w, h);
+        case PNM_PIX_ASCII:  return write_pnm_pix_ascii_data   (f, b, w, h);
+        case PNM_BIT_BINARY: return write_pnm_bit_binary_data  (f, b, w, h);
+        case PNM_GRE_BINARY: return write_pnm_gray_binary_data (f, b, w, h, intensity);
+        case PNM_PIX_BINARY: return write_pnm_pix_binary_data  (f, b, w, h, intensity);
+    }
+  #pragma GCC diagnostic pop
+
+    return 0;
+}
+
+int write_pnm_file(FILE * f, pnm_type_t type, const int * b, int w, int h, int intensity) {
+    // PAM and PFM have headers of their own; see `write_pam_file` and `write_pfm_file`
+    if (type < PNM_BIT_ASCII
+    ||  type > PNM_PIX_BINARY) {
+        return -1;
+    }
+
+    STATS_BEGIN(f);
+
+    int r = 0;
+
+    r += write_pnm_header(f, type, w, h, intensity);
+    r += write_pnm_data(f, type, b, w, h, intensity);
+
+    STATS_END("write_pnm_file", STATS_WRITE, f, (long long)w * h * pnm_channels(type), r);
+
+    return r;
+}
+
+static
+int write_pam_header(FILE * f, const pnm_pam_t * pam) {
+    int r = fprintf(f, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL %d\n", pam->w, pam->h, pam->depth, pam->maxval);
+    if (pam->tuple_type[0] != '\0') {
+        r += fprintf(f, "TUPLTYPE %s\n", pam->tuple_type);
+    }
+    r += fprintf(f, "ENDHDR\n");
+
+    return r;
+}
+
+/* The PAM raster is written as P5 rows of `w * depth` samples.
+ */
+int write_pam_file(FILE * f, const pnm_pam_t * pam, const int * b) {
+    const int r = write_pam_header(f, pam);
+    const int e = write_pnm_gray_binary_data(f, b, pam->w * pam->depth, pam->h, pam->maxval);
+    if (e < 0) { return -1; }
+
+    return r + e;
+}
+
+
+// --- Narrow buffers
+typedef enum {
+    SAMPLE_U8,
+    SAMPLE_U16,
+} sample_kind_t;
+
+/* Narrow samples are staged through a small int buffer,
+ *  so that the int readers and writers can be reused.
+ * The stage is a multiple of 3 ints,
+ *  so a chunk never splits a PPM pixel.
+ */
+static const int stage_size = 3 * 1024;
+
+static
+void narrow_samples(void * d, sample_kind_t kind, const int * s, int n) {
+    if (kind == SAMPLE_U8) {
+        narrow_u8((uint8_t *)d, s, n);
+    } else {
+        uint16_t * d16 = (uint16_t *)d;
+        for (int i = 0; i < n; i++) { d16[i] = s[i]; }
+    }
+}
+
+static
+void widen_samples(int * d, const void * s, sample_kind_t kind, int n) {
+    if (kind == SAMPLE_U8) {
+        widen_u8(d, (const uint8_t *)s, n);
+    } else {
+        const uint16_t * s16 = (const uint16_t *)s;
+        for (int i = 0; i < n; i++) { d[i] = s16[i]; }
+    }
+}
+
+static inline
+bool is_pnm_byte_binary(pnm_type_t type) {
+    return type == PNM_GRE_BINARY || type == PNM_PIX_BINARY || type == PNM_PAM;
+}
+
+static
+int read_pnm_raster_narrow(FILE * f, pnm_type_t type, void * b, sample_kind_t kind, int size, int w, int intensity) {
+    const int sample_width = (kind == SAMPLE_U8 ? 1 : 2);
+
+    // Samples above 255 do not fit bytes, binary or ASCII alike
+    if (kind == SAMPLE_U8
+    &&  intensity > 255) {
+        return -1;
+    }
+
+    if (is_pnm_byte_binary(type)
+    &&  intensity > 255) {
+        const int r = fread(b, 2, size, f);
+        decode_u16be((uint16_t *)b, (const uint8_t *)b, r);
+        return r;
+    }
+
+    if (is_pnm_byte_binary(type)) {
+        // Bytes go straight into the destination, widened in place if need be
+        uint8_t * const tail = (uint8_t *)b + (size_t)size * (sample_width - 1);
+        const int r = fread(tail, 1, size, f);
+        if (kind == SAMPLE_U16) {
+            uint16_t * d = (uint16_t *)b;
+            for (int i = 0; i < r; i++) { d[i] = tail[i]; }
+        }
+        return r;
+    }
+
+    if (type == PNM_BIT_BINARY) {
+        return read_bit_rows(f, b, sample_width, size, w,
+            kind == SAMPLE_U8 ? unpack_bits_u8_ : unpack_bits_u16_
+        );
+    }
+
+    int stage[stage_size];
+    int r = 0;
+
+    while (r < size) {
+        const int n = (size - r < stage_size ? size - r : stage_size);
+        const int e = read_pnm_data(f, type, stage, n);
+        if (e < 0) { return e; }
+
+        narrow_samples((char *)b + (size_t)r * sample_width, kind, stage, e);
+        r += e;
+
+        if (e < n) { break; }
+    }
+
+    return r;
+}
+
+static
+int read_pnm_data_narrow(FILE * f, pnm_type_t type, void * b, sample_kind_t kind, int size) {
+    int w = size, intensity = 255;
+    if (!recall_pnm_header(f, &w, &intensity, NULL)
+    &&  !is_pnm_ascii(type)) {
+        derive_pnm_header(f, type, size, &w, &intensity);
+    }
+
+    const int r = read_pnm_raster_narrow(f, type, b, kind, size, w, intensity);
+    advance_pnm_header(f);
+
+    return r;
+}
+
+static
+int write_pnm_data_narrow(FILE * f, pnm_type_t type, const void * b, sample_kind_t kind, int w, int h, int intensity) {
+    const int sample_width = (kind == SAMPLE_U8 ? 1 : 2);
+    const int row_size     = w * pnm_channels(type);
+
+    if (kind == SAMPLE_U8
+    &&  is_pnm_byte_binary(type)
+    &&  intensity <= 255) {
+        return stats_fwrite(b, 1, (size_t)row_size * h, f);
+    }
+
+    if (kind == SAMPLE_U16
+    &&  is_pnm_byte_binary(type)
+    &&  intensity > 255) {
+        const size_t n = (size_t)row_size * h;
+
+        uint8_t * block = (uint8_t *)malloc((n < (size_t)io_block_size ? n : (size_t)io_block_size) * 2);
+        if (!block) { return -1; }
+
+        int r = 0;
+        for (size_t i = 0; i < n; i += io_block_size) {
+            const int c = (n - i < (size_t)io_block_size ? (int)(n - i) : io_block_size);
+            encode_u16be(block, (const uint16_t *)b + i, c);
+            r += stats_fwrite(block, 1, (size_t)c * 2, f);
+        }
+
+        free(block);
+
+        return r;
+    }
+
+    // Whole rows, so that PBM packing stays aligned
+    int rows = stage_size / (row_size > 0 ? row_size : 1);
+    if (rows < 1) { rows = 1; }
+
+    int * stage = (int *)malloc((size_t)rows * row_size * sizeof(int));
+    if (!stage) { return -1; }
+
+    int r = 0;
+    for (int y = 0; y < h; y += rows) {
+        const int n = (h - y < rows ? h - y : rows);
+        widen_samples(
+            stage,
+            (const char *)b + (size_t)y * row_size * sample_width,
+            kind,
+            n * row_size
+        );
+        r += write_pnm_data(f, type, stage, w, n, intensity);
+    }
+
+    free(stage);
+
+    return r;
+}
+
+static
+int write_pnm_file_narrow(FILE * f, pnm_type_t type, const void * b, sample_kind_t kind, int w, int h, int intensity) {
+    const int r = write_pnm_header(f, type, w, h, intensity);
+    const int e = write_pnm_data_narrow(f, type, b, kind, w, h, intensity);
+    if (e < 0) { return -1; }
+
+    return r + e;
+}
+
+static
+int write_pam_file_narrow(FILE * f, const pnm_pam_t * pam, const void * b, sample_kind_t kind) {
+    const int r = write_pam_header(f, pam);
+    const int e = write_pnm_data_narrow(f, PNM_GRE_BINARY, b, kind, pam->w * pam->depth, pam->h, pam->maxval);
+    if (e < 0) { return -1; }
+
+    return r + e;
+}
+
+int write_pam_file_u8(FILE * f, const pnm_pam_t * pam, const uint8_t * b) {
+    return write_pam_file_narrow(f, pam, b, SAMPLE_U8);
+}
+
+int write_pam_file_u16(FILE * f, const pnm_pam_t * pam, const uint16_t * b) {
+    return write_pam_file_narrow(f, pam, b, SAMPLE_U16);
+}
+
+int read_pnm_data_u8(FILE * f, pnm_type_t type, uint8_t * b, int size) {
+    return read_pnm_data_narrow(f, type, b, SAMPLE_U8, size);
+}
+
+int read_pnm_data_u16(FILE * f, pnm_type_t type, uint16_t * b, int size) {
+    return read_pnm_data_narrow(f, type, b, SAMPLE_U16, size);
+}
+
+int read_pnm_data_bit(FILE * f, pnm_type_t type, uint8_t * b, int w, int h) {
+    const size_t stride = ((size_t)w + 7) / 8;
+
+    if (type == PNM_BIT_BINARY) {
+        // Already in the on disk layout
+        const size_t n = fread(b, 1, stride * h, f);
+        return (n == stride * h ? w * h : -1);
+    }
+
+    if (type != PNM_BIT_ASCII) { return -1; }
+
+    int * row = (int *)malloc(w * sizeof(int));
+    if (!row) { return -1; }
+
+    int r = 0;
+    for (int y = 0; y < h; y++) {
+        const int e = read_pnm_bit_ascii_data(f, row, w);
+        if (e != w) {
+            r = -1;
+            break;
+        }
+        pack_bits(b + y * stride, row, w);
+        r += e;
+    }
+
+    free(row);
+
+    return r;
+}
+
+int write_pnm_file_u8(FILE * f, pnm_type_t type, const uint8_t * b, int w, int h, int intensity) {
+    return write_pnm_file_narrow(f, type, b, SAMPLE_U8, w, h, intensity);
+}
+
+int write_pnm_file_u16(FILE * f, pnm_type_t type, const uint16_t * b, int w, int h, int intensity) {
+    return write_pnm_file_narrow(f, type, b, SAMPLE_U16, w, h, intensity);
+}
+
+int write_pnm_file_bit(FILE * f, pnm_type_t type, const uint8_t * b, int w, int h) {
+    const size_t stride = ((size_t)w + 7) / 8;
+
+    if (type != PNM_BIT_ASCII
+    &&  type != PNM_BIT_BINARY) {
+        return -1;
+    }
+
+    int r = write_pnm_header(f, type, w, h, 1);
+
+    if (type == PNM_BIT_BINARY) {
+        r += stats_fwrite(b, 1, stride * h, f);
+        return r;
+    }
+
+    int * row = (int *)malloc(w * sizeof(int));
+    if (!row) { return -1; }
+
+    for (int y = 0; y < h; y++) {
+        unpack_bits(row, b + y * stride, w);
+        r += write_pnm_bit_ascii_data(f, row, w, 1);
+    }
+
+    free(row);
+
+    return r;
+}
+
+int pnm_sample_bits(pnm_type_t type, int intensity) {
+    if (type == PNM_BIT_ASCII
+    ||  type == PNM_BIT_BINARY) {
+        return 1;
+    }
+
+    if (((type < PNM_BIT_ASCII || type > PNM_PIX_BINARY) && type != PNM_PAM)
+    ||  intensity < 1
+    ||  intensity > 65535) {
+        return -1;
+    }
+
+    return (intensity > 255 ? 16 : 8);
+}
+
+
+// --- Layouts
+/* PPM data is decoded a stage at a time as usual,
+ *  and reshuffled into the requested layout while the stage is still in cache.
+ * `n` counts pixels here, not samples.
+ */
+static
+void place_planar_scalar(int * r, int * g, int * b, const int * s, int n) {
+    for (int i = 0; i < n; i++) {
+        r[i] = s[3*i+0];
+        g[i] = s[3*i+1];
+        b[i] = s[3*i+2];
+    }
+}
+
+static
+void place_rgba_scalar(int * d, const int * s, int n, int alpha, bool bgra) {
+    const int first = (bgra ? 2 : 0);
+    for (int i = 0; i < n; i++) {
+        d[4*i+0] = s[3*i+first];
+        d[4*i+1] = s[3*i+1];
+        d[4*i+2] = s[3*i+2-first];
+        d[4*i+3] = alpha;
+    }
+}
+
+#ifdef PLUMBLISM_X86
+# ifdef __SSE2__
+static
+void place_rgba_sse2(int * d, const int * s, int n, int alpha, bool bgra) {
+    const __m128i keep = _mm_setr_epi32(-1, -1, -1, 0);
+    const __m128i a    = _mm_setr_epi32(0, 0, 0, alpha);
+
+    int i = 0;
+    // A pixel at a time, loading one sample past it
+    for (; i + 2 <= n; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + 3*i));
+        if (bgra) { v = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 0, 1, 2)); }
+        _mm_storeu_si128((__m128i *)(d + 4*i), _mm_or_si128(_mm_and_si128(v, keep), a));
+    }
+    place_rgba_scalar(d + 4*i, s + 3*i, n - i, alpha, bgra);
+}
+# endif
+
+/* Every plane takes a third of the lanes of 3 consecutive vectors,
+ *  which are blended together and then put in order with a single permutation.
+ */
+static __attribute__((target("avx2")))
+void place_planar_avx2(int * r, int * g, int * b, const int * s, int n) {
+    const __m256i r_order = _mm256_setr_epi32(0, 3, 6, 1, 4, 7, 2, 5);
+    const __m256i g_order = _mm256_setr_epi32(1, 4, 7, 2, 5, 0, 3, 6);
+    const __m256i b_order = _mm256_setr_epi32(2, 5, 0, 3, 6, 1, 4, 7);
+
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256i a0 = _mm256_loadu_si256((const __m256i *)(s + 3*i +  0));
+        const __m256i a1 = _mm256_loadu_si256((const __m256i *)(s + 3*i +  8));
+        const __m256i a2 = _mm256_loadu_si256((const __m256i *)(s + 3*i + 16));
+
+        const __m256i rv = _mm256_blend_epi32(_mm256_blend_epi32(a0, a1, 0x92), a2, 0x24);
+        const __m256i gv = _mm256_blend_epi32(_mm256_blend_epi32(a0, a1, 0x24), a2, 0x49);
+        const __m256i bv = _mm256_blend_epi32(_mm256_blend_epi32(a0, a1, 0x49), a2, 0x92);
+
+        _mm256_storeu_si256((__m256i *)(r + i), _mm256_permutevar8x32_epi32(rv, r_order));
+        _mm256_storeu_si256((__m256i *)(g + i), _mm256_permutevar8x32_epi32(gv, g_order));
+        _mm256_storeu_si256((__m256i *)(b + i), _mm256_permutevar8x32_epi32(bv, b_order));
+    }
+    place_planar_scalar(r + i, g + i, b + i, s + 3*i, n - i);
+}
+
+static __attribute__((target("avx2")))
+void place_rgba_avx2(int * d, const int * s, int n, int alpha, bool bgra) {
+    const __m256i order = (bgra ? _mm256_setr_epi32(2, 1, 0, 0, 5, 4, 3, 0)
+                                : _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0));
+    const __m256i a     = _mm256_set1_epi32(alpha);
+
+    int i = 0;
+    // Two pixels at a time, loading two samples past them
+    for (; i + 3 <= n; i += 2) {
+        const __m256i v = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i *)(s + 3*i)), order);
+        _mm256_storeu_si256((__m256i *)(d + 4*i), _mm256_blend_epi32(v, a, 0x88));
+    }
+    place_rgba_scalar(d + 4*i, s + 3*i, n - i, alpha, bgra);
+}
+#endif
+
+static
+void place_planar(int * r, int * g, int * b, const int * s, int n) {
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored "-Wswitch"
+    switch (pnm_simd()) {
+      #ifdef PLUMBLISM_X86
+        case PNM_SIMD_AVX2: place_planar_avx2(r, g, b, s, n); return;
+      #endif
+    }
+  #pragma GCC diagnostic pop
+
+    place_planar_scalar(r, g, b, s, n);
+}
+
+static
+void place_rgba(int * d, const int * s, int n, int alpha, bool bgra) {
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored "-Wswitch"
+    switch (pnm_simd()) {
+      #ifdef PLUMBLISM_X86
+        case PNM_SIMD_AVX2: place_rgba_avx2(d, s, n, alpha, bgra); return;
+      # ifdef __SSE2__
+        case PNM_SIMD_SSE2: place_rgba_sse2(d, s, n, alpha, bgra); return;
+      # endif
+      #endif
+    }
+  #pragma GCC diagnostic pop
+
+    place_rgba_scalar(d, s, n, alpha, bgra);
+}
+
+static
+int read_pnm_data_layout_(FILE * f, pnm_type_t type, void * b, bool to_u8, int size, pnm_layout_t layout, int alpha) {
+    if (type != PNM_PIX_ASCII
+    &&  type != PNM_PIX_BINARY) {
+        return -1;
+    }
+
+    if (layout == PNM_LAYOUT_RGB) {
+        return (to_u8 ? read_pnm_data_u8(f, type, (uint8_t *)b, size)
+                      : read_pnm_data(f, type, (int *)b, size)
+        );
+    }
+
+    int w = size, intensity = 255;
+    if (!recall_pnm_header(f, &w, &intensity, NULL)
+    &&  type == PNM_PIX_BINARY) {
+        derive_pnm_header(f, type, size, &w, &intensity);
+    }
+    // Like `read_pnm_raster_narrow`
+    if (to_u8 && intensity > 255) { return -1; }
+
+    const int pixels = size / 3;
+    const bool bgra  = (layout == PNM_LAYOUT_BGRA);
+
+    int stage[stage_size];
+    int placed[stage_size / 3 * 4];
+
+    int r = 0;
+    while (r < size) {
+        const int n = (size - r < stage_size ? size - r : stage_size);
+        const int e = read_pnm_raster(f, type, stage, n, w, intensity);
+        if (e < 0) { return e; }
+
+        const int p = r / 3;    // first pixel of the stage
+        const int m = e / 3;    // and their number
+
+        if (layout == PNM_LAYOUT_PLANAR) {
+            if (to_u8) {
+                uint8_t * d = (uint8_t *)b;
+                place_planar(placed, placed + m, placed + 2*m, stage, m);
+                narrow_u8(d + 0*pixels + p, placed + 0*m, m);
+                narrow_u8(d + 1*pixels + p, placed + 1*m, m);
+                narrow_u8(d + 2*pixels + p, placed + 2*m, m);
+            } else {
+                int * d = (int *)b;
+                place_planar(d + 0*pixels + p, d + 1*pixels + p, d + 2*pixels + p, stage, m);
+            }
+        } else {
+            if (to_u8) {
+                place_rgba(placed, stage, m, alpha, bgra);
+                narrow_u8((uint8_t *)b + 4*(size_t)p, placed, 4*m);
+            } else {
+                place_rgba((int *)b + 4*(size_t)p, stage, m, alpha, bgra);
+            }
+        }
+
+        r += e;
+        if (e < n) { break; }
+    }
+    advance_pnm_header(f);
+
+    return r;
+}
+
+int read_pnm_data_layout(FILE * f, pnm_type_t type, int * b, int size, pnm_layout_t layout, int alpha) {
+    return read_pnm_data_layout_(f, type, b, false, size, layout, alpha);
+}
+
+int read_pnm_data_layout_u8(FILE * f, pnm_type_t type, uint8_t * b, int size, pnm_layout_t layout, int alpha) {
+    return read_pnm_data_layout_(f, type, b, true, size, layout, alpha);
+}
+
+
+// --- Regions
+/* Binary rows have a fixed length, so the bytes of a rectangle can be found
+ *  from the header length alone.
+ * Only those are read, a row at a time, with `pread(2)`;
+ *  this leaves the stdio buffer of `f` alone.
+ * Streams without a descriptor (e.g. `fmemopen(3)`) are seeked instead.
+ */
+typedef struct {
+    pnm_type_t type;
+    int w;
+    int h;
+    int channels;
+    int sample_width;   // in bytes; 0 for PBM
+    size_t stride;
+} raster_geometry_t;
+
+static
+void set_raster_geometry(raster_geometry_t * g, pnm_type_t type, int w, int h, int channels, int intensity) {
+    g->type         = type;
+    g->w            = w;
+    g->h            = h;
+    g->channels     = channels;
+    g->sample_width = (type == PNM_BIT_BINARY ? 0 : (intensity > 255 ? 2 : 1));
+    g->stride       = pnm_binary_stride(type, (type == PNM_PAM ? w * channels : w), intensity);
+}
+
+static
+bool is_region_inside(const raster_geometry_t * g, int x, int y, int w, int h) {
+    return x >= 0 && y >= 0
+        && w >= 1 && h >= 1
+        && x <= g->w - w
+        && y <= g->h - h
+    ;
+}
+
+static inline
+size_t region_first_byte(const raster_geometry_t * g, int x) {
+    return (g->type == PNM_BIT_BINARY ? (size_t)x / 8
+                                      : (size_t)x * g->channels * g->sample_width
+    );
+}
+
+static inline
+size_t region_row_length(const raster_geometry_t * g, int x, int w) {
+    return (g->type == PNM_BIT_BINARY ? (size_t)(x + w - 1) / 8 - x / 8 + 1
+                                      : (size_t)w * g->channels * g->sample_width
+    );
+}
+
+/* `s` points to the first byte of the region inside the row.
+ */
+static
+void decode_region_row(const raster_geometry_t * g, const uint8_t * s, int x, int w, int * d) {
+    if (g->type == PNM_BIT_BINARY) {
+        const int o = x % 8;
+        if (o == 0) {
+            unpack_bits(d, s, w);
+        } else {
+            for (int i = 0; i < w; i++) { d[i] = bit_spread[s[(i + o) / 8]][(i + o) % 8]; }
+        }
+        return;
+    }
+
+    const int n = w * g->channels;
+    if (g->sample_width == 2) {
+        widen_u16be(d, s, n);
+    } else {
+        widen_u8(d, s, n);
+    }
+}
+
+static
+bool read_at(FILE * f, void * d, size_t n, long long at) {
+  #ifdef PLUMBLISM_POSIX
+    const int fd = fileno(f);
+    if (fd != -1) {
+        return pread(fd, d, n, (off_t)at) == (ssize_t)n;
+    }
+  #endif
+    return fseek(f, (long)at, SEEK_SET) == 0
+        && fread(d, 1, n, f) == n
+    ;
+}
+
+int read_pnm_region(FILE * f, pnm_type_t type, int * b, int x, int y, int w, int h) {
+    if (type != PNM_PAM
+    &&  type != PNM_BIT_BINARY
+    &&  type != PNM_GRE_BINARY
+    &&  type != PNM_PIX_BINARY) {
+        return -1;
+    }
+
+    // The image itself may well be too large for `read_pnm_header`
+    int w_, h_, channels, intensity;
+    if (parse_raster_header(f, type, &w_, &h_, &channels, &intensity) == -1) { return -1; }
+
+    raster_geometry_t g;
+    set_raster_geometry(&g, type, w_, h_, channels, intensity);
+
+    const long offset = ftell(f);
+    if (offset == -1
+    ||  !is_region_inside(&g, x, y, w, h)) {
+        return -1;
+    }
+
+    const size_t first  = region_first_byte(&g, x);
+    const size_t length = region_row_length(&g, x, w);
+
+    uint8_t * row = (uint8_t *)malloc(length);
+    if (!row) { return -1; }
+
+    int r = 0;
+    for (int j = 0; j < h; j++) {
+        const long long at = offset + (long long)(y + j) * g.stride + first;
+        if (!read_at(f, row, length, at)) {
+            r = -1;
+            break;
+        }
+        decode_region_row(&g, row, x, w, b + (size_t)j * w * g.channels);
+        r += w * g.channels;
+    }
+
+    free(row);
+
+    return r;
+}
+
+int read_pnm_map_region(const pnm_map_t * m, int * b, int x, int y, int w, int h) {
+    if (m->type != PNM_BIT_BINARY
+    &&  m->type != PNM_GRE_BINARY
+    &&  m->type != PNM_PIX_BINARY
+    &&  m->type != PNM_PAM) {
+        return -1;
+    }
+
+    // The depth of a PAM is only known through the stride
+    const int sample_width = (m->intensity > 255 ? 2 : 1);
+    const int channels     = (m->type == PNM_PAM ? (int)(m->stride / ((size_t)m->w * sample_width))
+                                                 : pnm_channels(m->type)
+    );
+
+    raster_geometry_t g;
+    set_raster_geometry(&g, m->type, m->w, m->h, channels, m->intensity);
+    if (!is_region_inside(&g, x, y, w, h)) { return -1; }
+
+    const size_t first = region_first_byte(&g, x);
+    for (int j = 0; j < h; j++) {
+        decode_region_row(&g, m->data + (size_t)(y + j) * m->stride + first, x, w, b + (size_t)j * w * channels);
+    }
+
+    return w * h * channels;
+}
+
+
+// --- Streaming
+int open_pnm_reader(pnm_stream_t * s, FILE * f) {
+    const pnm_type_t type = get_pnm_type(f);
+    if (type < PNM_BIT_ASCII
+    ||  type > PNM_PIX_BINARY) {
+        return -1;
+    }
+
+    int w, h, intensity;
+    if (parse_pnm_header(f, type, &w, &h, &intensity) == -1
+    ||  w < 1
+    ||  h < 1) {
+        return -1;
+    }
+
+    s->f         = f;
+    s->type      = type;
+    s->w         = w;
+    s->h         = h;
+    s->intensity = intensity;
+    s->y         = 0;
+
+    return 0;
+}
+
+int read_pnm_rows(pnm_stream_t * s, int * b, int n) {
+    if (n > s->h - s->y) { n = s->h - s->y; }
+    if (n <= 0) { return 0; }
+
+    const int size = s->w * pnm_channels(s->type) * n;
+
+    STATS_BEGIN(s->f);
+    int r = read_pnm_raster(s->f, s->type, b, size, s->w, s->intensity);
+    STATS_END("read_pnm_rows", STATS_DATA, s->f, r, 0);
+    if (r < 0) { return -1; }
+
+    r /= s->w * pnm_channels(s->type);
+    s->y += r;
+
+    return r;
+}
+
+int open_pnm_writer(pnm_stream_t * s, FILE * f, pnm_type_t type, int w, int h, int intensity) {
+    if (type < PNM_BIT_ASCII
+    ||  type > PNM_PIX_BINARY) {
+        return -1;
+    }
+
+    s->f         = f;
+    s->type      = type;
+    s->w         = w;
+    s->h         = h;
+    s->intensity = intensity;
+    s->y         = 0;
+
+    return write_pnm_header(f, type, w, h, intensity);
+}
+
+int write_pnm_rows(pnm_stream_t * s, const int * b, int n) {
+    if (n > s->h - s->y) { n = s->h - s->y; }
+    if (n <= 0) { return 0; }
+
+    STATS_BEGIN(s->f);
+    const int e = write_pnm_data(s->f, s->type, b, s->w, n, s->intensity);
+    STATS_END("write_pnm_rows", STATS_WRITE, s->f, (long long)s->w * pnm_channels(s->type) * n, e);
+    if (e < 0) { return -1; }
+    s->y += n;
+
+    return n;
+}
+
+
+// --- Transcoding
+/* Rows flow from the tokenizer (or the binary readers) through the optional stages
+ *  straight into the formatter, a block of rows at a time,
+ *  so memory use does not depend on the size of the image.
+ * Rescaling goes through a table whenever the input intensity fits 16 bits.
+ */
+static
+void reduce_to_luma(int * b, int n) {
+    // BT.601 weights in 16 bit fixed point; they add up to 1 << 16
+    for (int i = 0; i < n; i++) {
+        const uint32_t r = b[3*i+0];
+        const uint32_t g = b[3*i+1];
+        const uint32_t l = b[3*i+2];
+        b[i] = (r * 19595u + g * 38470u + l * 7471u + 32768u) >> 16;
+    }
+}
+
+static
+void expand_from_gray(int * b, int n) {
+    // Back to front, so that no sample is overwritten before it is read
+    for (int i = n - 1; i >= 0; i--) {
+        const int v = b[i];
+        b[3*i+2] = v;
+        b[3*i+1] = v;
+        b[3*i+0] = v;
+    }
+}
+
+static inline
+int rescale_sample(int v, int from, int to) {
+    if (v < 0)    { v = 0; }
+    if (v > from) { v = from; }
+    return ((long long)v * to + from / 2) / from;
+}
+
+int transcode_pnm(FILE * in, FILE * out, pnm_type_t type, int intensity) {
+    pnm_stream_t s;
+    pnm_stream_t o;
+
+    if (type < PNM_BIT_ASCII
+    ||  type > PNM_PIX_BINARY
+    ||  open_pnm_reader(&s, in) == -1) {
+        return -1;
+    }
+
+    const bool in_bits  = (s.type == PNM_BIT_ASCII || s.type == PNM_BIT_BINARY);
+    const bool out_bits = (type   == PNM_BIT_ASCII || type   == PNM_BIT_BINARY);
+    if (in_bits != out_bits) { return -1; }
+
+    // Nothing to rescale from; see `rescale_sample`
+    if (s.intensity < 1) { return -1; }
+
+    if (intensity < 1) { intensity = s.intensity; }
+    if (out_bits)      { intensity = 1; }
+
+    const int in_channels  = pnm_channels(s.type);
+    const int out_channels = pnm_channels(type);
+    const int row_size     = s.w * (in_channels > out_channels ? in_channels : out_channels);
+    const bool rescale     = (!out_bits && intensity != s.intensity);
+
+    int rows = io_block_size / row_size;
+    if (rows < 1) { rows = 1; }
+
+    int * block = (int *)malloc((size_t)rows * row_size * sizeof(int));
+    uint16_t * table = NULL;
+    if (rescale
+    &&  s.intensity <= 65535
+    &&  intensity   <= 65535) {
+        table = (uint16_t *)malloc(((size_t)s.intensity + 1) * sizeof(uint16_t));
+        if (table) {
+            for (int v = 0; v <= s.intensity; v++) { table[v] = rescale_sample(v, s.intensity, intensity); }
+        }
+    }
+
+    int r = -1;
+    if (!block
+    ||  open_pnm_writer(&o, out, type, s.w, s.h, intensity) < 0) {
+        goto end;
+    }
+
+    int n;
+    while ((n = read_pnm_rows(&s, block, rows)) > 0) {
+        const int pixels = n * s.w;
+
+        if (in_channels == 3 && out_channels == 1) { reduce_to_luma(block, pixels); }
+        if (in_channels == 1 && out_channels == 3) { expand_from_gray(block, pixels); }
+
+        if (rescale) {
+            const int samples = pixels * out_channels;
+            if (table) {
+                for (int i = 0; i < samples; i++) {
+                    int v = block[i];
+                    if (v < 0)           { v = 0; }
+                    if (v > s.intensity) { v = s.intensity; }
+                    block[i] = table[v];
+                }
+            } else {
+                for (int i = 0; i < samples; i++) { block[i] = rescale_sample(block[i], s.intensity, intensity); }
+            }
+        }
+
+        if (write_pnm_rows(&o, block, n) != n) { goto end; }
+    }
+
+    // Anything short of the whole image means the input was truncated
+    r = (n == 0 && s.y == s.h ? 0 : -1);
+
+  end:
+    free(block);
+    free(table);
+
+    return r;
+}
+
+
+// --- Images
+/* An image is its header fields and its samples in one allocation,
+ *  the samples starting at the next cache line after the struct.
+ * A decoder keeps one image around and only reallocates it to grow.
+ */
+static const size_t image_header_size = (sizeof(pnm_image_t) + 63) & ~(size_t)63;
+
+static
+void * default_alloc(void * user, size_t size) {
+    (void)user;
+    return malloc(size);
+}
+
+static
+void default_free(void * user, void * p, size_t size) {
+    (void)user;
+    (void)size;
+    free(p);
+}
+
+static const pnm_allocator_t default_allocator = {
+    default_alloc,
+    default_free,
+    NULL,
+};
+
+/* Parse whichever header `f` starts with.
+ * Returns the storage requirement in ints.
+ */
+static
+int read_image_header(FILE * f, pnm_image_t * image) {
+    rewind(f);
+    const pnm_type_t type = get_pnm_type(f);
+
+    int size;
+    if (type == PNM_PAM) {
+        pnm_pam_t pam;
+        size = read_pam_header(f, &pam);
+        if (size == -1) { return -1; }
+        image->w         = pam.w;
+        image->h         = pam.h;
+        image->intensity = pam.maxval;
+        image->channels  = pam.depth;
+    } else
+    if (type >= PNM_BIT_ASCII
+    &&  type <= PNM_PIX_BINARY) {
+        size = read_pnm_header(f, type, &image->w, &image->h, &image->intensity);
+        if (size == -1) { return -1; }
+        image->channels = pnm_channels(type);
+    } else {
+        return -1;
+    }
+
+    image->type   = type;
+    image->stride = image->w * image->channels;
+    image->size   = size;
+
+    return size;
+}
+
+static
+pnm_image_t * allocate_pnm_image(const pnm_allocator_t * allocator, int size) {
+    const size_t capacity = image_header_size + (size_t)size * sizeof(int);
+
+    pnm_image_t * image = (pnm_image_t *)allocator->alloc(allocator->user, capacity);
+    if (!image) { return NULL; }
+
+    memset(image, 0, sizeof(*image));
+    image->data      = (int *)((char *)image + image_header_size);
+    image->capacity_ = capacity;
+
+    return image;
+}
+
+static
+pnm_error_t load_image(pnm_image_t ** image, FILE * f, const pnm_allocator_t * allocator) {
+    if (!allocator) { allocator = &default_allocator; }
+
+    pnm_image_t header;
+    const int size = read_image_header(f, &header);
+    if (size == -1) { return PNM_ERROR_HEADER; }
+
+    pnm_image_t * r = allocate_pnm_image(allocator, size);
+    if (!r) { return PNM_ERROR_MEMORY; }
+
+    int * const data = r->data;
+    const size_t capacity = r->capacity_;
+    *r = header;
+    r->data      = data;
+    r->capacity_ = capacity;
+
+    if (read_pnm_data(f, r->type, r->data, size) != size) {
+        allocator->free(allocator->user, r, r->capacity_);
+        return PNM_ERROR_DATA;
+    }
+
+    *image = r;
+
+    return PNM_OK;
+}
+
+int load_pnm_image(pnm_image_t ** image, FILE * f, const pnm_allocator_t * allocator) {
+    if (load_image(image, f, allocator) != PNM_OK) { return -1; }
+
+    return (*image)->size;
+}
+
+void free_pnm_image(pnm_image_t * image, const pnm_allocator_t * allocator) {
+    if (!image) { return; }
+    if (!allocator) { allocator = &default_allocator; }
+
+    allocator->free(allocator->user, image, image->capacity_);
+}
+
+void init_pnm_decoder(pnm_decoder_t * d, const pnm_allocator_t * allocator) {
+    d->allocator = (allocator ? *allocator : default_allocator);
+    d->image     = NULL;
+}
+
+int decode_pnm_image(pnm_decoder_t * d, FILE * f) {
+    reset_pnm_decoder(d);
+
+    pnm_image_t header;
+    const int size = read_image_header(f, &header);
+    if (size == -1) { return -1; }
+
+    const size_t capacity = image_header_size + (size_t)size * sizeof(int);
+    if (!d->image
+    ||  d->image->capacity_ < capacity) {
+        free_pnm_image(d->image, &d->allocator);
+        d->image = allocate_pnm_image(&d->allocator, size);
+        if (!d->image) { return -1; }
+    }
+
+    pnm_image_t * image = d->image;
+    int * const data = image->data;
+    const size_t kept = image->capacity_;
+    *image = header;
+    image->data      = data;
+    image->capacity_ = kept;
+
+    if (read_pnm_data(f, image->type, image->data, size) != size) {
+        reset_pnm_decoder(d);
+        return -1;
+    }
+
+    return size;
+}
+
+void reset_pnm_decoder(pnm_decoder_t * d) {
+    if (!d->image) { return; }
+
+    pnm_image_t * image = d->image;
+    image->type      = PNM_FORMAT_ERROR;
+    image->w         = 0;
+    image->h         = 0;
+    image->intensity = 0;
+    image->channels  = 0;
+    image->stride    = 0;
+    image->size      = 0;
+}
+
+void free_pnm_decoder(pnm_decoder_t * d) {
+    free_pnm_image(d->image, &d->allocator);
+    d->image = NULL;
+}
+
+
+// --- Parallel decoding
+/* ASCII data is split into chunks right after newlines;
+ *  a newline is never inside a number and always ends a comment,
+ *  so every chunk can be lexed on its own.
+ * A first pass counts the samples of each chunk,
+ *  a prefix sum over the counts gives each chunk its place in `b`,
+ *  and a second pass decodes the chunks straight into it.
+ * Small inputs are not worth the threads and are read as usual.
+ */
+#ifdef PLUMBLISM_THREADS
+static const size_t parallel_chunk_min = 1 << 20;
+
+typedef struct {
+    pnm_type_t type;
+    const char * s;
+    const char * e;
+    bool is_last;
+    int * b;
+    int n;
+    bool invalid;
+    const char * stop;
+} lex_chunk_t;
+
+static
+int pnm_thread_count(int threads) {
+    if (threads < 1) {
+        const long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (n > 0 ? n : 1);
+    }
+    return threads;
+}
+
+/* Run `fn` over `n` consecutive `arg_size` sized arguments,
+ *  one thread each, the first one on the calling thread.
+ */
+static
+int run_parallel(void * (*fn)(void *), void * args, size_t arg_size, int n) {
+    pthread_t * threads = (pthread_t *)malloc(n * sizeof(pthread_t));
+    if (!threads) { return -1; }
+
+    int started = 1;
+    for (; started < n; started++) {
+        if (pthread_create(&threads[started], NULL, fn, (char *)args + started * arg_size)) {
+            break;
+        }
+    }
+
+    fn(args);
+    // Whatever could not get a thread runs here too
+    for (int i = started; i < n; i++) { fn((char *)args + i * arg_size); }
+
+    for (int i = 1; i < started; i++) { pthread_join(threads[i], NULL); }
+
+    free(threads);
+
+    return 0;
+}
+
+/* Count the samples in `[s, e)`,
+ *  stopping at the first byte which can not be part of the data.
+ */
+static
+void * lex_chunk_count(void * arg) {
+    lex_chunk_t * c = (lex_chunk_t *)arg;
+    const char * s = c->s;
+
+    int n = 0;
+    bool in_number = false;
+    while (s < c->e) {
+        if (c->type == PNM_BIT_ASCII
+        &&  (*s == '0' || *s == '1')) {
+            ++n;
+        } else
+        if (is_digit(*s)) {
+            if (!in_number) {
+                ++n;
+                in_number = true;
+            }
+        } else
+        if (is_wsnl(*s)) {
+            in_number = false;
+        } else
+        if (*s == '#' && !in_number) {
+            const char * nl = (const char *)memchr(s, '\n', c->e - s);
+            s = (nl ? nl : c->e);
+            continue;
+        } else {
+            c->invalid = true;
+            break;
+        }
+        ++s;
+    }
+
+    c->n = n;
+    return NULL;
+}
+
+static
+int lex_bits_memory(const char * s, const char * e, int * b, int n, const char ** stop) {
+    int r = 0;
+    while (r < n && s < e) {
+        switch (*s) {
+            case '0': case '1': {
+                b[r++] = *s - '0';
+            } break;
+            case WSNL: { ; } break;
+            case '#': {
+                const char * nl = (const char *)memchr(s, '\n', e - s);
+                s = (nl ? nl : e);
+                continue;
+            }
+            default: return -1;
+        }
+        ++s;
+    }
+
+    *stop = s;
+    return r;
+}
+
+static
+int lex_memory(const char * s, const char * e, int * b, int n, bool is_last, const char ** stop) {
+    const lex_block_fn kernel = lex_block_kernel();
+
+    int r = 0;
+    while (r < n) {
+        const lex_status_t status = kernel(s, e, b, n, &r, &s);
+
+        if (status == LEX_ERROR) { return -1; }
+        if (status == LEX_COMMENT) {
+            const char * nl = (const char *)memchr(s, '\n', e - s);
+            const char * t  = (nl ? nl + 1 : e);
+            STATS_ADD(comment_bytes, t - s);
+            s = t;
+            continue;
+        }
+        if (status == LEX_MORE) {
+            if (is_last
+            &&  s < e
+            &&  e - s < digit_buffer_size) {
+                // A number running into the end of the file
+                char tail[16];
+                memcpy(tail, s, e - s);
+                tail[e - s] = '\n';
+                const char * t;
+                if (lex_block_scalar(tail, tail + (e - s) + 1, b, n, &r, &t) == LEX_ERROR) { return -1; }
+                s = e;
+            }
+            break;
+        }
+    }
+
+    *stop = s;
+    return r;
+}
+
+static
+void * lex_chunk_decode(void * arg) {
+    lex_chunk_t * c = (lex_chunk_t *)arg;
+
+    if (c->n == 0) {
+        c->stop = c->s;
+        return NULL;
+    }
+
+    const int r = (c->type == PNM_BIT_ASCII)
+        ? lex_bits_memory(c->s, c->e, c->b, c->n, &c->stop)
+        : lex_memory(c->s, c->e, c->b, c->n, c->is_last, &c->stop)
+    ;
+    c->invalid = (r != c->n);
+
+    return NULL;
+}
+#endif
+
+static
+int read_pnm_data_parallel_(FILE * f, pnm_type_t type, int * b, int size, int threads) {
+  #ifdef PLUMBLISM_THREADS
+    if (type != PNM_BIT_ASCII
+    &&  type != PNM_GRE_ASCII
+    &&  type != PNM_PIX_ASCII) {
+        return read_pnm_data(f, type, b, size);
+    }
+
+    threads = pnm_thread_count(threads);
+    // Resolved here, so that the workers do not race on it
+    pnm_simd();
+
+    const long offset = ftell(f);
+    struct stat st;
+    if (offset == -1
+    ||  fstat(fileno(f), &st) == -1
+    ||  !S_ISREG(st.st_mode)
+    ||  st.st_size <= offset) {
+        return read_pnm_data(f, type, b, size);
+    }
+
+    const size_t length = st.st_size - offset;
+    if ((size_t)threads > length / parallel_chunk_min) { threads = length / parallel_chunk_min; }
+    if (threads < 2) { return read_pnm_data(f, type, b, size); }
+
+    const long   page    = sysconf(_SC_PAGESIZE);
+    const off_t  aligned = offset - offset % page;
+    const size_t mapped  = st.st_size - aligned;
+    void * map = mmap(NULL, mapped, PROT_READ, MAP_PRIVATE, fileno(f), aligned);
+    if (map == MAP_FAILED) { return read_pnm_data(f, type, b, size); }
+
+    const char * const data = (const char *)map + (offset - aligned);
+    const char * const end  = data + length;
+
+    lex_chunk_t * chunks = (lex_chunk_t *)calloc(threads, sizeof(lex_chunk_t));
+    if (!chunks) {
+        munmap(map, mapped);
+        return -1;
+    }
+
+    // Chunks start right after a newline
+    int n_chunks = 0;
+    const char * s = data;
+    for (int i = 0; i < threads && s < end; i++) {
+        const char * e = data + length / threads * (i + 1);
+        if (i == threads - 1
+        ||  e <= s) {
+            e = end;
+        } else {
+            const char * nl = (const char *)memchr(e, '\n', end - e);
+            e = (nl ? nl + 1 : end);
+        }
+        chunks[n_chunks].type = type;
+        chunks[n_chunks].s    = s;
+        chunks[n_chunks].e    = e;
+        ++n_chunks;
+        s = e;
+    }
+    chunks[n_chunks - 1].is_last = true;
+
+    run_parallel(lex_chunk_count, chunks, sizeof(lex_chunk_t), n_chunks);
+
+    // Prefix sum; data past the requested samples (say, another image) is left alone
+    int r = 0;
+    int used = 0;
+    bool failed = false;
+    for (; used < n_chunks && r < size; used++) {
+        lex_chunk_t * c = &chunks[used];
+        c->b = b + r;
+        if (c->n > size - r) { c->n = size - r; }
+        r += c->n;
+        if (c->invalid && r < size) {
+            failed = true;
+            break;
+        }
+        c->invalid = false;
+    }
+
+    if (!failed) {
+        run_parallel(lex_chunk_decode, chunks, sizeof(lex_chunk_t), used);
+        for (int i = 0; i < used; i++) { failed |= chunks[i].invalid; }
+    }
+
+    if (!failed) {
+        const char * stop = chunks[used - 1].stop;
+        fseek(f, offset + (stop - data), SEEK_SET);
+        advance_pnm_header(f);
+    }
+
+    free(chunks);
+    munmap(map, mapped);
+
+    if (failed) { return -1; }
+    // Like `lex_data`
+    if (r < size) { memset(b + r, 0, (size_t)(size - r) * sizeof(int)); }
+    if (type == PNM_PIX_ASCII && r % 3 != 0) { return -2; }
+
+    return r;
+  #else
+    (void)threads;
+    return read_pnm_data(f, type, b, size);
+  #endif
+}
+
+int read_pnm_data_parallel(FILE * f, pnm_type_t type, int * b, int size, int threads) {
+    STATS_BEGIN(f);
+    const int r = read_pnm_data_parallel_(f, type, b, size, threads);
+    STATS_END("read_pnm_data_parallel", STATS_DATA, f, r, 0);
+
+    return r;
+}
+
+
+// --- Parallel encoding
+/* ASCII rows are formatted in bands, one band per worker,
+ *  into buffers of their own; the bands are then written out in order,
+ *  with a single `writev` where the stream has a file descriptor behind it.
+ * Bands are capped in size, so memory does not grow with the image.
+ */
+#ifdef PLUMBLISM_THREADS
+static const size_t parallel_band_max = 4 << 20;
+
+typedef struct {
+    const int * b;
+    int w;
+    int rows;
+    int channels;
+    format_row_fn format_row;
+    char * buffer;
+    size_t length;
+} format_band_t;
+
+static
+void * format_band(void * arg) {
+    format_band_t * band = (format_band_t *)arg;
+
+    char * p = band->buffer;
+    for (int y = 0; y < band->rows; y++) {
+        p = band->format_row(p, band->b + (size_t)y * band->w * band->channels, band->w);
+    }
+    band->length = p - band->buffer;
+
+    return NULL;
+}
+
+static
+long write_bands(FILE * f, format_band_t * bands, int n) {
+    long r = 0;
+
+    const int fd = fileno(f);
+    struct iovec * iov = NULL;
+    if (fd != -1
+    &&  fflush(f) == 0
+    &&  (iov = (struct iovec *)malloc(n * sizeof(struct iovec)))) {
+        const off_t start = lseek(fd, 0, SEEK_CUR);
+        if (start != -1) {
+            for (int i = 0; i < n; i++) {
+                iov[i].iov_base = bands[i].buffer;
+                iov[i].iov_len  = bands[i].length;
+            }
+
+            // No more than `IOV_MAX` buffers go into a single call
+            long iov_max = sysconf(_SC_IOV_MAX);
+            if (iov_max < 1) { iov_max = 16; } // _XOPEN_IOV_MAX, the least POSIX allows
+
+            struct iovec * v = iov;
+            int left = n;
+            while (left > 0) {
+                const int count = (left < iov_max ? left : (int)iov_max);
+              #ifdef PLUMBLISM_STATS
+                const uint64_t start = stats_now();
+                const ssize_t e = writev(fd, v, count);
+                STATS_ADD(write_ns, stats_now() - start);
+              #else
+                const ssize_t e = writev(fd, v, count);
+              #endif
+                if (e < 0) {
+                    free(iov);
+                    return -1;
+                }
+                r += e;
+
+                // Partial write; skip what is done
+                size_t done = e;
+                while (left > 0 && done >= v->iov_len) {
+                    done -= v->iov_len;
+                    ++v;
+                    --left;
+                }
+                if (left > 0) {
+                    v->iov_base = (char *)v->iov_base + done;
+                    v->iov_len -= done;
+                }
+            }
+
+            // Let stdio know where the descriptor is now
+            fseek(f, start + r, SEEK_SET);
+            free(iov);
+            return r;
+        }
+    }
+    free(iov);
+
+    for (int i = 0; i < n; i++) {
+        r += stats_fwrite(bands[i].buffer, 1, bands[i].length, f);
+    }
+
+    return r;
+}
+#endif
+
+static
+long write_pnm_data_parallel(FILE * f, pnm_type_t type, const int * b, int w, int h, int intensity, int threads) {
+  #ifdef PLUMBLISM_THREADS
+    format_row_fn format_row;
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored "-Wswitch"
+    switch (type) {
+        case PNM_BIT_ASCII: format_row = format_bit_row;  break;
+        case PNM_GRE_ASCII: format_row = format_gray_row; break;
+        case PNM_PIX_ASCII: format_row = format_pix_row;  break;
+        default: return write_pnm_data(f, type, b, w, h, intensity);
+    }
+  #pragma GCC diagnostic pop
+
+    threads = pnm_thread_count(threads);
+    if (threads > h) { threads = h; }
+    if (threads < 2) { return write_pnm_data(f, type, b, w, h, intensity); }
+
+    const int    channels  = pnm_channels(type);
+    const size_t row_max   = format_row_max(w, channels);
+    int          band_rows = parallel_band_max / row_max;
+    if (band_rows < 1) { band_rows = 1; }
+    if ((long long)band_rows * threads > h) { band_rows = (h + threads - 1) / threads; }
+
+    format_band_t * bands = (format_band_t *)calloc(threads, sizeof(format_band_t));
+    if (!bands) { return -1; }
+
+    long r = -1;
+    for (int i = 0; i < threads; i++) {
+        bands[i].buffer = (char *)malloc(row_max * band_rows);
+        if (!bands[i].buffer) { goto end; }
+        bands[i].w          = w;
+        bands[i].channels   = channels;
+        bands[i].format_row = format_row;
+    }
+
+    r = 0;
+
+    for (int y = 0; y < h; ) {
+        int n = 0;
+        for (; n < threads && y < h; n++) {
+            bands[n].b    = b + (size_t)y * w * channels;
+            bands[n].rows = (h - y < band_rows ? h - y : band_rows);
+            y += bands[n].rows;
+        }
+
+        run_parallel(format_band, bands, sizeof(format_band_t), n);
+
+        const long e = write_bands(f, bands, n);
+        if (e < 0) {
+            r = -1;
+            goto end;
+        }
+        r += e;
+    }
+
+  end:
+    for (int i = 0; i < threads; i++) { free(bands[i].buffer); }
+    free(bands);
+
+    return r;
+  #else
+    (void)threads;
+    return write_pnm_data(f, type, b, w, h, intensity);
+  #endif
+}
+
+int write_pnm_file_parallel(FILE * f, pnm_type_t type, const int * b, int w, int h, int intensity, int threads) {
+    if (type < PNM_BIT_ASCII
+    ||  type > PNM_PIX_BINARY) {
+        return -1;
+    }
+
+    STATS_BEGIN(f);
+
+    const int  header = write_pnm_header(f, type, w, h, intensity);
+    const long data   = write_pnm_data_parallel(f, type, b, w, h, intensity, threads);
+
+    STATS_END("write_pnm_file_parallel", STATS_WRITE, f, (long long)w * h * pnm_channels(type), (data < 0 ? 0 : header + data));
+
+    if (data < 0) { return -1; }
+
+    // Counted in a `long`, which an `int` may not hold
+    return (header + data > INT_MAX ? INT_MAX : (int)(header + data));
+}
+
+int write_pnm_rows_parallel(pnm_stream_t * s, const int * b, int n, int threads) {
+    if (n > s->h - s->y) { n = s->h - s->y; }
+    if (n <= 0) { return 0; }
+
+    STATS_BEGIN(s->f);
+    const long e = write_pnm_data_parallel(s->f, s->type, b, s->w, n, s->intensity, threads);
+    STATS_END("write_pnm_rows_parallel", STATS_WRITE, s->f, (long long)s->w * pnm_channels(s->type) * n, e);
+    if (e < 0) { return -1; }
+    s->y += n;
+
+    return n;
+}
+
+
+// --- Batches
+/* Workers take the next file off a shared counter,
+ *  so a few large files do not hold up the rest.
+ */
+typedef struct {
+    pnm_batch_item_t * items;
+    int n;
+    int next;
+    const pnm_allocator_t * allocator;
+    pnm_batch_callback_t callback;
+    void * user;
+} batch_job_t;
+
+static
+void load_batch_item(pnm_batch_item_t * item, const pnm_allocator_t * allocator) {
+    item->image = NULL;
+
+    FILE * f = fopen(item->path, "r");
+    if (!f) {
+        item->error = PNM_ERROR_OPEN;
+        return;
+    }
+
+    item->error = load_image(&item->image, f, allocator);
+
+    fclose(f);
+}
+
+static
+void finish_batch_item(const batch_job_t * job, pnm_batch_item_t * item) {
+    if (job->callback) { job->callback(item, job->user); }
+}
+
+static
+void * batch_worker(void * arg) {
+    batch_job_t * job = *(batch_job_t **)arg;
+
+    int i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n) {
+        load_batch_item(&job->items[i], job->allocator);
+        finish_batch_item(job, &job->items[i]);
+    }
+
+    return NULL;
+}
+
+static
+int count_batch_loaded(const pnm_batch_item_t * items, int n) {
+    int r = 0;
+    for (int i = 0; i < n; i++) {
+        if (items[i].error == PNM_OK) { ++r; }
+    }
+    return r;
+}
+
+static
+int run_batch(batch_job_t * job, int threads) {
+    const int n = job->n;
+    batch_job_t * job_p = job;
+
+  #ifdef PLUMBLISM_THREADS
+    threads = pnm_thread_count(threads);
+    if (threads > n) { threads = n; }
+
+    if (threads > 1) {
+        // Resolved here, so that the workers do not race on it
+        pnm_simd();
+
+        batch_job_t ** workers = (batch_job_t **)malloc(threads * sizeof(batch_job_t *));
+        if (workers) {
+            for (int i = 0; i < threads; i++) { workers[i] = job; }
+            run_parallel(batch_worker, workers, sizeof(batch_job_t *), threads);
+            free(workers);
+        }
+    }
+  #else
+    (void)threads;
+  #endif
+
+    // Whatever is left (everything, without threads)
+    batch_worker(&job_p);
+
+    return count_batch_loaded(job->items, n);
+}
+
+int load_pnm_batch(pnm_batch_item_t * items, int n, int threads, const pnm_allocator_t * allocator) {
+    batch_job_t job = { items, n, 0, allocator, NULL, NULL };
+
+    return run_batch(&job, threads);
+}
+
+
+// --- Asynchronous batches
+/* The calling thread drives an io_uring instance, reading whole files into memory;
+ *  the other workers decode them from there as they arrive.
+ * The ring is set up with raw syscalls, so there is no liburing dependency.
+ * Files which could not be read this way are loaded the regular way by the decoder,
+ *  which also takes care of reporting why they fail.
+ */
+#ifdef PLUMBLISM_URING
+static const unsigned uring_depth      = 64;
+static const size_t   uring_read_limit = 1 << 30;
+
+typedef struct {
+    int fd;
+    unsigned * sq_tail;
+    unsigned sq_mask;
+    unsigned * sq_array;
+    struct io_uring_sqe * sqes;
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe * cqes;
+    // private
+    void * sq_map;
+    size_t sq_map_size;
+    void * cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+} uring_t;
+
+static
+void close_uring(uring_t * r) {
+    if (r->sqes && (void *)r->sqes != MAP_FAILED) { munmap(r->sqes, r->sqes_size); }
+    if (r->cq_map && r->cq_map != MAP_FAILED && r->cq_map != r->sq_map) {
+        munmap(r->cq_map, r->cq_map_size);
+    }
+    if (r->sq_map && r->sq_map != MAP_FAILED) { munmap(r->sq_map, r->sq_map_size); }
+    close(r->fd);
+}
+
+static
+int open_uring(uring_t * r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r,  0, sizeof(*r));
+
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) { return -1; }
+
+    r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_size = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size   = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    const bool single_map = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_map) {
+        if (r->cq_map_size > r->sq_map_size) { r->sq_map_size = r->cq_map_size; }
+        r->cq_map_size = r->sq_map_size;
+    }
+
+    r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) { goto fail; }
+
+    r->cq_map = single_map
+              ? r->sq_map
+              : mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, IORING_OFF_CQ_RING)
+    ;
+    if (r->cq_map == MAP_FAILED) { goto fail; }
+
+    r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, IORING_OFF_SQES);
+    if ((void *)r->sqes == MAP_FAILED) { goto fail; }
+
+    {
+        char * sq = (char *)r->sq_map;
+        char * cq = (char *)r->cq_map;
+        r->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+        r->sq_mask  = *(unsigned *)(sq + p.sq_off.ring_mask);
+        r->sq_array = (unsigned *)(sq + p.sq_off.array);
+        r->cq_head  = (unsigned *)(cq + p.cq_off.head);
+        r->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+        r->cq_mask  = *(unsigned *)(cq + p.cq_off.ring_mask);
+        r->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    }
+
+    return 0;
+
+  fail:
+    close_uring(r);
+    return -1;
+}
+
+/* Only the driving thread touches the rings,
+ *  so the tails it owns need no atomic read.
+ */
+static
+void push_uring_read(uring_t * r, int fd, void * b, size_t size, size_t offset, int user_data) {
+    const unsigned tail = *r->sq_tail;
+    const unsigned i    = tail & r->sq_mask;
+
+    struct io_uring_sqe * sqe = &r->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = IORING_OP_READ;
+    sqe->fd        = fd;
+    sqe->addr      = (uintptr_t)b;
+    sqe->len       = (unsigned)(size < uring_read_limit ? size : uring_read_limit);
+    sqe->off       = offset;
+    sqe->user_data = (unsigned)user_data;
+
+    r->sq_array[i] = i;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static
+int enter_uring(uring_t * r, unsigned to_submit, unsigned min_complete) {
+    for (;;) {
+        const long e = syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (e >= 0) { return 0; }
+        if (errno != EINTR
+        &&  errno != EAGAIN
+        &&  errno != EBUSY) {
+            return -1;
+        }
+    }
+}
+
+typedef struct {
+    int fd;
+    unsigned char * data;
+    size_t size;
+    size_t done;
+} uring_file_t;
+
+typedef struct {
+    batch_job_t * batch;
+    uring_file_t * files;
+    int * ready;    // indices of files read, in completion order
+    int ready_count;
+    int taken;
+    bool reads_done;
+  #ifdef PLUMBLISM_THREADS
+    pthread_mutex_t lock;
+    pthread_cond_t  arrived;
+  #endif
+} uring_job_t;
+
+static
+void lock_uring_job(uring_job_t * job) {
+  #ifdef PLUMBLISM_THREADS
+    pthread_mutex_lock(&job->lock);
+  #else
+    (void)job;
+  #endif
+}
+
+static
+void unlock_uring_job(uring_job_t * job) {
+  #ifdef PLUMBLISM_THREADS
+    pthread_mutex_unlock(&job->lock);
+  #else
+    (void)job;
+  #endif
+}
+
+static
+void put_ready(uring_job_t * job, int i) {
+    lock_uring_job(job);
+    job->ready[job->ready_count++] = i;
+  #ifdef PLUMBLISM_THREADS
+    pthread_cond_signal(&job->arrived);
+  #endif
+    unlock_uring_job(job);
+}
+
+/* Returns the index of a file ready for decoding, -1 if there is none.
+ * With `wait`, blocks until one arrives or all reads are done.
+ */
+static
+int take_ready(uring_job_t * job, bool wait) {
+    lock_uring_job(job);
+  #ifdef PLUMBLISM_THREADS
+    while (wait
+    &&     job->taken == job->ready_count
+    &&     !job->reads_done) {
+        pthread_cond_wait(&job->arrived, &job->lock);
+    }
+  #else
+    (void)wait;
+  #endif
+    const int r = (job->taken < job->ready_count ? job->ready[job->taken++] : -1);
+    unlock_uring_job(job);
+
+    return r;
+}
+
+static
+int count_ready(uring_job_t * job) {
+    lock_uring_job(job);
+    const int r = job->ready_count - job->taken;
+    unlock_uring_job(job);
+
+    return r;
+}
+
+static
+void finish_reads(uring_job_t * job) {
+    lock_uring_job(job);
+    job->reads_done = true;
+  #ifdef PLUMBLISM_THREADS
+    pthread_cond_broadcast(&job->arrived);
+  #endif
+    unlock_uring_job(job);
+}
+
+static
+void decode_uring_file(uring_job_t * job, int i) {
+    batch_job_t * batch = job->batch;
+    pnm_batch_item_t * item = &batch->items[i];
+    uring_file_t * file = &job->files[i];
+
+    FILE * f = (file->data ? fmemopen(file->data, file->size, "r") : NULL);
+    if (f) {
+        item->image = NULL;
+        item->error = load_image(&item->image, f, batch->allocator);
+        fclose(f);
+    } else {
+        load_batch_item(item, batch->allocator);
+    }
+
+    free(file->data);
+    file->data = NULL;
+
+    finish_batch_item(batch, item);
+}
+
+/* Returns whether a read was submitted for file `i`.
+ */
+static
+bool start_uring_read(uring_job_t * job, uring_t * ring, int i) {
+    uring_file_t * file = &job->files[i];
+
+    file->fd = open(job->batch->items[i].path, O_RDONLY);
+    if (file->fd == -1) { goto fail; }
+
+    struct stat st;
+    if (fstat(file->fd, &st) == -1
+    ||  !S_ISREG(st.st_mode)
+    ||  st.st_size == 0) {
+        goto fail;
+    }
+
+    file->size = st.st_size;
+    file->done = 0;
+    file->data = (unsigned char *)malloc(file->size);
+    if (!file->data) { goto fail; }
+
+    posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    push_uring_read(ring, file->fd, file->data, file->size, 0, i);
+
+    return true;
+
+  fail:
+    if (file->fd != -1) { close(file->fd); }
+    file->fd = -1;
+    put_ready(job, i);
+
+    return false;
+}
+
+/* Returns the number of files whose reads are over.
+ * Short reads are continued, counted in `queued`.
+ */
+static
+unsigned reap_uring(uring_job_t * job, uring_t * ring, unsigned * queued) {
+    unsigned r = 0;
+
+    unsigned head = *ring->cq_head;
+    const unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const struct io_uring_cqe * cqe = &ring->cqes[head & ring->cq_mask];
+        const int i = (int)cqe->user_data;
+        uring_file_t * file = &job->files[i];
+
+        if (cqe->res == -EAGAIN
+        ||  cqe->res == -EINTR) {
+            ;
+        } else
+        if (cqe->res < 0) {
+            free(file->data);
+            file->data = NULL;
+        } else
+        if (cqe->res == 0) {
+            // The file shrank under us; the decoder will complain if it matters
+            file->size = file->done;
+        } else {
+            file->done += cqe->res;
+        }
+
+        if (file->data
+        &&  file->done < file->size) {
+            push_uring_read(ring, file->fd, file->data + file->done, file->size - file->done, file->done, i);
+            ++*queued;
+        } else {
+            close(file->fd);
+            file->fd = -1;
+            put_ready(job, i);
+            ++r;
+        }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    return r;
+}
+
+static
+void drive_uring(uring_job_t * job, uring_t * ring, bool alone) {
+    const int n = job->batch->n;
+    int considered = 0;
+    unsigned queued = 0;
+    unsigned in_flight = 0;
+
+    while (considered < n || in_flight > 0) {
+        // Files read but not yet decoded count against the depth too,
+        //  which keeps memory bounded when decoding is the bottleneck
+        while (considered < n
+        &&     in_flight + count_ready(job) < uring_depth) {
+            if (start_uring_read(job, ring, considered++)) {
+                ++in_flight;
+                ++queued;
+            }
+        }
+
+        if (in_flight > 0) {
+            if (enter_uring(ring, queued, 1) == -1) {
+                // The kernel may still write into these buffers, so they are let go of;
+                //  the files get loaded the regular way
+                for (int i = 0; i < considered; i++) {
+                    uring_file_t * file = &job->files[i];
+                    if (file->fd != -1) {
+                        close(file->fd);
+                        file->fd   = -1;
+                        file->data = NULL;
+                        put_ready(job, i);
+                    }
+                }
+                in_flight = 0;
+            } else {
+                queued = 0;
+                in_flight -= reap_uring(job, ring, &queued);
+            }
+        } else
+        if (considered < n) {
+            const int i = take_ready(job, false);
+            if (i != -1) { decode_uring_file(job, i); }
+        }
+
+        if (alone) {
+            int i;
+            while ((i = take_ready(job, false)) != -1) { decode_uring_file(job, i); }
+        }
+    }
+
+    finish_reads(job);
+}
+
+typedef struct {
+    uring_job_t * job;
+    uring_t * ring;    // set for the driving worker only
+    bool alone;
+} uring_worker_t;
+
+static
+void * uring_worker(void * arg) {
+    uring_worker_t * worker = (uring_worker_t *)arg;
+
+    if (worker->ring) { drive_uring(worker->job, worker->ring, worker->alone); }
+
+    int i;
+    while ((i = take_ready(worker->job, true)) != -1) {
+        decode_uring_file(worker->job, i);
+    }
+
+    return NULL;
+}
+
+static
+int run_uring_batch(batch_job_t * batch, uring_t * ring, int threads) {
+    const int n = batch->n;
+
+    uring_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.batch = batch;
+    job.files = (uring_file_t *)calloc(n, sizeof(uring_file_t));
+    job.ready = (int *)malloc(n * sizeof(int));
+    if (!job.files || !job.ready) {
+        free(job.files);
+        free(job.ready);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) { job.files[i].fd = -1; }
+
+    uring_worker_t driver = { &job, ring, true };
+
+  #ifdef PLUMBLISM_THREADS
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.arrived, NULL);
+
+    threads = pnm_thread_count(threads);
+    if (threads > n) { threads = n; }
+
+    uring_worker_t * workers = (threads > 1 ? (uring_worker_t *)malloc(threads * sizeof(uring_worker_t)) : NULL);
+    if (workers) {
+        // Resolved here, so that the workers do not race on it
+        pnm_simd();
+
+        const uring_worker_t helper = { &job, NULL, false };
+        workers[0] = driver;
+        workers[0].alone = false;
+        for (int i = 1; i < threads; i++) {
+            workers[i] = helper;
+        }
+        if (run_parallel(uring_worker, workers, sizeof(uring_worker_t), threads) == -1) {
+            uring_worker(&driver);
+        }
+        free(workers);
+    } else {
+        uring_worker(&driver);
+    }
+
+    pthread_cond_destroy(&job.arrived);
+    pthread_mutex_destroy(&job.lock);
+  #else
+    (void)threads;
+    uring_worker(&driver);
+  #endif
+
+    free(job.files);
+    free(job.ready);
+
+    return count_batch_loaded(batch->items, n);
+}
+#endif
+
+int load_pnm_batch_async(
+    pnm_batch_item_t * items,
+    int n,
+    int threads,
+    const pnm_allocator_t * allocator,
+    pnm_batch_callback_t callback,
+    void * user
+) {
+    batch_job_t job = { items, n, 0, allocator, callback, user };
+
+  #ifdef PLUMBLISM_URING
+    uring_t ring;
+    if (n > 0
+    &&  open_uring(&ring, uring_depth) == 0) {
+        const int r = run_uring_batch(&job, &ring, threads);
+        close_uring(&ring);
+        if (r != -1) { return r; }
+    }
+  #endif
+
+    return run_batch(&job, threads);
+}
+
+
+// --- Frames
+/* Netpbm allows images to follow each other in a single stream.
+ * Binary frames are skipped over by size when indexing,
+ *  ASCII frames have to be lexed to find their end.
+ */
+static
+int parse_pnm_frame(FILE * f, pnm_frame_t * frame) {
+    int c;
+    while ((c = fgetc(f)) != EOF && is_wsnl(c)) { ; }
+    if (c == EOF) { return 0; }
+    ungetc(c, f);
+
+    frame->offset = ftell(f);
+
+    const pnm_type_t type = get_pnm_type(f);
+    if (type < PNM_BIT_ASCII
+    ||  type > PNM_PIX_BINARY) {
+        return -1;
+    }
+
+    int w, h, intensity;
+    if (parse_pnm_header_fields(f, type, &w, &h, &intensity) == -1
+    ||  w < 1
+    ||  h < 1) {
+        return -1;
+    }
+
+    frame->type        = type;
+    frame->w           = w;
+    frame->h           = h;
+    frame->intensity   = intensity;
+    frame->data_offset = ftell(f);
+    record_pnm_header(f, w, intensity, 0);
+
+    return 1;
+}
+
+int read_pnm_frame(FILE * f, pnm_frame_t * frame) {
+    const int e = parse_pnm_frame(f, frame);
+    if (e != 1) { return e; }
+
+    const long long size = (long long)frame->w * frame->h * pnm_channels(frame->type);
+    return (size > INT_MAX ? -1 : (int)size);
+}
+
+int read_pnm_frame_data(FILE * f, const pnm_frame_t * frame, int * b, int size) {
+    return read_pnm_raster(f, frame->type, b, size, frame->w, frame->intensity);
+}
+
+int read_pnm_frame_data_u8(FILE * f, const pnm_frame_t * frame, uint8_t * b, int size) {
+    return read_pnm_raster_narrow(f, frame->type, b, SAMPLE_U8, size, frame->w, frame->intensity);
+}
+
+int read_pnm_frame_data_u16(FILE * f, const pnm_frame_t * frame, uint16_t * b, int size) {
+    return read_pnm_raster_narrow(f, frame->type, b, SAMPLE_U16, size, frame->w, frame->intensity);
+}
+
+static
+int skip_pnm_frame_data(FILE * f, const pnm_frame_t * frame) {
+    if (frame->type == PNM_BIT_BINARY
+    ||  frame->type == PNM_GRE_BINARY
+    ||  frame->type == PNM_PIX_BINARY) {
+        const long long length = (long long)pnm_binary_stride(frame->type, frame->w, frame->intensity) * frame->h;
+        return fseek(f, frame->data_offset + length, SEEK_SET);
+    }
+
+    int stage[stage_size];
+    long long left = (long long)frame->w * frame->h * pnm_channels(frame->type);
+    while (left > 0) {
+        const int n = (left < stage_size ? left : stage_size);
+        if (read_pnm_data(f, frame->type, stage, n) != n) { return -1; }
+        left -= n;
+    }
+
+    return 0;
+}
+
+int index_pnm_frames(FILE * f, pnm_index_t * index) {
+    index->frames = NULL;
+    index->n      = 0;
+
+    int capacity = 0;
+    pnm_frame_t frame;
+    int e;
+    // Frames are only skipped over, so they may be of any size
+    while ((e = parse_pnm_frame(f, &frame)) != 0) {
+        if (e == -1
+        ||  skip_pnm_frame_data(f, &frame) == -1) {
+            free_pnm_index(index);
+            return -1;
+        }
+
+        if (index->n == capacity) {
+            capacity = (capacity ? capacity * 2 : 16);
+            pnm_frame_t * frames = (pnm_frame_t *)realloc(index->frames, capacity * sizeof(pnm_frame_t));
+            if (!frames) {
+                free_pnm_index(index);
+                return -1;
+            }
+            index->frames = frames;
+        }
+        index->frames[index->n++] = frame;
+    }
+
+    return index->n;
+}
+
+int seek_pnm_frame(FILE * f, const pnm_index_t * index, int k) {
+    if (k < 0
+    ||  k >= index->n) {
+        return -1;
+    }
+
+    return fseek(f, index->frames[k].data_offset, SEEK_SET);
+}
+
+void free_pnm_index(pnm_index_t * index) {
+    free(index->frames);
+    index->frames = NULL;
+    index->n      = 0;
+}
@@ -2,6 +2,8 @@
 #define PLUMBLISM_H
 
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /* Legend:
  *  PBM -> Portable Bit Map
@@ -18,6 +20,8 @@
  *  PBM  : 1 bit   : 1 int
  *  PGM  : 1 byte  : 1 int
  *  PGM  : 3 bytes : 3 int
+ * Binary PGM and PPM samples take 2 bytes (big-endian) on disk
+ *  if the intensity is above 255.
  */
 
 typedef enum {
@@ -32,6 +36,10 @@ typedef enum {
     PNM_BIT_BINARY,
     PNM_GRE_BINARY,
     PNM_PIX_BINARY,
+    PNM_PAM,
+    // PFM; the magic is a letter ("Pf" and "PF")
+    PNM_GRE_FLOAT = 'f',
+    PNM_PIX_FLOAT = 'F',
 } pnm_type_t;
 
 /* Return PNM type.
@@ -41,7 +49,8 @@ typedef enum {
 pnm_type_t get_pnm_type(FILE * f);
 
 /* Return storage requirement in number of ints (NOT bytes).
- * `f` will be rewinded automatically.
+ * `f` will be rewinded automatically, so this always reads the first image;
+ *  see `read_pnm_frame` for streams holding more than one.
  * `w`, `h` and `intensity` are nullable.
  * In case of a `PNM_BIT_*`, intensity will always be 1 (assuming success).
  */
@@ -52,14 +61,418 @@ int read_pnm_header(FILE * f, pnm_type_t type, int * w, int * h, int * intensity
  * as according to the return value of `read_pnm_header`.
  * It is assumed that `read_pnm_header` has just been called on `f`,
  *  otherwise the file position pointer is going to be misaligned.
+ * For binary types, the width and intensity are taken from that same header.
  */
 int read_pnm_data(FILE * f, pnm_type_t type, int * b, int size);
 
 /* Write from `b` to `f`.
  * In case of a `PNM_BIT_*`, intensity is ignored.
+ * PAM and PFM are written with `write_pam_file` and `write_pfm_file`.
  */
 int write_pnm_file(FILE * f, pnm_type_t type, const int * b, int w, int h, int intensity);
 
+/* Same as `read_pnm_data`, but ASCII data is decoded by `threads` workers.
+ * `threads` < 1 means one per online CPU.
+ * Falls back to `read_pnm_data` for binary types, small inputs
+ *  and streams which are not regular files.
+ */
+int read_pnm_data_parallel(FILE * f, pnm_type_t type, int * b, int size, int threads);
+
+/* Same as `write_pnm_file`, but ASCII rows are formatted by `threads` workers.
+ * `threads` < 1 means one per online CPU.
+ * The output is identical to that of `write_pnm_file`.
+ */
+int write_pnm_file_parallel(FILE * f, pnm_type_t type, const int * b, int w, int h, int intensity, int threads);
+
+/* Narrow buffer variants of the above.
+ * Memory requirements per pixel:
+ *  Type | u8      | u16     | bit
+ *  PBM  : 1 byte  : 2 bytes : 1 bit
+ *  PGM  : 1 byte  : 2 bytes : -
+ *  PPM  : 3 bytes : 6 bytes : -
+ * Use `pnm_sample_bits` to pick one after `read_pnm_header`;
+ *  reading 16 bit binary samples into u8 fails.
+ * For the u8 and u16 variants `size` is the same as for the int versions.
+ * The bit variants take PBM rows packed MSB first,
+ *  each row padded to a byte boundary (the P4 layout),
+ *  which is `(w + 7) / 8 * h` bytes.
+ */
+int read_pnm_data_u8 (FILE * f, pnm_type_t type, uint8_t  * b, int size);
+int read_pnm_data_u16(FILE * f, pnm_type_t type, uint16_t * b, int size);
+int read_pnm_data_bit(FILE * f, pnm_type_t type, uint8_t  * b, int w, int h);
+
+int write_pnm_file_u8 (FILE * f, pnm_type_t type, const uint8_t  * b, int w, int h, int intensity);
+int write_pnm_file_u16(FILE * f, pnm_type_t type, const uint16_t * b, int w, int h, int intensity);
+int write_pnm_file_bit(FILE * f, pnm_type_t type, const uint8_t  * b, int w, int h);
+
+/* Portable Arbitrary Map (P7); `depth` samples per pixel,
+ *  e.g. 4 for "RGB_ALPHA" or 2 for "GRAYSCALE_ALPHA".
+ * The raster is binary, 1 or 2 byte samples depending on `maxval`,
+ *  like P5 with rows of `w * depth` samples.
+ * It is read with `read_pnm_data` (or the narrow variants) as `PNM_PAM`,
+ *  after either `read_pam_header` or `read_pnm_header`;
+ *  the latter reports `maxval` as the intensity and counts `depth` ints per pixel.
+ * `read_pam_header` returns the storage requirement in number of ints.
+ */
+typedef struct {
+    int w;
+    int h;
+    int depth;
+    int maxval;
+    char tuple_type[256];   // empty if not given
+} pnm_pam_t;
+
+int read_pam_header(FILE * f, pnm_pam_t * pam);
+
+int write_pam_file    (FILE * f, const pnm_pam_t * pam, const int      * b);
+int write_pam_file_u8 (FILE * f, const pnm_pam_t * pam, const uint8_t  * b);
+int write_pam_file_u16(FILE * f, const pnm_pam_t * pam, const uint16_t * b);
+
+/* Portable Float Map; one (`PNM_GRE_FLOAT`) or three (`PNM_PIX_FLOAT`)
+ *  floats per pixel, not readable by the int functions above.
+ * The byte order on disk is converted where needed.
+ * Rows are stored bottom to top, but `b` is top to bottom,
+ *  like for every other type.
+ * `read_pfm_header` returns the storage requirement in number of floats,
+ *  and the absolute value of the scale factor in `scale` (nullable).
+ * `write_pfm_file` writes the floats in the host's byte order.
+ */
+int read_pfm_header(FILE * f, pnm_type_t type, int * w, int * h, float * scale);
+int read_pfm_data(FILE * f, pnm_type_t type, float * b, int size);
+int write_pfm_file(FILE * f, pnm_type_t type, const float * b, int w, int h, float scale);
+
+/* Return the narrowest sample width in bits (1, 8 or 16) able to hold
+ *  the samples of an image of `type` with `intensity`.
+ * Returns -1 if `intensity` does not fit 16 bits.
+ */
+int pnm_sample_bits(pnm_type_t type, int intensity);
+
+/* Destination layouts for decoding PPM data.
+ *  PNM_LAYOUT_RGB    : interleaved triplets; the default elsewhere
+ *  PNM_LAYOUT_PLANAR : every red sample, then every green, then every blue
+ *  PNM_LAYOUT_RGBA   : 4 samples per pixel, the last one being a constant alpha
+ *  PNM_LAYOUT_BGRA   : likewise, with red and blue swapped
+ */
+typedef enum {
+    PNM_LAYOUT_RGB,
+    PNM_LAYOUT_PLANAR,
+    PNM_LAYOUT_RGBA,
+    PNM_LAYOUT_BGRA,
+} pnm_layout_t;
+
+/* Same as `read_pnm_data` (and `read_pnm_data_u8`) for `PNM_PIX_*` types,
+ *  storing the pixels in `layout`.
+ * `size` is the return value of `read_pnm_header` either way,
+ *  but RGBA and BGRA need room for `size / 3 * 4` samples in `b`.
+ * `alpha` is ignored by the other layouts.
+ * Returns the number of samples read from `f`.
+ */
+int read_pnm_data_layout   (FILE * f, pnm_type_t type, int     * b, int size, pnm_layout_t layout, int alpha);
+int read_pnm_data_layout_u8(FILE * f, pnm_type_t type, uint8_t * b, int size, pnm_layout_t layout, int alpha);
+
+/* Row by row access, for images too large to be held in memory at once.
+ * Only a block's worth of the file is ever buffered,
+ *  so memory use is bound by what the caller passes in.
+ * Rows are `w` ints wide for PBM and PGM, `w * 3` for PPM.
+ * (For PBM binary files, `w` is the real width, not counting the padding.)
+ */
+typedef struct {
+    FILE * f;
+    pnm_type_t type;
+    int w;
+    int h;
+    int intensity;
+    int y;          // index of the next row
+} pnm_stream_t;
+
+/* Parse the header of `f` and prepare to read its rows.
+ *  It is assumed that `f` has just been opened.
+ * Returns 0 on success.
+ */
+int open_pnm_reader(pnm_stream_t * s, FILE * f);
+
+/* Read up to `n` rows into `b`.
+ * Returns the number of rows read; 0 once all of them were.
+ */
+int read_pnm_rows(pnm_stream_t * s, int * b, int n);
+
+/* Write the header of a `w` x `h` image to `f` and prepare to write its rows.
+ * Returns the amount of bytes written.
+ */
+int open_pnm_writer(pnm_stream_t * s, FILE * f, pnm_type_t type, int w, int h, int intensity);
+
+/* Write up to `n` rows from `b`; rows past `h` are ignored.
+ * Returns the number of rows written.
+ */
+int write_pnm_rows(pnm_stream_t * s, const int * b, int n);
+
+/* Same as `write_pnm_rows`, but ASCII rows are formatted by `threads` workers,
+ *  as with `write_pnm_file_parallel`.
+ */
+int write_pnm_rows_parallel(pnm_stream_t * s, const int * b, int n, int threads);
+
+/* Convert the image in `in` (which has just been opened) to `type`, writing it to `out`.
+ * Rows are streamed a block at a time, without ever holding the whole image.
+ * `intensity` < 1 keeps that of `in`, otherwise samples are rescaled to it.
+ * PPM to PGM keeps the luma (BT.601), PGM to PPM repeats the grey;
+ *  PBM can only be converted to PBM.
+ * Returns 0 on success.
+ */
+int transcode_pnm(FILE * in, FILE * out, pnm_type_t type, int intensity);
+
+/* Allocation callbacks; `free` is given back the size passed to `alloc`,
+ *  so arenas and pools do not have to keep track of it.
+ * Wherever an allocator is taken, NULL means `malloc(3)` and `free(3)`.
+ */
+typedef struct {
+    void * (*alloc)(void * user, size_t size);
+    void   (*free)(void * user, void * p, size_t size);
+    void * user;
+} pnm_allocator_t;
+
+/* An image with its header fields and samples in a single allocation.
+ * Any type read by `read_pnm_data` works (PAM included);
+ *  `channels` is 1 for PBM and PGM, 3 for PPM and the depth for PAM.
+ */
+typedef struct {
+    pnm_type_t type;
+    int w;
+    int h;
+    int intensity;
+    int channels;
+    int stride;     // ints per row
+    int size;       // ints in total
+    int * data;     // inside the same allocation
+    // private
+    size_t capacity_;
+} pnm_image_t;
+
+/* Read the whole image in `f` (which has just been opened) into a new `*image`.
+ * Returns the number of ints stored.
+ */
+int load_pnm_image(pnm_image_t ** image, FILE * f, const pnm_allocator_t * allocator);
+
+/* `allocator` must be the one `image` was loaded with.
+ */
+void free_pnm_image(pnm_image_t * image, const pnm_allocator_t * allocator);
+
+/* A decoder owns one image, which is reused by every load
+ *  and only reallocated when a larger one comes along.
+ * `image` is valid until the next call on the decoder.
+ */
+typedef struct {
+    pnm_allocator_t allocator;
+    pnm_image_t * image;
+} pnm_decoder_t;
+
+void init_pnm_decoder(pnm_decoder_t * d, const pnm_allocator_t * allocator);
+
+/* Decode `f` (which has just been opened) into `d->image`.
+ * Returns the number of ints stored.
+ */
+int decode_pnm_image(pnm_decoder_t * d, FILE * f);
+
+/* Empty `d->image`, keeping its storage for the next load.
+ */
+void reset_pnm_decoder(pnm_decoder_t * d);
+
+void free_pnm_decoder(pnm_decoder_t * d);
+
+/* Load every `items[i].path` into `items[i].image` on `threads` workers;
+ *  `threads` < 1 means one per online CPU.
+ * Images are allocated through `allocator`,
+ *  which has to be thread safe if there is more than one worker.
+ * Every item gets its own `error`; failed ones have a NULL `image`.
+ * Returns the number of images loaded.
+ */
+typedef enum {
+    PNM_OK,
+    PNM_ERROR_OPEN,     // the file could not be opened
+    PNM_ERROR_HEADER,   // not a supported type, or a malformed header
+    PNM_ERROR_MEMORY,
+    PNM_ERROR_DATA,     // truncated or malformed raster
+} pnm_error_t;
+
+typedef struct {
+    const char * path;
+    pnm_image_t * image;
+    pnm_error_t error;
+} pnm_batch_item_t;
+
+int load_pnm_batch(pnm_batch_item_t * items, int n, int threads, const pnm_allocator_t * allocator);
+
+/* Same as `load_pnm_batch`, with the files read asynchronously through io_uring
+ *  on Linux, while the other workers decode the ones which already arrived.
+ * Falls back to `load_pnm_batch` when io_uring is unavailable
+ *  (other systems, old kernels, seccomp, or built with `PLUMBLISM_NO_URING`).
+ * `callback`, unless NULL, is called from a worker as each item is finished;
+ *  items finish in no particular order, and possibly concurrently.
+ */
+typedef void (*pnm_batch_callback_t)(pnm_batch_item_t * item, void * user);
+
+int load_pnm_batch_async(
+    pnm_batch_item_t * items,
+    int n,
+    int threads,
+    const pnm_allocator_t * allocator,
+    pnm_batch_callback_t callback,
+    void * user
+);
+
+/* Netpbm streams may hold several images back to back.
+ * A frame is the header of one of them and where it is in the stream.
+ */
+typedef struct {
+    pnm_type_t type;
+    int w;
+    int h;
+    int intensity;
+    long offset;        // of the magic
+    long data_offset;   // of the first byte after the header
+} pnm_frame_t;
+
+/* Read the header of the image at the current position of `f`,
+ *  leaving `f` at its data.
+ * Whitespace in front of the magic is skipped.
+ * Returns the storage requirement like `read_pnm_header`,
+ *  or 0 at the end of the stream.
+ */
+int read_pnm_frame(FILE * f, pnm_frame_t * frame);
+
+/* Read the data of `frame` into `b`,
+ *  leaving `f` right after it (where the next frame starts).
+ * `f` must be at `frame->data_offset`.
+ * Unlike `read_pnm_data`, these take the geometry from `frame`,
+ *  so they also work after `f` was moved around in between.
+ */
+int read_pnm_frame_data    (FILE * f, const pnm_frame_t * frame, int      * b, int size);
+int read_pnm_frame_data_u8 (FILE * f, const pnm_frame_t * frame, uint8_t  * b, int size);
+int read_pnm_frame_data_u16(FILE * f, const pnm_frame_t * frame, uint16_t * b, int size);
+
+/* Byte offsets of every frame in a stream, for random access.
+ */
+typedef struct {
+    pnm_frame_t * frames;
+    int n;
+} pnm_index_t;
+
+/* Walk the stream from its current position once and index every frame in it.
+ * Binary frames are skipped by size, ASCII ones have to be lexed.
+ * Returns the number of frames.
+ */
+int index_pnm_frames(FILE * f, pnm_index_t * index);
+
+/* Position `f` at the data of frame `k`,
+ *  ready for `read_pnm_frame_data(f, &index->frames[k], ...)`.
+ * Returns 0 on success.
+ */
+int seek_pnm_frame(FILE * f, const pnm_index_t * index, int k);
+
+void free_pnm_index(pnm_index_t * index);
+
+/* Read-only view of a binary PNM file, mapped straight into memory.
+ * Rows are `stride` bytes apart; no copying or widening happens,
+ *  `data` points to the raster inside the mapping.
+ * Samples wider than a byte (intensity > 255) are big-endian, as on disk.
+ * PBM rows are packed, MSB first, padded to a byte boundary.
+ * PFM rows are bottom to top, as on disk; see `get_pfm_map_row`.
+ */
+typedef struct {
+    pnm_type_t type;
+    int w;
+    int h;
+    int intensity;
+    float scale;    // PFM only; as on disk, so negative means little-endian
+    size_t stride;
+    size_t size;    // of the raster, in bytes
+    const unsigned char * data;
+    // private
+    void * map_;
+    size_t map_size_;
+} pnm_map_t;
+
+/* Map the file at `path` and parse its header into `m`.
+ * Only `PNM_*_BINARY`, `PNM_PAM` and `PNM_*_FLOAT` types are supported,
+ *  ASCII data has no fixed layout to point into.
+ * There is no limit on the size of the raster besides the address space.
+ * Returns 0 on success.
+ */
+int open_pnm_map(pnm_map_t * m, const char * path);
+
+/* Return row `y` (counted from the top) of a mapped PFM file as floats,
+ *  without copying.
+ * Returns NULL if the floats are not in the host's byte order,
+ *  or sit misaligned behind the header (`write_pfm_file` pads it to avoid that).
+ */
+const float * get_pfm_map_row(const pnm_map_t * m, int y);
+
+/* Unmap `m`. Pointers previously taken from it are invalidated.
+ */
+void close_pnm_map(pnm_map_t * m);
+
+/* Read the `w` x `h` rectangle at (`x`, `y`) of a binary image (P4, P5, P6 or PAM) into `b`,
+ *  rows packed back to back; `w * h` ints, times 3 for PPM and the depth for PAM.
+ * Only the bytes inside the rectangle are read,
+ *  with `pread(2)` where `f` has a file descriptor.
+ * The header is parsed by the call itself;
+ *  the image may be larger than `read_pnm_header` can give a storage requirement for.
+ * Returns the number of ints stored; -1 if the rectangle is not inside the image.
+ */
+int read_pnm_region(FILE * f, pnm_type_t type, int * b, int x, int y, int w, int h);
+
+/* Same as `read_pnm_region`, decoding straight out of the mapping.
+ */
+int read_pnm_map_region(const pnm_map_t * m, int * b, int x, int y, int w, int h);
+
+/* Hot loops have vectorized kernels, picked at runtime
+ *  from what the CPU supports.
+ * `pnm_set_simd` forces a lower level; mostly useful for benchmarking.
+ * Levels the CPU does not support are clamped down.
+ * Returns the level in effect.
+ */
+typedef enum {
+    PNM_SIMD_AUTO,
+    PNM_SIMD_SCALAR,
+    PNM_SIMD_SSE2,
+    PNM_SIMD_AVX2,
+} pnm_simd_t;
+
+pnm_simd_t pnm_set_simd(pnm_simd_t level);
+
+/* Counters of what the readers and writers did, for spotting pathological inputs.
+ * They are only kept when plumblism is built with `PLUMBLISM_STATS` defined;
+ *  otherwise every counter stays zero, the callback is never called,
+ *  and the hot loops carry no trace of them.
+ * Counted calls are `read_pnm_header`, `read_pnm_data`, `read_pnm_rows`,
+ *  `write_pnm_file`, `write_pnm_rows` and their `_parallel` variants;
+ *  calls made by other calls are included in the outermost one.
+ * Comments skipped by `read_pnm_data_parallel` workers are not counted.
+ */
+typedef struct {
+    uint64_t calls;
+    uint64_t bytes_read;        // where `f` is seekable
+    uint64_t samples_read;
+    uint64_t comment_bytes;
+    uint64_t header_ns;
+    uint64_t data_ns;
+    uint64_t bytes_written;
+    uint64_t samples_written;
+    uint64_t format_ns;         // writing, less the time spent handing bytes to the stream
+    uint64_t write_ns;
+} pnm_stats_t;
+
+/* `callback` gets the counters of every call as it returns, named by `call`;
+ *  from the thread which made it. NULL removes it.
+ */
+typedef void (*pnm_stats_callback_t)(const char * call, const pnm_stats_t * stats, void * user);
+
+void set_pnm_stats_callback(pnm_stats_callback_t callback, void * user);
+
+/* Totals of every call since the start, or the last `reset_pnm_stats`.
+ */
+void get_pnm_stats(pnm_stats_t * stats);
+void reset_pnm_stats(void);
+
 /* ## Return value
  * `read_pnm_header` returns the number of bytes required to store the contents of `f`.
  * 
@@ -0,0 +1,429 @@
+#ifndef PLUMBLISM_HPP
+#define PLUMBLISM_HPP
+
+/* Header only C++ front end to plumblism.
+ * The format and the sample type are template arguments,
+ *  so what `read_pnm_data` decides at run time is decided at compile time:
+ *   pnm::reader<pnm::P6, uint8_t>::load(f)
+ *  reads straight into bytes through `read_pnm_data_u8`,
+ *  without an int buffer to be narrowed afterwards.
+ * Images held in memory (e.g. embedded in the executable)
+ *  are decoded by constexpr kernels instead, even at compile time.
+ * Errors are reported the same way as by the C functions;
+ *  -1 or an empty `std::optional`, nothing throws.
+ * Requires C++20.
+ */
+
+#include <array>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <memory>
+#include <new>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <type_traits>
+
+#include "plumblism.h"
+
+namespace pnm {
+
+// --- Formats
+template <pnm_type_t T>
+struct format {
+    static_assert(T >= PNM_BIT_ASCII && T <= PNM_PIX_BINARY, "only P1 to P6 have a fixed layout");
+
+    static constexpr pnm_type_t type     = T;
+    static constexpr bool       bitmap   = (T == PNM_BIT_ASCII || T == PNM_BIT_BINARY);
+    static constexpr bool       binary   = (T >= PNM_BIT_BINARY);
+    static constexpr int        channels = (T == PNM_PIX_ASCII || T == PNM_PIX_BINARY ? 3 : 1);
+};
+
+using P1 = format<PNM_BIT_ASCII>;
+using P2 = format<PNM_GRE_ASCII>;
+using P3 = format<PNM_PIX_ASCII>;
+using P4 = format<PNM_BIT_BINARY>;
+using P5 = format<PNM_GRE_BINARY>;
+using P6 = format<PNM_PIX_BINARY>;
+
+/* The sample types of the narrow buffer variants (see plumblism.h),
+ *  plus int for the classic ones.
+ */
+template <class S>
+concept sample = std::is_same_v<S, std::uint8_t>
+              || std::is_same_v<S, std::uint16_t>
+              || std::is_same_v<S, int>;
+
+
+// --- Headers
+struct header {
+    pnm_type_t  type;
+    int         w;
+    int         h;
+    int         maxval;     // 1 for PBM
+    std::size_t offset;     // of the raster, in bytes
+
+    constexpr int channels() const {
+        return (type == PNM_PIX_ASCII || type == PNM_PIX_BINARY ? 3 : 1);
+    }
+
+    // Same as the return value of `read_pnm_header`
+    constexpr std::size_t samples() const {
+        return static_cast<std::size_t>(w) * h * channels();
+    }
+};
+
+namespace detail {
+    constexpr bool is_wsnl(char c) {
+        return c == ' '  || c == '\t' || c == '\n'
+            || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    constexpr void skip_comment(std::string_view s, std::size_t & i) {
+        while (i < s.size() && s[i] != '\n') { ++i; }
+    }
+
+    /* Skip whitespace and comments, then read a decimal number.
+     * Returns -1 if there is none or it does not fit an int.
+     */
+    constexpr long next_number(std::string_view s, std::size_t & i) {
+        while (i < s.size()) {
+            if (is_wsnl(s[i])) {
+                ++i;
+            } else if (s[i] == '#') {
+                skip_comment(s, i);
+            } else {
+                break;
+            }
+        }
+
+        if (i == s.size()
+        ||  s[i] < '0'
+        ||  s[i] > '9') {
+            return -1;
+        }
+
+        long r = 0;
+        while (i < s.size()
+        &&     s[i] >= '0'
+        &&     s[i] <= '9') {
+            r = r * 10 + (s[i] - '0');
+            if (r > INT_MAX) { return -1; }
+            ++i;
+        }
+
+        return r;
+    }
+
+    constexpr std::uint8_t byte_at(std::string_view s, std::size_t i) {
+        return static_cast<std::uint8_t>(s[i]);
+    }
+}
+
+/* Parse the header of a P1 to P6 image held in `s`.
+ * A single whitespace must separate the header from the raster,
+ *  which begins at `offset`.
+ */
+constexpr std::optional<header> parse_header(std::string_view s) {
+    if (s.size() < 2
+    ||  s[0] != 'P'
+    ||  s[1] < '1'
+    ||  s[1] > '6') {
+        return std::nullopt;
+    }
+
+    header r{};
+    r.type = static_cast<pnm_type_t>(s[1] - '0');
+
+    std::size_t i = 2;
+    const long w = detail::next_number(s, i);
+    const long h = detail::next_number(s, i);
+    const long maxval = (r.type == PNM_BIT_ASCII || r.type == PNM_BIT_BINARY
+                        ? 1
+                        : detail::next_number(s, i)
+    );
+
+    if (w < 1
+    ||  h < 1
+    ||  maxval < 1
+    ||  maxval > 65535
+    ||  i == s.size()
+    ||  !detail::is_wsnl(s[i])) {
+        return std::nullopt;
+    }
+
+    r.w      = w;
+    r.h      = h;
+    r.maxval = maxval;
+    r.offset = i + 1;
+
+    // Too large to be held in a single buffer; see `read_pnm_header`
+    if (r.samples() > INT_MAX) { return std::nullopt; }
+
+    return r;
+}
+
+
+// --- Kernels
+/* Decode the raster of `s` (described by `h`) into `b`.
+ * Every format gets its own instantiation, with no run time dispatch.
+ * Returns the number of samples decoded or -1.
+ */
+namespace detail {
+    template <class Format, sample Sample>
+    constexpr int decode(const header & h, std::string_view s, std::span<Sample> b) {
+        const int size = h.samples();
+        if (h.type != Format::type
+        ||  b.size() < h.samples()) {
+            return -1;
+        }
+
+        std::size_t i = h.offset;
+
+        // As for `read_pnm_data_u8`, binary or ASCII alike
+        if (std::is_same_v<Sample, std::uint8_t> && h.maxval > 255) { return -1; }
+
+        if constexpr (Format::type == PNM_BIT_ASCII) {
+            int r = 0;
+            while (r < size) {
+                if (i == s.size()) { return -1; }
+                const char c = s[i++];
+                if (c == '0' || c == '1') {
+                    b[r++] = c - '0';
+                } else if (c == '#') {
+                    skip_comment(s, i);
+                } else if (!is_wsnl(c)) {
+                    return -1;
+                }
+            }
+        } else if constexpr (Format::type == PNM_GRE_ASCII
+                          || Format::type == PNM_PIX_ASCII) {
+            for (int r = 0; r < size; r++) {
+                const long v = next_number(s, i);
+                if (v < 0
+                ||  v > std::numeric_limits<Sample>::max()) {
+                    return -1;
+                }
+                b[r] = v;
+            }
+        } else if constexpr (Format::type == PNM_BIT_BINARY) {
+            const std::size_t stride = (h.w + 7) / 8;
+            if (s.size() - i < stride * h.h) { return -1; }
+            for (int y = 0; y < h.h; y++) {
+                for (int x = 0; x < h.w; x++) {
+                    const std::uint8_t c = byte_at(s, i + y * stride + x / 8);
+                    b[y * h.w + x] = (c >> (7 - x % 8)) & 1;
+                }
+            }
+        } else {
+            // Samples above 255 take 2 bytes, big-endian; as for `read_pnm_data_u8`
+            const bool wide = (h.maxval > 255);
+            if (s.size() - i < static_cast<std::size_t>(size) << wide) { return -1; }
+            if (wide) {
+                for (int r = 0; r < size; r++, i += 2) {
+                    b[r] = byte_at(s, i) << 8 | byte_at(s, i + 1);
+                }
+            } else {
+                for (int r = 0; r < size; r++, i++) {
+                    b[r] = byte_at(s, i);
+                }
+            }
+        }
+
+        return size;
+    }
+}
+
+
+// --- Images
+/* An owning, `w` x `h` image of `channels` interleaved samples per pixel.
+ */
+template <sample Sample>
+class image {
+  public:
+    image() = default;
+
+    /* Check `valid()` afterwards; the allocation may fail.
+     */
+    image(int w, int h, int channels, int maxval) {
+        const std::size_t size = static_cast<std::size_t>(w) * h * channels;
+        data_.reset(new (std::nothrow) Sample[size]());
+        if (!data_) { return; }
+
+        w_        = w;
+        h_        = h;
+        channels_ = channels;
+        maxval_   = maxval;
+    }
+
+    bool valid()    const { return data_ != nullptr; }
+    int  width()    const { return w_; }
+    int  height()   const { return h_; }
+    int  channels() const { return channels_; }
+    int  maxval()   const { return maxval_; }
+
+    std::span<Sample> samples() {
+        return { data_.get(), static_cast<std::size_t>(w_) * h_ * channels_ };
+    }
+    std::span<const Sample> samples() const {
+        return { data_.get(), static_cast<std::size_t>(w_) * h_ * channels_ };
+    }
+
+    std::span<Sample> row(int y) {
+        return samples().subspan(static_cast<std::size_t>(y) * w_ * channels_, w_ * channels_);
+    }
+    std::span<const Sample> row(int y) const {
+        return samples().subspan(static_cast<std::size_t>(y) * w_ * channels_, w_ * channels_);
+    }
+
+  private:
+    std::unique_ptr<Sample[]> data_;
+    int w_        = 0;
+    int h_        = 0;
+    int channels_ = 0;
+    int maxval_   = 0;
+};
+
+
+// --- Readers
+template <class Format, sample Sample>
+struct reader {
+    using format_type = Format;
+    using sample_type = Sample;
+
+    /* Same as `pnm::parse_header`, but only accepts `Format`.
+     */
+    static constexpr std::optional<header> parse(std::string_view s) {
+        const auto h = parse_header(s);
+        if (!h || h->type != Format::type) { return std::nullopt; }
+        return h;
+    }
+
+    /* Decode the image held in `s` into `b`, which must have room
+     *  for `parse(s)->samples()` samples.
+     * Returns the number of samples decoded or -1.
+     */
+    static constexpr int decode(std::string_view s, std::span<Sample> b) {
+        const auto h = parse(s);
+        if (!h) { return -1; }
+        return detail::decode<Format, Sample>(*h, s, b);
+    }
+
+    /* Same as `read_pnm_header`, but fails if `f` is not of `Format`.
+     *  It is assumed that `f` has just been opened.
+     * `h` is nullable.
+     */
+    static int read_header(FILE * f, header * h) {
+        if (get_pnm_type(f) != Format::type) { return -1; }
+
+        header r{};
+        r.type = Format::type;
+        const int size = read_pnm_header(f, Format::type, &r.w, &r.h, &r.maxval);
+        if (size == -1) { return -1; }
+
+        if (h) { *h = r; }
+
+        return size;
+    }
+
+    /* Same as `read_pnm_data`, into caller owned memory;
+     *  nothing is allocated.
+     */
+    static int read_data(FILE * f, std::span<Sample> b) {
+        if (b.size() > INT_MAX) { return -1; }
+
+        if constexpr (std::is_same_v<Sample, std::uint8_t>) {
+            return read_pnm_data_u8(f, Format::type, b.data(), b.size());
+        } else if constexpr (std::is_same_v<Sample, std::uint16_t>) {
+            return read_pnm_data_u16(f, Format::type, b.data(), b.size());
+        } else {
+            return read_pnm_data(f, Format::type, b.data(), b.size());
+        }
+    }
+
+    static std::optional<image<Sample>> load(FILE * f) {
+        header h;
+        const int size = read_header(f, &h);
+        if (size == -1) { return std::nullopt; }
+
+        image<Sample> r(h.w, h.h, Format::channels, h.maxval);
+        if (!r.valid()
+        ||  read_data(f, r.samples()) != size) {
+            return std::nullopt;
+        }
+
+        return r;
+    }
+
+    static std::optional<image<Sample>> load(const char * path) {
+        FILE * f = fopen(path, "rb");
+        if (!f) { return std::nullopt; }
+
+        auto r = load(f);
+        fclose(f);
+
+        return r;
+    }
+
+    static std::optional<image<Sample>> load(std::string_view s) {
+        const auto h = parse(s);
+        if (!h) { return std::nullopt; }
+
+        image<Sample> r(h->w, h->h, Format::channels, h->maxval);
+        if (!r.valid()
+        ||  detail::decode<Format, Sample>(*h, s, r.samples()) == -1) {
+            return std::nullopt;
+        }
+
+        return r;
+    }
+};
+
+/* Decode an image of `N` samples at compile time:
+ *  constexpr std::string_view icon = "P2 2 1 255 0 255\n";
+ *  constexpr auto pixels = pnm::embed<pnm::P2, uint8_t, pnm::parse_header(icon)->samples()>(icon);
+ */
+template <class Format, sample Sample, std::size_t N>
+constexpr std::optional<std::array<Sample, N>> embed(std::string_view s) {
+    std::array<Sample, N> r{};
+    if (reader<Format, Sample>::decode(s, r) != static_cast<int>(N)) { return std::nullopt; }
+    return r;
+}
+
+
+// --- Writers
+template <class Format, sample Sample>
+struct writer {
+    using format_type = Format;
+    using sample_type = Sample;
+
+    /* Same as `write_pnm_file`; `b` holds `w * h * Format::channels` samples.
+     */
+    static int write(FILE * f, std::span<const Sample> b, int w, int h, int maxval) {
+        if (w < 1
+        ||  h < 1
+        ||  b.size() < static_cast<std::size_t>(w) * h * Format::channels) {
+            return -1;
+        }
+
+        if constexpr (std::is_same_v<Sample, std::uint8_t>) {
+            return write_pnm_file_u8(f, Format::type, b.data(), w, h, maxval);
+        } else if constexpr (std::is_same_v<Sample, std::uint16_t>) {
+            return write_pnm_file_u16(f, Format::type, b.data(), w, h, maxval);
+        } else {
+            return write_pnm_file(f, Format::type, b.data(), w, h, maxval);
+        }
+    }
+
+    static int write(FILE * f, const image<Sample> & i) {
+        if (i.channels() != Format::channels) { return -1; }
+        return write(f, i.samples(), i.width(), i.height(), i.maxval());
+    }
+};
+
+}
+
+#endif
@@ -10,6 +10,7 @@
 #include <string.h>
 #include <limits.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #define DIFFHEX_IMPLEMENTATION
 #include "diffhex.h"
@@ -255,6 +256,195 @@ Test(plumblism, read_image_ppm_gimp_binary) {
     test_read_image_proto(test_images[8]);
 }
 
+static
+void test_read_image_simd_proto(struct test_image_t image) {
+    FILE * f = fopen(image.name, "r");
+    crex_assert_file_open(f, image.name);
+
+    int size = read_pnm_header(f, image.type, NULL, NULL, NULL);
+    cr_assert(lt(int, 0, size));
+
+    int * expected = malloc(size * sizeof(int));
+    int * actual   = malloc(size * sizeof(int));
+    cr_assert_not_null(expected);
+    cr_assert_not_null(actual);
+
+    pnm_set_simd(PNM_SIMD_SCALAR);
+    cr_assert(eq(int, read_pnm_data(f, image.type, expected, size), size));
+
+    for (int level = PNM_SIMD_SSE2; level <= PNM_SIMD_AVX2; level++) {
+        if (pnm_set_simd(level) != level) { continue; }
+
+        read_pnm_header(f, image.type, NULL, NULL, NULL);
+        cr_assert(eq(int, read_pnm_data(f, image.type, actual, size), size));
+        cr_expect_arr_eq(actual, expected, size * sizeof(int),
+            "%s: level %d disagrees with the scalar kernel",
+            image.name,
+            level
+        );
+    }
+
+    pnm_set_simd(PNM_SIMD_AUTO);
+
+    free(expected);
+    free(actual);
+    fclose(f);
+}
+
+Test(plumblism, simd_pgm_gimp_ascii) {
+    test_read_image_simd_proto(test_images[4]);
+}
+
+Test(plumblism, simd_ppm_gimp_ascii) {
+    test_read_image_simd_proto(test_images[5]);
+}
+
+Test(plumblism, simd_pgm_gimp_binary) {
+    test_read_image_simd_proto(test_images[7]);
+}
+
+Test(plumblism, simd_ppm_gimp_binary) {
+    test_read_image_simd_proto(test_images[8]);
+}
+
+Test(plumblism, simd_comments_and_odd_whitespace) {
+    const char text[] =
+        "P2\n4 2\n65535\n"
+        "1 22\t333\r\n"
+        "# 9 9 9\n"
+        "4444\v55555\f 0006 # trailing comment\n"
+        "7"
+    ;
+    const int expected[] = { 1, 22, 333, 4444, 55555, 6, 7 };
+
+    for (int level = PNM_SIMD_SCALAR; level <= PNM_SIMD_AVX2; level++) {
+        pnm_set_simd(level);
+
+        FILE * f = fmemopen((void *)text, sizeof(text) - 1, "r");
+        cr_assert(eq(int, get_pnm_type(f), PNM_GRE_ASCII));
+        read_pnm_header(f, PNM_GRE_ASCII, NULL, NULL, NULL);
+
+        int b[8];
+        cr_assert(eq(int, read_pnm_data(f, PNM_GRE_ASCII, b, 8), 7));
+        cr_expect_arr_eq(b, expected, sizeof(expected));
+        fclose(f);
+    }
+
+    pnm_set_simd(PNM_SIMD_AUTO);
+}
+
+Test(plumblism, simd_small_partial_reads) {
+    // A column, so that rows are a single sample each
+    char text[512];
+    int n = sprintf(text, "P2\n1 64\n255\n");
+    const long header = n;
+    int expected[64];
+    for (int i = 0; i < 64; i++) {
+        expected[i] = i * 37 % 256;
+        n += sprintf(text + n, "%d\n", expected[i]);
+    }
+
+    for (int level = PNM_SIMD_SCALAR; level <= PNM_SIMD_AVX2; level++) {
+        if (pnm_set_simd(level) != level) { continue; }
+
+        FILE * f = fmemopen(text, n, "r");
+        cr_assert(eq(int, get_pnm_type(f), PNM_GRE_ASCII));
+        read_pnm_header(f, PNM_GRE_ASCII, NULL, NULL, NULL);
+
+        int b[64];
+        cr_assert(eq(int, read_pnm_data(f, PNM_GRE_ASCII, b, 1), 1));
+        cr_expect(eq(int, b[0], expected[0]));
+        cr_expect(eq(long, ftell(f), header + 2), "level %d", level);
+
+        rewind(f);
+        pnm_stream_t s;
+        cr_assert(eq(int, open_pnm_reader(&s, f), 0));
+        for (int y = 0; y < 64; y++) {
+            cr_assert(eq(int, read_pnm_rows(&s, b + y, 1), 1));
+        }
+        cr_expect_arr_eq(b, expected, sizeof(expected), "level %d", level);
+        fclose(f);
+    }
+
+    pnm_set_simd(PNM_SIMD_AUTO);
+}
+
+static
+void test_map_image_proto(struct test_image_t image) {
+    pnm_map_t m;
+    cr_assert(eq(int, open_pnm_map(&m, image.name), 0));
+
+    cr_expect(eq(int, m.type, image.type));
+    cr_expect(eq(int, m.w, image.width));
+    cr_expect(eq(int, m.h, image.height));
+    cr_expect(eq(int, (int)m.size, (int)m.stride * m.h));
+
+    if (image.type != PNM_BIT_BINARY) {
+        FILE * f = fopen(image.name, "r");
+        crex_assert_file_open(f, image.name);
+
+        int n = read_pnm_header(f, image.type, NULL, NULL, NULL);
+        int * buffer = malloc(n * sizeof(int));
+        cr_assert_not_null(buffer);
+        cr_assert(lt(int, 0, read_pnm_data(f, image.type, buffer, n)));
+
+        for (int i = 0; i < n; i++) {
+            cr_assert(eq(int, m.data[i], buffer[i]),
+                "%s: mismatch at %d",
+                image.name,
+                i
+            );
+        }
+
+        free(buffer);
+        fclose(f);
+    }
+
+    close_pnm_map(&m);
+    cr_expect_null(m.data);
+}
+
+Test(plumblism, map_image_pbm_gimp_binary) {
+    test_map_image_proto(test_images[6]);
+}
+
+Test(plumblism, map_image_pgm_gimp_binary) {
+    test_map_image_proto(test_images[7]);
+}
+
+Test(plumblism, map_image_ppm_gimp_binary) {
+    test_map_image_proto(test_images[8]);
+}
+
+Test(plumblism, map_image_too_large_for_a_buffer) {
+    // 3 GB, all holes but the last byte
+    char filename[] = "/tmp/plumblism-XXXXXX";
+    int fd = mkstemp(filename);
+    cr_assert_neq(fd, -1);
+    FILE * f = fdopen(fd, "w+b");
+    crex_assert_file_open(f, filename);
+
+    const long long size = 60000LL * 50000;
+    const int header = fprintf(f, "P5 60000 50000 255\n");
+    fseek(f, header + size - 1, SEEK_SET);
+    fputc(7, f);
+    fclose(f);
+
+    pnm_map_t m;
+    cr_assert(eq(int, open_pnm_map(&m, filename), 0));
+    cr_expect(eq(int, m.size == (size_t)size, 1));
+    cr_expect(eq(int, m.data[size - 1], 7));
+    cr_expect(eq(int, m.data[size / 2], 0));
+
+    close_pnm_map(&m);
+    unlink(filename);
+}
+
+Test(plumblism, map_image_rejects_ascii) {
+    pnm_map_t m;
+    cr_expect(eq(int, open_pnm_map(&m, test_images[4].name), -1));
+}
+
 // -------------------------------
 // -------------------------------
 // __      __   _ _   _
@@ -351,6 +541,203 @@ Test(plumblism, write_image_ppm_binary) {
     crex_assert_file_size(e.s, e.n);
 }
 
+static
+void test_read_image_narrow_proto(struct test_image_t image) {
+    FILE * f = fopen(image.name, "r");
+    crex_assert_file_open(f, image.name);
+
+    int w, h, maxval;
+    int size = read_pnm_header(f, image.type, &w, &h, &maxval);
+    cr_assert(lt(int, 0, size));
+    cr_assert(eq(int, pnm_sample_bits(image.type, maxval),
+        (image.type == PNM_BIT_ASCII || image.type == PNM_BIT_BINARY) ? 1 : 8
+    ));
+
+    int      * wide   = malloc(size * sizeof(int));
+    uint8_t  * narrow = malloc(size);
+    uint16_t * half   = malloc(size * sizeof(uint16_t));
+    cr_assert_not_null(wide);
+    cr_assert_not_null(narrow);
+    cr_assert_not_null(half);
+
+    cr_assert(eq(int, read_pnm_data(f, image.type, wide, size), size));
+    read_pnm_header(f, image.type, NULL, NULL, NULL);
+    cr_assert(eq(int, read_pnm_data_u8(f, image.type, narrow, size), size));
+    read_pnm_header(f, image.type, NULL, NULL, NULL);
+    cr_assert(eq(int, read_pnm_data_u16(f, image.type, half, size), size));
+
+    for (int i = 0; i < size; i++) {
+        cr_assert(eq(int, narrow[i], wide[i]), "%s: u8 mismatch at %d", image.name, i);
+        cr_assert(eq(int, half[i],   wide[i]), "%s: u16 mismatch at %d", image.name, i);
+    }
+
+    do {
+        static char tmpfilename[] = "/tmp/plumblism-XXXXXX";
+        int fd = mkstemp(tmpfilename);
+        cr_assert_neq(fd, -1);
+
+        FILE * tmp = fdopen(fd, "w+b");
+        crex_assert_file_open(tmp, tmpfilename);
+
+        char * expected;
+        size_t expected_size;
+        FILE * mem = open_memstream(&expected, &expected_size);
+        int n = write_pnm_file(mem, image.type, wide, w, h, maxval);
+        fclose(mem);
+
+        cr_assert(eq(int, write_pnm_file_u8(tmp, image.type, narrow, w, h, maxval), n));
+        cr_assert(eq(int, (int)expected_size, n));
+
+        char * actual = malloc(n);
+        rewind(tmp);
+        cr_assert(eq(int, fread(actual, 1, n, tmp), n));
+        cr_expect_arr_eq(actual, expected, n);
+
+        free(actual);
+        free(expected);
+        fclose(tmp);
+    } while (0);
+
+    free(wide);
+    free(narrow);
+    free(half);
+    fclose(f);
+}
+
+Test(plumblism, narrow_pbm_gimp_ascii) {
+    test_read_image_narrow_proto(test_images[3]);
+}
+
+Test(plumblism, narrow_pgm_gimp_ascii) {
+    test_read_image_narrow_proto(test_images[4]);
+}
+
+Test(plumblism, narrow_ppm_gimp_ascii) {
+    test_read_image_narrow_proto(test_images[5]);
+}
+
+Test(plumblism, narrow_pgm_gimp_binary) {
+    test_read_image_narrow_proto(test_images[7]);
+}
+
+Test(plumblism, narrow_ppm_gimp_binary) {
+    test_read_image_narrow_proto(test_images[8]);
+}
+
+Test(plumblism, narrow_bit_packing) {
+    // 10 wide, so every row carries 6 bits of padding
+    FILE * f = fopen(test_images[0].name, "r");
+    crex_assert_file_open(f, test_images[0].name);
+
+    int w, h;
+    int size = read_pnm_header(f, PNM_BIT_ASCII, &w, &h, NULL);
+    int * wide = malloc(size * sizeof(int));
+    cr_assert(eq(int, read_pnm_data(f, PNM_BIT_ASCII, wide, size), size));
+
+    const int stride = (w + 7) / 8;
+    uint8_t * packed = calloc(stride * h, 1);
+    read_pnm_header(f, PNM_BIT_ASCII, NULL, NULL, NULL);
+    cr_assert(eq(int, read_pnm_data_bit(f, PNM_BIT_ASCII, packed, w, h), size));
+    fclose(f);
+
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            const int bit = (packed[y * stride + x / 8] >> (7 - x % 8)) & 0x1;
+            cr_assert(eq(int, bit, wide[y * w + x]));
+        }
+    }
+
+    char * text;
+    size_t text_size;
+    FILE * mem = open_memstream(&text, &text_size);
+    cr_assert(lt(int, 0, write_pnm_file_bit(mem, PNM_BIT_BINARY, packed, w, h)));
+    fclose(mem);
+
+    mem = fmemopen(text, text_size, "r");
+    cr_assert(eq(int, get_pnm_type(mem), PNM_BIT_BINARY));
+    uint8_t * copy = calloc(stride * h, 1);
+    read_pnm_header(mem, PNM_BIT_BINARY, NULL, NULL, NULL);
+    cr_assert(eq(int, read_pnm_data_bit(mem, PNM_BIT_BINARY, copy, w, h), size));
+    cr_expect_arr_eq(copy, packed, stride * h);
+    fclose(mem);
+
+    free(text);
+    free(copy);
+    free(packed);
+    free(wide);
+}
+
+Test(plumblism, narrow_u16_samples) {
+    uint16_t b[4*4];
+    for (int i = 0; i < 16; i++) {
+        b[i] = i * 4000;
+    }
+
+    char * text;
+    size_t text_size;
+    FILE * mem = open_memstream(&text, &text_size);
+    cr_assert(lt(int, 0, write_pnm_file_u16(mem, PNM_GRE_ASCII, b, 4, 4, 65535)));
+    fclose(mem);
+
+    mem = fmemopen(text, text_size, "r");
+    int maxval;
+    int size = read_pnm_header(mem, PNM_GRE_ASCII, NULL, NULL, &maxval);
+    cr_assert(eq(int, pnm_sample_bits(PNM_GRE_ASCII, maxval), 16));
+
+    uint16_t copy[4*4];
+    cr_assert(eq(int, read_pnm_data_u16(mem, PNM_GRE_ASCII, copy, size), 16));
+    cr_expect_arr_eq(copy, b, sizeof(b));
+
+    // Too wide for bytes; refused up front, like for binary files
+    uint8_t bytes[4*4];
+    read_pnm_header(mem, PNM_GRE_ASCII, NULL, NULL, NULL);
+    cr_expect(eq(int, read_pnm_data_u8(mem, PNM_GRE_ASCII, bytes, size), -1));
+    fclose(mem);
+    free(text);
+}
+
+Test(plumblism, write_ascii_layout) {
+    const int b[] = {
+        0, 1, 9, 10, 99, 100,
+        999, 1000, 65535, 123456789, INT_MAX, -1,
+        INT_MIN, 42, 7, 255, 256, 1,
+    };
+
+    for (int type = PNM_BIT_ASCII; type <= PNM_PIX_ASCII; type++) {
+        const int w = (type == PNM_PIX_ASCII ? 2 : 6);
+        const int h = 3;
+
+        char * expected;
+        size_t expected_size;
+        FILE * mem = open_memstream(&expected, &expected_size);
+        fprintf(mem, "P%d\n%d %d", type, w, h);
+        if (type != PNM_BIT_ASCII) { fprintf(mem, " 255"); }
+        fprintf(mem, "\n");
+        for (int i = 0; i < w * h; i++) {
+            if (type == PNM_PIX_ASCII) {
+                fprintf(mem, "%d %d %d  ", b[3*i], b[3*i+1], b[3*i+2]);
+            } else {
+                fprintf(mem, "%d ", b[i]);
+            }
+            if ((i + 1) % w == 0) { fprintf(mem, "\n"); }
+        }
+        fclose(mem);
+
+        char * actual;
+        size_t actual_size;
+        mem = open_memstream(&actual, &actual_size);
+        int n = write_pnm_file(mem, (pnm_type_t)type, b, w, h, 255);
+        fclose(mem);
+
+        cr_expect(eq(int, n, (int)actual_size));
+        cr_assert(eq(int, (int)actual_size, (int)expected_size));
+        cr_expect_arr_eq(actual, expected, expected_size);
+
+        free(expected);
+        free(actual);
+    }
+}
+
 // -------------------------------
 // -------------------------------
 //   ___                _
@@ -390,12 +777,12 @@ void rwr_roundtrip_proto(struct test_image_t image) {
         cr_assert_not_null(original);
         cr_assert_not_null(copy);
 
-        cr_assert(lt(int, 0, read_pnm_data(
+        cr_assert(eq(int, read_pnm_data(
             in,
             image.type,
             original,
             size
-        )));
+        ), size));
 
         fclose(in);
     } while (0);
@@ -492,3 +879,1174 @@ Test(plumblism, rwr_roundtrip_pgm_gimp_binary) {
 Test(plumblism, rwr_roundtrip_ppm_gimp_binary) {
     rwr_roundtrip_proto(test_images[8]);
 }
+
+Test(plumblism, pbm_binary_rows_are_padded) {
+    int w, h;
+    int * ascii;
+    int * binary;
+
+    do {
+        FILE * f = fopen(test_images[3].name, "r");
+        crex_assert_file_open(f, test_images[3].name);
+        int size = read_pnm_header(f, PNM_BIT_ASCII, &w, &h, NULL);
+        ascii = malloc(size * sizeof(int));
+        cr_assert(eq(int, read_pnm_data(f, PNM_BIT_ASCII, ascii, size), size));
+        fclose(f);
+    } while (0);
+
+    do {
+        FILE * f = fopen(test_images[6].name, "r");
+        crex_assert_file_open(f, test_images[6].name);
+        int size = read_pnm_header(f, PNM_BIT_BINARY, NULL, NULL, NULL);
+        binary = malloc(size * sizeof(int));
+        cr_assert(eq(int, read_pnm_data(f, PNM_BIT_BINARY, binary, size), size));
+        fclose(f);
+    } while (0);
+
+    // Both were exported from the same picture; 275 is not a multiple of 8
+    cr_expect_arr_eq(ascii, binary, w * h * sizeof(int));
+
+    char * text;
+    size_t text_size;
+    FILE * mem = open_memstream(&text, &text_size);
+    const int header = snprintf(NULL, 0, "P4\n%d %d\n", w, h);
+    cr_assert(eq(int, write_pnm_file(mem, PNM_BIT_BINARY, binary, w, h, 1), (int)(header + (w + 7) / 8 * h)));
+    fclose(mem);
+    cr_assert(eq(int, (int)text_size, header + (w + 7) / 8 * h));
+
+    free(text);
+    free(ascii);
+    free(binary);
+}
+
+Test(plumblism, binary_16bit_samples) {
+    // Odd sizes, so that every kernel has a tail
+    const int w = 37;
+    const int h = 5;
+    const int size = w * h * 3;
+    const int header = snprintf(NULL, 0, "P6\n%d %d %d\n", w, h, 65535);
+
+    int * b = malloc(size * sizeof(int));
+    int * copy = malloc(size * sizeof(int));
+    uint16_t * b16 = malloc(size * sizeof(uint16_t));
+    uint16_t * copy16 = malloc(size * sizeof(uint16_t));
+    for (int i = 0; i < size; i++) {
+        b[i] = (i * 2731 + 258) & 0xFFFF;
+        b16[i] = b[i];
+    }
+
+    for (pnm_simd_t level = PNM_SIMD_SCALAR; level <= PNM_SIMD_AVX2; level++) {
+        if (pnm_set_simd(level) != level) { continue; }
+
+        char * text;
+        size_t text_size;
+        FILE * mem = open_memstream(&text, &text_size);
+        cr_assert(eq(int, write_pnm_file(mem, PNM_PIX_BINARY, b, w, h, 65535), header + size * 2));
+        fclose(mem);
+        cr_assert(eq(int, (int)text_size, header + size * 2));
+        // Big-endian on disk
+        cr_expect(eq(int, (unsigned char)text[header + 0], 0x01));
+        cr_expect(eq(int, (unsigned char)text[header + 1], 0x02));
+
+        char * text16;
+        size_t text16_size;
+        mem = open_memstream(&text16, &text16_size);
+        write_pnm_file_u16(mem, PNM_PIX_BINARY, b16, w, h, 65535);
+        fclose(mem);
+        cr_assert(eq(int, (int)text16_size, (int)text_size));
+        cr_expect_arr_eq(text16, text, text_size);
+
+        mem = fmemopen(text, text_size, "r");
+        int maxval;
+        cr_assert(eq(int, read_pnm_header(mem, PNM_PIX_BINARY, NULL, NULL, &maxval), size));
+        cr_assert(eq(int, pnm_sample_bits(PNM_PIX_BINARY, maxval), 16));
+        cr_assert(eq(int, read_pnm_data(mem, PNM_PIX_BINARY, copy, size), size));
+        cr_expect_arr_eq(copy, b, size * sizeof(int));
+
+        read_pnm_header(mem, PNM_PIX_BINARY, NULL, NULL, NULL);
+        cr_assert(eq(int, read_pnm_data_u16(mem, PNM_PIX_BINARY, copy16, size), size));
+        cr_expect_arr_eq(copy16, b16, size * sizeof(uint16_t));
+
+        // Seeked, as memory streams have no descriptor to `pread` from
+        cr_assert(eq(int, read_pnm_region(mem, PNM_PIX_BINARY, copy, 5, 1, 10, 3), 10 * 3 * 3));
+        for (int j = 0; j < 3; j++) {
+            cr_expect_arr_eq(copy + j * 30, b + ((1 + j) * w + 5) * 3, 30 * sizeof(int));
+        }
+
+        // Words do not fit bytes
+        read_pnm_header(mem, PNM_PIX_BINARY, NULL, NULL, NULL);
+        cr_expect(eq(int, read_pnm_data_u8(mem, PNM_PIX_BINARY, (uint8_t *)copy16, size), -1));
+        fclose(mem);
+
+        free(text);
+        free(text16);
+    }
+    pnm_set_simd(PNM_SIMD_AUTO);
+
+    free(b);
+    free(copy);
+    free(b16);
+    free(copy16);
+}
+
+static
+void layout_proto(struct test_image_t image) {
+    FILE * f = fopen(image.name, "r");
+    crex_assert_file_open(f, image.name);
+
+    const int size   = read_pnm_header(f, image.type, NULL, NULL, NULL);
+    const int pixels = size / 3;
+    int * rgb = malloc(size * sizeof(int));
+    cr_assert(eq(int, read_pnm_data(f, image.type, rgb, size), size));
+
+    int * expected = malloc(pixels * 4 * sizeof(int));
+    int * actual   = malloc(pixels * 4 * sizeof(int));
+    uint8_t * actual8 = malloc(pixels * 4);
+
+    for (pnm_layout_t layout = PNM_LAYOUT_RGB; layout <= PNM_LAYOUT_BGRA; layout++) {
+        const int n = (layout == PNM_LAYOUT_RGBA || layout == PNM_LAYOUT_BGRA ? pixels * 4 : size);
+        for (int i = 0; i < pixels; i++) {
+            const int r = rgb[3*i], g = rgb[3*i+1], b = rgb[3*i+2];
+            switch (layout) {
+                case PNM_LAYOUT_RGB: {
+                    memcpy(expected + 3*i, rgb + 3*i, 3 * sizeof(int));
+                } break;
+                case PNM_LAYOUT_PLANAR: {
+                    expected[i] = r;
+                    expected[pixels + i] = g;
+                    expected[2*pixels + i] = b;
+                } break;
+                case PNM_LAYOUT_RGBA:
+                case PNM_LAYOUT_BGRA: {
+                    expected[4*i+0] = (layout == PNM_LAYOUT_RGBA ? r : b);
+                    expected[4*i+1] = g;
+                    expected[4*i+2] = (layout == PNM_LAYOUT_RGBA ? b : r);
+                    expected[4*i+3] = 200;
+                } break;
+            }
+        }
+
+        for (pnm_simd_t level = PNM_SIMD_SCALAR; level <= PNM_SIMD_AVX2; level++) {
+            if (pnm_set_simd(level) != level) { continue; }
+
+            read_pnm_header(f, image.type, NULL, NULL, NULL);
+            cr_assert(eq(int, read_pnm_data_layout(f, image.type, actual, size, layout, 200), size));
+            cr_expect_arr_eq(actual, expected, n * sizeof(int),
+                "%s: layout %d at level %d", image.name, layout, level
+            );
+
+            read_pnm_header(f, image.type, NULL, NULL, NULL);
+            cr_assert(eq(int, read_pnm_data_layout_u8(f, image.type, actual8, size, layout, 200), size));
+            for (int i = 0; i < n; i++) { actual[i] = actual8[i]; }
+            cr_expect_arr_eq(actual, expected, n * sizeof(int),
+                "%s: u8 layout %d at level %d", image.name, layout, level
+            );
+        }
+        pnm_set_simd(PNM_SIMD_AUTO);
+    }
+
+    free(rgb);
+    free(expected);
+    free(actual);
+    free(actual8);
+    fclose(f);
+}
+
+Test(plumblism, layout_ppm_gimp_ascii) {
+    layout_proto(test_images[5]);
+}
+Test(plumblism, layout_ppm_gimp_binary) {
+    layout_proto(test_images[8]);
+}
+
+static
+void region_proto(struct test_image_t image) {
+    FILE * f = fopen(image.name, "r");
+    crex_assert_file_open(f, image.name);
+
+    int w;
+    const int size = read_pnm_header(f, image.type, &w, NULL, NULL);
+    const int c = ints_per_pixel(image.type);
+    int * full = malloc(size * sizeof(int));
+    cr_assert(eq(int, read_pnm_data(f, image.type, full, size), size));
+
+    const struct { int x, y, w, h; } regions[] = {
+        {   0,   0,   1,   1 },
+        {  13,   7, 101,  50 },
+        {  16, 100,  64,  33 },
+        {   3,   0, 272, 235 },
+    };
+
+    pnm_map_t m;
+    cr_assert(eq(int, open_pnm_map(&m, image.name), 0));
+
+    for (size_t k = 0; k < sizeof(regions) / sizeof(regions[0]); k++) {
+        const int rw = regions[k].w, rh = regions[k].h;
+        int * expected = malloc(rw * rh * c * sizeof(int));
+        int * actual   = malloc(rw * rh * c * sizeof(int));
+        for (int j = 0; j < rh; j++) {
+            memcpy(expected + j * rw * c, full + ((regions[k].y + j) * w + regions[k].x) * c, rw * c * sizeof(int));
+        }
+
+        cr_assert(eq(int, read_pnm_region(f, image.type, actual, regions[k].x, regions[k].y, rw, rh), rw * rh * c));
+        cr_expect_arr_eq(actual, expected, rw * rh * c * sizeof(int), "%s: region %zu", image.name, k);
+
+        memset(actual, 0, rw * rh * c * sizeof(int));
+        cr_assert(eq(int, read_pnm_map_region(&m, actual, regions[k].x, regions[k].y, rw, rh), rw * rh * c));
+        cr_expect_arr_eq(actual, expected, rw * rh * c * sizeof(int), "%s: mapped region %zu", image.name, k);
+
+        free(expected);
+        free(actual);
+    }
+
+    int dummy[4];
+    cr_expect(eq(int, read_pnm_region(f, image.type, dummy, w - 1, 0, 2, 1), -1));
+
+    close_pnm_map(&m);
+    free(full);
+    fclose(f);
+}
+
+Test(plumblism, region_of_an_image_too_large_for_a_buffer) {
+    // 50000 x 50000, sparse but for two bytes near the bottom right corner
+    const long long x = 49992, y = 49998;
+    for (pnm_type_t type = PNM_BIT_BINARY; type <= PNM_GRE_BINARY; type++) {
+        char filename[] = "/tmp/plumblism-XXXXXX";
+        int fd = mkstemp(filename);
+        cr_assert_neq(fd, -1);
+        FILE * f = fdopen(fd, "w+b");
+        crex_assert_file_open(f, filename);
+
+        const long long stride = (type == PNM_BIT_BINARY ? 50000 / 8 : 50000);
+        const long long first  = (type == PNM_BIT_BINARY ? x / 8 : x);
+        const int header = fprintf(f, "P%d 50000 50000%s\n", type, (type == PNM_BIT_BINARY ? "" : " 255"));
+        fseek(f, header + y * stride + first, SEEK_SET);
+        fputc(0x80, f);
+        fseek(f, header + (y + 1) * stride + first, SEEK_SET);
+        fputc(0x01, f);
+        fseek(f, header + 50000 * stride - 1, SEEK_SET);
+        fputc(0, f);
+        fflush(f);
+
+        int b[4];
+        rewind(f);
+        cr_expect(eq(int, read_pnm_header(f, type, NULL, NULL, NULL), -1));
+        cr_assert(eq(int, read_pnm_region(f, type, b, x, y, 2, 2), 4), "P%d", type);
+
+        const int bits[]  = { 1, 0, 0, 0 };
+        const int bytes[] = { 128, 0, 1, 0 };
+        cr_expect_arr_eq(b, (type == PNM_BIT_BINARY ? bits : bytes), sizeof(b), "P%d", type);
+
+        fclose(f);
+        unlink(filename);
+    }
+}
+
+Test(plumblism, region_pbm_gimp_binary) {
+    region_proto(test_images[6]);
+}
+Test(plumblism, region_pgm_gimp_binary) {
+    region_proto(test_images[7]);
+}
+Test(plumblism, region_ppm_gimp_binary) {
+    region_proto(test_images[8]);
+}
+
+struct counting_allocator_t {
+    int allocations;
+    int frees;
+    size_t live;
+};
+
+static
+void * counting_alloc(void * user, size_t size) {
+    struct counting_allocator_t * c = user;
+    c->allocations += 1;
+    c->live += size;
+    return malloc(size);
+}
+
+static
+void counting_free(void * user, void * p, size_t size) {
+    struct counting_allocator_t * c = user;
+    c->frees += 1;
+    c->live -= size;
+    free(p);
+}
+
+Test(plumblism, decoder_reuses_storage) {
+    struct counting_allocator_t counts = { 0, 0, 0 };
+    const pnm_allocator_t allocator = { counting_alloc, counting_free, &counts };
+
+    pnm_decoder_t d;
+    init_pnm_decoder(&d, &allocator);
+
+    // Largest first, so that every later load fits
+    const int order[] = { 8, 5, 7, 4, 6, 3, 2, 1, 0, 8 };
+    for (size_t k = 0; k < sizeof(order) / sizeof(order[0]); k++) {
+        struct test_image_t image = test_images[order[k]];
+        FILE * f = fopen(image.name, "r");
+        crex_assert_file_open(f, image.name);
+
+        const int size = image.width * image.height * ints_per_pixel(image.type);
+        cr_assert(eq(int, decode_pnm_image(&d, f), size), "%s", image.name);
+        cr_expect(eq(int, d.image->type, image.type));
+        cr_expect(eq(int, d.image->w, image.width));
+        cr_expect(eq(int, d.image->stride, image.width * ints_per_pixel(image.type)));
+
+        int * expected = malloc(size * sizeof(int));
+        read_pnm_header(f, image.type, NULL, NULL, NULL);
+        read_pnm_data(f, image.type, expected, size);
+        cr_expect_arr_eq(d.image->data, expected, size * sizeof(int), "%s", image.name);
+        free(expected);
+
+        fclose(f);
+    }
+    cr_expect(eq(int, counts.allocations, 1));
+
+    reset_pnm_decoder(&d);
+    cr_expect(eq(int, d.image->size, 0));
+    free_pnm_decoder(&d);
+    cr_expect(eq(int, counts.frees, 1));
+
+    FILE * f = fopen(test_images[7].name, "r");
+    pnm_image_t * image;
+    cr_assert(eq(int, load_pnm_image(&image, f, &allocator), 275 * 235));
+    cr_expect(eq(int, image->intensity, 255));
+    free_pnm_image(image, &allocator);
+    fclose(f);
+
+    cr_expect(eq(int, counts.allocations, counts.frees));
+    cr_expect(eq(int, (int)counts.live, 0));
+}
+
+Test(plumblism, batch_errors_per_file) {
+    const int n_images = sizeof(test_images) / sizeof(test_images[0]);
+
+    // Its raster is cut short
+    char truncated[] = "/tmp/plumblism-XXXXXX";
+    int fd = mkstemp(truncated);
+    cr_assert_neq(fd, -1);
+    cr_assert(eq(int, write(fd, "P2 2 2 255\n1 2 3\n", 17), 17));
+    close(fd);
+
+    pnm_batch_item_t items[sizeof(test_images) / sizeof(test_images[0]) + 2];
+    for (int i = 0; i < n_images; i++) {
+        items[i].path = test_images[i].name;
+    }
+    items[n_images].path     = "test/does-not-exist.pgm";
+    items[n_images + 1].path = truncated;
+
+    cr_assert(eq(int, load_pnm_batch(items, n_images + 2, 4, NULL), n_images));
+
+    cr_expect(eq(int, items[n_images].error, PNM_ERROR_OPEN));
+    cr_expect(items[n_images].image == NULL);
+    cr_expect(eq(int, items[n_images + 1].error, PNM_ERROR_DATA));
+    cr_expect(items[n_images + 1].image == NULL);
+    unlink(truncated);
+
+    for (int i = 0; i < n_images; i++) {
+        struct test_image_t image = test_images[i];
+        cr_assert(eq(int, items[i].error, PNM_OK), "%s", image.name);
+
+        const int size = image.width * image.height * ints_per_pixel(image.type);
+        cr_expect(eq(int, items[i].image->size, size), "%s", image.name);
+
+        FILE * f = fopen(image.name, "r");
+        int * expected = malloc(size * sizeof(int));
+        read_pnm_header(f, image.type, NULL, NULL, NULL);
+        read_pnm_data(f, image.type, expected, size);
+        cr_expect_arr_eq(items[i].image->data, expected, size * sizeof(int), "%s", image.name);
+        free(expected);
+        fclose(f);
+
+        free_pnm_image(items[i].image, NULL);
+    }
+}
+
+static
+void count_finished(pnm_batch_item_t * item, void * user) {
+    (void)item;
+    __atomic_fetch_add((int *)user, 1, __ATOMIC_RELAXED);
+}
+
+Test(plumblism, batch_async_matches_sync) {
+    const int n_images = sizeof(test_images) / sizeof(test_images[0]);
+
+    // More files than the ring is deep, and one missing
+    enum { N = 150 };
+    pnm_batch_item_t sync[N];
+    pnm_batch_item_t async[N];
+    for (int i = 0; i < N; i++) {
+        sync[i].path = async[i].path = (i == N - 1 ? "test/does-not-exist.pgm" : test_images[i % n_images].name);
+    }
+
+    const int loaded = load_pnm_batch(sync, N, 1, NULL);
+
+    int finished = 0;
+    cr_assert(eq(int, load_pnm_batch_async(async, N, 4, NULL, count_finished, &finished), loaded));
+    cr_expect(eq(int, finished, N));
+
+    for (int i = 0; i < N; i++) {
+        cr_assert(eq(int, async[i].error, sync[i].error), "%s", async[i].path);
+        if (sync[i].error != PNM_OK) { continue; }
+
+        cr_expect(eq(int, async[i].image->size, sync[i].image->size), "%s", async[i].path);
+        cr_expect_arr_eq(async[i].image->data, sync[i].image->data, sync[i].image->size * sizeof(int), "%s", async[i].path);
+
+        free_pnm_image(sync[i].image, NULL);
+        free_pnm_image(async[i].image, NULL);
+    }
+}
+
+Test(plumblism, pam_roundtrip) {
+    pnm_pam_t pam = { .w = 7, .h = 3, .depth = 4, .maxval = 255, .tuple_type = "RGB_ALPHA" };
+    const int size = pam.w * pam.h * pam.depth;
+
+    int b[7*3*4];
+    uint8_t b8[7*3*4];
+    uint16_t b16[7*3*4];
+    for (int i = 0; i < size; i++) {
+        b[i] = (i * 37) & 0xFF;
+        b8[i] = b[i];
+        b16[i] = i * 1021;
+    }
+
+    char * text;
+    size_t text_size;
+    FILE * mem = open_memstream(&text, &text_size);
+    const int n = write_pam_file(mem, &pam, b);
+    fclose(mem);
+    cr_assert(eq(int, n, (int)text_size));
+    const char * header = "P7\nWIDTH 7\nHEIGHT 3\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n";
+    cr_assert(eq(int, (int)text_size, (int)strlen(header) + size));
+    cr_expect_arr_eq(text, header, strlen(header));
+
+    char * text8;
+    size_t text8_size;
+    mem = open_memstream(&text8, &text8_size);
+    write_pam_file_u8(mem, &pam, b8);
+    fclose(mem);
+    cr_assert(eq(int, (int)text8_size, (int)text_size));
+    cr_expect_arr_eq(text8, text, text_size);
+
+    mem = fmemopen(text, text_size, "r");
+    cr_assert(eq(int, get_pnm_type(mem), PNM_PAM));
+    pnm_pam_t copy_pam;
+    cr_assert(eq(int, read_pam_header(mem, &copy_pam), size));
+    cr_expect(eq(int, copy_pam.depth, 4));
+    cr_expect(eq(str, copy_pam.tuple_type, "RGB_ALPHA"));
+    int copy[7*3*4];
+    cr_assert(eq(int, read_pnm_data(mem, PNM_PAM, copy, size), size));
+    cr_expect_arr_eq(copy, b, sizeof(b));
+
+    int maxval;
+    cr_assert(eq(int, read_pnm_header(mem, PNM_PAM, NULL, NULL, &maxval), size));
+    cr_assert(eq(int, pnm_sample_bits(PNM_PAM, maxval), 8));
+    uint8_t copy8[7*3*4];
+    cr_assert(eq(int, read_pnm_data_u8(mem, PNM_PAM, copy8, size), size));
+    cr_expect_arr_eq(copy8, b8, sizeof(b8));
+    fclose(mem);
+    free(text);
+    free(text8);
+
+    // 16 bit samples, with comments and a split tuple type
+    pam.depth  = 2;
+    pam.maxval = 65535;
+    strcpy(pam.tuple_type, "GRAYSCALE_ALPHA");
+    mem = open_memstream(&text, &text_size);
+    fprintf(mem, "P7\n# comment\nWIDTH 7\nHEIGHT 3\n\tDEPTH 2  \nMAXVAL 65535\nTUPLTYPE GRAYSCALE\nTUPLTYPE ALPHA\nENDHDR\n");
+    for (int i = 0; i < pam.w * pam.h * pam.depth; i++) {
+        fputc(b16[i] >> 8, mem);
+        fputc(b16[i] & 0xFF, mem);
+    }
+    fclose(mem);
+
+    mem = fmemopen(text, text_size, "r");
+    cr_assert(eq(int, read_pam_header(mem, &copy_pam), 7*3*2));
+    cr_expect(eq(int, copy_pam.maxval, 65535));
+    cr_expect(eq(str, copy_pam.tuple_type, "GRAYSCALE ALPHA"));
+    uint16_t copy16[7*3*2];
+    cr_assert(eq(int, read_pnm_data_u16(mem, PNM_PAM, copy16, 7*3*2), 7*3*2));
+    cr_expect_arr_eq(copy16, b16, sizeof(copy16));
+    fclose(mem);
+
+    strcpy(pam.tuple_type, "GRAYSCALE ALPHA");
+    char * again;
+    size_t again_size;
+    mem = open_memstream(&again, &again_size);
+    write_pam_file_u16(mem, &pam, b16);
+    fclose(mem);
+    const size_t raster = 7*3*2*2;
+    cr_assert(lt(int, (int)raster, (int)again_size));
+    cr_expect_arr_eq(again + again_size - raster, text + text_size - raster, raster);
+
+    free(text);
+    free(again);
+}
+
+Test(plumblism, pfm_roundtrip) {
+    const int w = 13;
+    const int h = 4;
+    const int size = w * h * 3;
+
+    float * b = malloc(size * sizeof(float));
+    float * copy = malloc(size * sizeof(float));
+    for (int i = 0; i < size; i++) {
+        b[i] = i * 0.25f - 3;
+    }
+
+    char filename[] = "/tmp/plumblism-XXXXXX";
+    int fd = mkstemp(filename);
+    cr_assert_neq(fd, -1);
+    FILE * f = fdopen(fd, "w+b");
+    crex_assert_file_open(f, filename);
+
+    int n = write_pfm_file(f, PNM_PIX_FLOAT, b, w, h, 2.0f);
+    fflush(f);
+    cr_assert(eq(int, n, (int)ftell(f)));
+    cr_expect(eq(int, n % 4, 0));
+
+    rewind(f);
+    cr_assert(eq(int, get_pnm_type(f), PNM_PIX_FLOAT));
+    float scale;
+    int w_, h_;
+    cr_assert(eq(int, read_pfm_header(f, PNM_PIX_FLOAT, &w_, &h_, &scale), size));
+    cr_expect(eq(int, w_, w));
+    cr_expect(eq(int, h_, h));
+    cr_expect(eq(flt, scale, 2.0f));
+    cr_assert(eq(int, read_pfm_data(f, PNM_PIX_FLOAT, copy, size), size));
+    cr_expect_arr_eq(copy, b, size * sizeof(float));
+    fclose(f);
+
+    // Rows are mapped bottom to top, but indexed from the top
+    pnm_map_t m;
+    cr_assert(eq(int, open_pnm_map(&m, filename), 0));
+    cr_expect(eq(int, (int)m.size, size * (int)sizeof(float)));
+    cr_expect(eq(int, m.type, PNM_PIX_FLOAT));
+    for (int y = 0; y < h; y++) {
+        const float * row = get_pfm_map_row(&m, y);
+        cr_assert_not_null(row);
+        cr_expect_arr_eq(row, b + y * w * 3, w * 3 * sizeof(float));
+    }
+    close_pnm_map(&m);
+    remove(filename);
+
+    // The other byte order; a positive scale means big-endian
+    char * text;
+    size_t text_size;
+    FILE * mem = open_memstream(&text, &text_size);
+    fprintf(mem, "PF\n%d %d\n1.0\n", w, h);
+    for (int y = h - 1; y >= 0; y--) {
+        for (int i = 0; i < w * 3; i++) {
+            unsigned char bytes[4];
+            memcpy(bytes, b + y * w * 3 + i, 4);
+            for (int k = 3; k >= 0; k--) { fputc(bytes[k], mem); }
+        }
+    }
+    fclose(mem);
+
+    for (pnm_simd_t level = PNM_SIMD_SCALAR; level <= PNM_SIMD_AVX2; level++) {
+        if (pnm_set_simd(level) != level) { continue; }
+
+        mem = fmemopen(text, text_size, "r");
+        cr_assert(eq(int, read_pfm_header(mem, PNM_PIX_FLOAT, NULL, NULL, NULL), size));
+        memset(copy, 0, size * sizeof(float));
+        cr_assert(eq(int, read_pfm_data(mem, PNM_PIX_FLOAT, copy, size), size));
+        cr_expect_arr_eq(copy, b, size * sizeof(float));
+        fclose(mem);
+    }
+    pnm_set_simd(PNM_SIMD_AUTO);
+
+    free(text);
+    free(b);
+    free(copy);
+}
+
+static
+void stream_roundtrip_proto(struct test_image_t image) {
+    FILE * f = fopen(image.name, "r");
+    crex_assert_file_open(f, image.name);
+
+    int w, h, maxval;
+    int size = read_pnm_header(f, image.type, &w, &h, &maxval);
+    int * whole = malloc(size * sizeof(int));
+    cr_assert(eq(int, read_pnm_data(f, image.type, whole, size), size));
+
+    char * expected;
+    size_t expected_size;
+    FILE * mem = open_memstream(&expected, &expected_size);
+    write_pnm_file(mem, image.type, whole, w, h, maxval);
+    fclose(mem);
+
+    rewind(f);
+    pnm_stream_t in;
+    cr_assert(eq(int, open_pnm_reader(&in, f), 0));
+    cr_assert(eq(int, in.w, w));
+    cr_assert(eq(int, in.h, h));
+
+    char * actual;
+    size_t actual_size;
+    mem = open_memstream(&actual, &actual_size);
+    pnm_stream_t out;
+    cr_assert(lt(int, 0, open_pnm_writer(&out, mem, in.type, in.w, in.h, in.intensity)));
+
+    // An odd number of rows, so that chunks do not line up with anything
+    const int row_size = w * ints_per_pixel(image.type);
+    int * rows = malloc(7 * row_size * sizeof(int));
+
+    int n;
+    int y = 0;
+    while ((n = read_pnm_rows(&in, rows, 7)) > 0) {
+        cr_assert_arr_eq(rows, whole + y * row_size, n * row_size * sizeof(int),
+            "%s: rows %d..%d differ",
+            image.name,
+            y,
+            y + n
+        );
+        cr_assert(eq(int, write_pnm_rows(&out, rows, n), n));
+        y += n;
+    }
+    cr_expect(eq(int, y, h));
+    fclose(mem);
+
+    cr_assert(eq(int, (int)actual_size, (int)expected_size));
+    cr_expect_arr_eq(actual, expected, expected_size);
+
+    free(rows);
+    free(actual);
+    free(expected);
+    free(whole);
+    fclose(f);
+}
+
+Test(plumblism, stream_roundtrip_pbm_gimp_ascii) {
+    stream_roundtrip_proto(test_images[3]);
+}
+
+Test(plumblism, stream_roundtrip_pgm_gimp_ascii) {
+    stream_roundtrip_proto(test_images[4]);
+}
+
+Test(plumblism, stream_roundtrip_ppm_gimp_ascii) {
+    stream_roundtrip_proto(test_images[5]);
+}
+
+Test(plumblism, stream_roundtrip_pbm_gimp_binary) {
+    stream_roundtrip_proto(test_images[6]);
+}
+
+Test(plumblism, stream_roundtrip_pgm_gimp_binary) {
+    stream_roundtrip_proto(test_images[7]);
+}
+
+Test(plumblism, stream_roundtrip_ppm_gimp_binary) {
+    stream_roundtrip_proto(test_images[8]);
+}
+
+static
+void transcode_proto(struct test_image_t image, pnm_type_t type) {
+    FILE * f = fopen(image.name, "r");
+    crex_assert_file_open(f, image.name);
+
+    int w, h, maxval;
+    const int size = read_pnm_header(f, image.type, &w, &h, &maxval);
+    int * b = malloc(size * sizeof(int));
+    cr_assert(eq(int, read_pnm_data(f, image.type, b, size), size));
+
+    char * expected;
+    size_t expected_size;
+    FILE * mem = open_memstream(&expected, &expected_size);
+    write_pnm_file(mem, type, b, w, h, maxval);
+    fclose(mem);
+
+    rewind(f);
+    char * actual;
+    size_t actual_size;
+    mem = open_memstream(&actual, &actual_size);
+    cr_assert(eq(int, transcode_pnm(f, mem, type, 0), 0));
+    fclose(mem);
+
+    cr_assert(eq(int, (int)actual_size, (int)expected_size), "%s to P%d", image.name, type);
+    cr_expect_arr_eq(actual, expected, expected_size);
+
+    free(expected);
+    free(actual);
+    free(b);
+    fclose(f);
+}
+
+Test(plumblism, transcode_pbm) {
+    transcode_proto(test_images[3], PNM_BIT_BINARY);
+    transcode_proto(test_images[6], PNM_BIT_ASCII);
+}
+Test(plumblism, transcode_pgm) {
+    transcode_proto(test_images[4], PNM_GRE_BINARY);
+    transcode_proto(test_images[7], PNM_GRE_ASCII);
+}
+Test(plumblism, transcode_ppm) {
+    transcode_proto(test_images[5], PNM_PIX_BINARY);
+    transcode_proto(test_images[8], PNM_PIX_ASCII);
+}
+
+Test(plumblism, transcode_luma_and_rescale) {
+    const char ppm[] = "P3\n2 1 255\n255 255 255  10 200 30\n";
+    FILE * in = fmemopen((void *)ppm, sizeof(ppm) - 1, "r");
+
+    char * text;
+    size_t text_size;
+    FILE * mem = open_memstream(&text, &text_size);
+    cr_assert(eq(int, transcode_pnm(in, mem, PNM_GRE_BINARY, 65535), 0));
+    fclose(mem);
+    fclose(in);
+
+    mem = fmemopen(text, text_size, "r");
+    int maxval;
+    cr_assert(eq(int, read_pnm_header(mem, PNM_GRE_BINARY, NULL, NULL, &maxval), 2));
+    cr_expect(eq(int, maxval, 65535));
+    int b[2];
+    cr_assert(eq(int, read_pnm_data(mem, PNM_GRE_BINARY, b, 2), 2));
+    cr_expect(eq(int, b[0], 65535));
+    // (10 * .299 + 200 * .587 + 30 * .114) = 123.8; 124 * 257
+    cr_expect(eq(int, b[1], 124 * 257));
+    fclose(mem);
+    free(text);
+
+    in = fmemopen((void *)ppm, sizeof(ppm) - 1, "r");
+    mem = open_memstream(&text, &text_size);
+    cr_expect(eq(int, transcode_pnm(in, mem, PNM_BIT_ASCII, 0), -1));
+    fclose(mem);
+    fclose(in);
+    free(text);
+
+    const char black[] = "P2\n2 1\n0\n0 0\n";
+    in = fmemopen((void *)black, sizeof(black) - 1, "r");
+    mem = open_memstream(&text, &text_size);
+    cr_expect(eq(int, transcode_pnm(in, mem, PNM_GRE_BINARY, 255), -1));
+    fclose(mem);
+    fclose(in);
+    free(text);
+}
+
+static
+void parallel_read_proto(pnm_type_t type) {
+    static char tmpfilename[] = "/tmp/plumblism-XXXXXX";
+
+    // Large enough to be split
+    const int w = 1024;
+    const int h = 512;
+    const int size = w * h * ints_per_pixel(type);
+    const int mask = (type == PNM_BIT_ASCII ? 0x1 : 0xffff);
+
+    int * original = malloc(size * sizeof(int));
+    int * copy     = malloc(size * sizeof(int));
+    cr_assert_not_null(original);
+    cr_assert_not_null(copy);
+
+    srand(size);
+    for (int i = 0; i < size; i++) { original[i] = rand() & mask; }
+
+    int fd = mkstemp(tmpfilename);
+    cr_assert_neq(fd, -1);
+    FILE * f = fdopen(fd, "w+b");
+    crex_assert_file_open(f, tmpfilename);
+    cr_assert(lt(int, 0, write_pnm_file(f, type, original, w, h, 65535)));
+    fflush(f);
+
+    for (int threads = 1; threads <= 4; threads++) {
+        memset(copy, 0xff, size * sizeof(int));
+        cr_assert(eq(int, read_pnm_header(f, type, NULL, NULL, NULL), size));
+        cr_assert(eq(int, read_pnm_data_parallel(f, type, copy, size, threads), size));
+        cr_assert_arr_eq(copy, original, size * sizeof(int),
+            "%s: mismatch with %d threads",
+            tmpfilename,
+            threads
+        );
+    }
+
+    fclose(f);
+    free(original);
+    free(copy);
+}
+
+Test(plumblism, parallel_read_pbm_ascii) {
+    parallel_read_proto(PNM_BIT_ASCII);
+}
+
+Test(plumblism, parallel_read_pgm_ascii) {
+    parallel_read_proto(PNM_GRE_ASCII);
+}
+
+Test(plumblism, parallel_read_ppm_ascii) {
+    parallel_read_proto(PNM_PIX_ASCII);
+}
+
+static
+void parallel_write_proto(pnm_type_t type) {
+    static char tmpfilename[] = "/tmp/plumblism-XXXXXX";
+
+    const int w = 333;
+    const int h = 257;
+    const int size = w * h * ints_per_pixel(type);
+    const int mask = (type == PNM_BIT_ASCII ? 0x1 : 0xffff);
+
+    int * b = malloc(size * sizeof(int));
+    cr_assert_not_null(b);
+    srand(size);
+    for (int i = 0; i < size; i++) { b[i] = rand() & mask; }
+
+    char * expected;
+    size_t expected_size;
+    FILE * mem = open_memstream(&expected, &expected_size);
+    write_pnm_file(mem, type, b, w, h, 65535);
+    fclose(mem);
+
+    for (int threads = 2; threads <= 5; threads += 3) {
+        // Through stdio
+        char * actual;
+        size_t actual_size;
+        mem = open_memstream(&actual, &actual_size);
+        cr_expect(eq(int, write_pnm_file_parallel(mem, type, b, w, h, 65535, threads), (int)expected_size));
+        fclose(mem);
+        cr_assert(eq(int, (int)actual_size, (int)expected_size));
+        cr_expect_arr_eq(actual, expected, expected_size);
+        free(actual);
+
+        // Through the file descriptor
+        int fd = mkstemp(tmpfilename);
+        cr_assert_neq(fd, -1);
+        FILE * f = fdopen(fd, "w+b");
+        crex_assert_file_open(f, tmpfilename);
+        cr_expect(eq(int, write_pnm_file_parallel(f, type, b, w, h, 65535, threads), (int)expected_size));
+        fputs("#", f);
+        fclose(f);
+        crex_assert_file_size(tmpfilename, expected_size + 1);
+
+        actual = malloc(expected_size);
+        f = fopen(tmpfilename, "r");
+        cr_assert(eq(int, (int)fread(actual, 1, expected_size, f), (int)expected_size));
+        cr_expect_arr_eq(actual, expected, expected_size);
+        fclose(f);
+        free(actual);
+        remove(tmpfilename);
+        strcpy(tmpfilename, "/tmp/plumblism-XXXXXX");
+
+        // Streamed, in uneven chunks of rows
+        mem = open_memstream(&actual, &actual_size);
+        pnm_stream_t out;
+        open_pnm_writer(&out, mem, type, w, h, 65535);
+        const int stride = w * ints_per_pixel(type);
+        for (int y = 0, n = 1; y < h; y += n, n += 37) {
+            const int expected_n = (h - y < n ? h - y : n);
+            cr_expect(eq(int, write_pnm_rows_parallel(&out, b + (size_t)y * stride, n, threads), expected_n));
+        }
+        cr_expect(eq(int, write_pnm_rows_parallel(&out, b, 1, threads), 0));
+        fclose(mem);
+        cr_assert(eq(int, (int)actual_size, (int)expected_size));
+        cr_expect_arr_eq(actual, expected, expected_size);
+        free(actual);
+    }
+
+    free(expected);
+    free(b);
+}
+
+Test(plumblism, parallel_write_more_bands_than_iov_max) {
+    static char tmpfilename[] = "/tmp/plumblism-XXXXXX";
+
+    // A band per row, more of them than a single `writev` takes on Linux
+    const int w = 1;
+    const int h = 1100;
+
+    int * b = malloc(h * sizeof(int));
+    cr_assert_not_null(b);
+    for (int i = 0; i < h; i++) { b[i] = i % 256; }
+
+    char * expected;
+    size_t expected_size;
+    FILE * mem = open_memstream(&expected, &expected_size);
+    write_pnm_file(mem, PNM_GRE_ASCII, b, w, h, 255);
+    fclose(mem);
+
+    int fd = mkstemp(tmpfilename);
+    cr_assert_neq(fd, -1);
+    FILE * f = fdopen(fd, "w+b");
+    crex_assert_file_open(f, tmpfilename);
+    cr_expect(eq(int, write_pnm_file_parallel(f, PNM_GRE_ASCII, b, w, h, 255, h), (int)expected_size));
+    fclose(f);
+    crex_assert_file_size(tmpfilename, expected_size);
+    remove(tmpfilename);
+
+    free(expected);
+    free(b);
+}
+
+Test(plumblism, parallel_write_pbm_ascii) {
+    parallel_write_proto(PNM_BIT_ASCII);
+}
+
+Test(plumblism, parallel_write_pgm_ascii) {
+    parallel_write_proto(PNM_GRE_ASCII);
+}
+
+Test(plumblism, parallel_write_ppm_ascii) {
+    parallel_write_proto(PNM_PIX_ASCII);
+}
+
+Test(plumblism, frames_iterate_and_index) {
+    static char tmpfilename[] = "/tmp/plumblism-XXXXXX";
+
+    const pnm_type_t types[] = { PNM_GRE_BINARY, PNM_PIX_ASCII, PNM_BIT_BINARY, PNM_BIT_ASCII, PNM_PIX_BINARY };
+    const int n_frames = sizeof(types) / sizeof(types[0]);
+    const int w = 13;
+    const int h = 5;
+
+    int * frames[n_frames];
+
+    int fd = mkstemp(tmpfilename);
+    cr_assert_neq(fd, -1);
+    FILE * f = fdopen(fd, "w+b");
+    crex_assert_file_open(f, tmpfilename);
+
+    srand(n_frames);
+    for (int i = 0; i < n_frames; i++) {
+        const int size = w * h * ints_per_pixel(types[i]);
+        const int mask = (types[i] == PNM_BIT_ASCII || types[i] == PNM_BIT_BINARY) ? 0x1 : 0xff;
+        frames[i] = malloc(size * sizeof(int));
+        for (int j = 0; j < size; j++) { frames[i][j] = rand() & mask; }
+        cr_assert(lt(int, 0, write_pnm_file(f, types[i], frames[i], w, h, 255)));
+    }
+
+    int * b = malloc(w * h * 3 * sizeof(int));
+
+    rewind(f);
+    pnm_frame_t frame;
+    for (int i = 0; i < n_frames; i++) {
+        const int size = read_pnm_frame(f, &frame);
+        cr_assert(eq(int, size, w * h * ints_per_pixel(types[i])));
+        cr_assert(eq(int, frame.type, types[i]));
+        cr_assert(eq(int, read_pnm_frame_data(f, &frame, b, size), size));
+        cr_assert_arr_eq(b, frames[i], size * sizeof(int), "frame %d differs", i);
+    }
+    cr_expect(eq(int, read_pnm_frame(f, &frame), 0));
+
+    rewind(f);
+    pnm_index_t index;
+    cr_assert(eq(int, index_pnm_frames(f, &index), n_frames));
+
+    for (int i = n_frames - 1; i >= 0; i -= 2) {
+        const int size = w * h * ints_per_pixel(types[i]);
+        cr_assert(eq(int, seek_pnm_frame(f, &index, i), 0));
+        cr_assert(eq(int, read_pnm_frame_data(f, &index.frames[i], b, size), size));
+        cr_assert_arr_eq(b, frames[i], size * sizeof(int), "indexed frame %d differs", i);
+    }
+    cr_expect(eq(int, seek_pnm_frame(f, &index, n_frames), -1));
+
+    free_pnm_index(&index);
+    for (int i = 0; i < n_frames; i++) { free(frames[i]); }
+    free(b);
+    fclose(f);
+}
+
+Test(plumblism, frames_index_rasters_too_large_for_a_buffer) {
+    // 2.5 GB of holes between the two headers
+    char filename[] = "/tmp/plumblism-XXXXXX";
+    int fd = mkstemp(filename);
+    cr_assert_neq(fd, -1);
+    FILE * f = fdopen(fd, "w+b");
+    crex_assert_file_open(f, filename);
+
+    const long long raster = 50000LL * 50000;
+    fputs("P5 50000 50000 255\n", f);
+    cr_assert(eq(int, fseek(f, raster, SEEK_CUR), 0));
+    fputs("P5 1 1 255\n\x07", f);
+    fflush(f);
+
+    rewind(f);
+    pnm_frame_t frame;
+    cr_expect(eq(int, read_pnm_frame(f, &frame), -1));
+
+    rewind(f);
+    pnm_index_t index;
+    cr_assert(eq(int, index_pnm_frames(f, &index), 2));
+    cr_expect(eq(int, index.frames[0].w, 50000));
+    cr_expect(eq(int, index.frames[1].offset == 19 + raster, 1));
+
+    int b;
+    cr_assert(eq(int, seek_pnm_frame(f, &index, 1), 0));
+    cr_assert(eq(int, read_pnm_frame_data(f, &index.frames[1], &b, 1), 1));
+    cr_expect(eq(int, b, 7));
+
+    free_pnm_index(&index);
+    fclose(f);
+    unlink(filename);
+}
+
+Test(plumblism, frames_read_with_their_own_geometry) {
+    // The second frame is wider and has words for samples
+    const char stream[] =
+        "P4 3 2\n\xA0\x40"
+        "P5 3 1 1000\n\x00\x01\x01\x00\x03\xE8"
+    ;
+    const int expected_bits[]  = { 1, 0, 1, 0, 1, 0 };
+    const int expected_words[] = { 1, 256, 1000 };
+
+    int fds[2];
+    cr_assert(eq(int, pipe(fds), 0));
+    cr_assert(eq(int, write(fds[1], stream, sizeof(stream) - 1), (int)sizeof(stream) - 1));
+    close(fds[1]);
+
+    // Neither seekable, nor starting with the same geometry as the later frame
+    FILE * f = fdopen(fds[0], "rb");
+    pnm_frame_t frame;
+    int b[6];
+
+    cr_assert(eq(int, read_pnm_frame(f, &frame), 6));
+    cr_assert(eq(int, read_pnm_data(f, frame.type, b, 6), 6));
+    cr_expect_arr_eq(b, expected_bits, sizeof(expected_bits));
+
+    cr_assert(eq(int, read_pnm_frame(f, &frame), 3));
+    uint16_t words[3];
+    cr_assert(eq(int, read_pnm_data_u16(f, frame.type, words, 3), 3));
+    for (int i = 0; i < 3; i++) { cr_expect(eq(int, words[i], expected_words[i])); }
+    fclose(f);
+
+    // Without a header on record, the first one of the stream is gone back to
+    f = fmemopen((void *)stream, sizeof(stream) - 1, "rb");
+    pnm_frame_t first;
+    cr_assert(eq(int, read_pnm_frame(f, &first), 6));
+    fseek(f, first.data_offset + 2, SEEK_SET);
+    cr_assert(eq(int, read_pnm_frame(f, &frame), 3));
+
+    fseek(f, first.data_offset, SEEK_SET);
+    cr_assert(eq(int, read_pnm_data(f, first.type, b, 6), 6));
+    cr_expect_arr_eq(b, expected_bits, sizeof(expected_bits));
+
+    // Or the geometry is passed explicitly
+    fseek(f, first.data_offset, SEEK_SET);
+    uint8_t bits[6];
+    cr_assert(eq(int, read_pnm_frame_data_u8(f, &first, bits, 6), 6));
+    for (int i = 0; i < 6; i++) { cr_expect(eq(int, bits[i], expected_bits[i])); }
+    fclose(f);
+}
+
+Test(plumblism, frames_read_from_a_pipe_in_ascii) {
+    const char stream[] =
+        "P2 3 1 255\n1 # dim\n2 3\n"
+        "P3 1 1 255\n4 5 6\n"
+    ;
+    const int expected_gray[] = { 1, 2, 3 };
+    const int expected_pix[]  = { 4, 5, 6 };
+
+    int fds[2];
+    cr_assert(eq(int, pipe(fds), 0));
+    cr_assert(eq(int, write(fds[1], stream, sizeof(stream) - 1), (int)sizeof(stream) - 1));
+    close(fds[1]);
+
+    // Nothing after the first raster may be read ahead, it could not be seeked back to
+    FILE * f = fdopen(fds[0], "r");
+    pnm_frame_t frame;
+    int b[3];
+
+    cr_assert(eq(int, read_pnm_frame(f, &frame), 3));
+    cr_assert(eq(int, read_pnm_data(f, frame.type, b, 3), 3));
+    cr_expect_arr_eq(b, expected_gray, sizeof(expected_gray));
+
+    cr_assert(eq(int, read_pnm_frame(f, &frame), 3));
+    cr_expect(eq(int, frame.type, PNM_PIX_ASCII));
+    cr_assert(eq(int, read_pnm_data(f, frame.type, b, 3), 3));
+    cr_expect_arr_eq(b, expected_pix, sizeof(expected_pix));
+    fclose(f);
+}
+
+Test(plumblism, headers_of_other_streams_leave_reads_be) {
+    const char bits[]  = "P4 3 2\n\xA0\x40";
+    const char words[] = "P5 3 1 1000\n\x00\x01\x01\x00\x03\xE8";
+    const int expected_bits[]  = { 1, 0, 1, 0, 1, 0 };
+    const int expected_words[] = { 1, 256, 1000 };
+
+    FILE * a = fmemopen((void *)bits,  sizeof(bits)  - 1, "rb");
+    FILE * b = fmemopen((void *)words, sizeof(words) - 1, "rb");
+
+    cr_assert(eq(int, read_pnm_header(a, PNM_BIT_BINARY, NULL, NULL, NULL), 6));
+    cr_assert(eq(int, read_pnm_header(b, PNM_GRE_BINARY, NULL, NULL, NULL), 3));
+
+    int pixels[6];
+    cr_assert(eq(int, read_pnm_data(a, PNM_BIT_BINARY, pixels, 6), 6));
+    cr_expect_arr_eq(pixels, expected_bits, sizeof(expected_bits));
+    cr_assert(eq(int, read_pnm_data(b, PNM_GRE_BINARY, pixels, 3), 3));
+    cr_expect_arr_eq(pixels, expected_words, sizeof(expected_words));
+
+    fclose(a);
+    fclose(b);
+}
+
+Test(plumblism, bits_without_width) {
+    const char header[] = "P4\n0 5\n";
+    FILE * f = fmemopen((void *)header, sizeof(header) - 1, "rb");
+
+    int b[1];
+    uint8_t bytes[1];
+    cr_assert(eq(int, read_pnm_header(f, PNM_BIT_BINARY, NULL, NULL, NULL), 0));
+    cr_expect(eq(int, read_pnm_data(f, PNM_BIT_BINARY, b, 0), 0));
+    cr_assert(eq(int, read_pnm_header(f, PNM_BIT_BINARY, NULL, NULL, NULL), 0));
+    cr_expect(eq(int, read_pnm_data_u8(f, PNM_BIT_BINARY, bytes, 0), 0));
+    fclose(f);
+
+    f = tmpfile();
+    cr_assert(lt(int, -1, write_pnm_file(f, PNM_BIT_BINARY, b, 0, 5, 1)));
+    cr_expect(eq(long, ftell(f), (long)sizeof(header) - 1));
+    fclose(f);
+}
+
+static
+void count_stats_calls(const char * call, const pnm_stats_t * stats, void * user) {
+    (void)call;
+    (void)stats;
+    ++*(int *)user;
+}
+
+Test(plumblism, stats_count_reads_and_writes) {
+    struct test_image_t image = test_images[4]; // GIMP's PGM, with a comment in the header
+    const int size = image.width * image.height;
+
+    int calls = 0;
+    set_pnm_stats_callback(count_stats_calls, &calls);
+    reset_pnm_stats();
+
+    FILE * f = fopen(image.name, "r");
+    crex_assert_file_open(f, image.name);
+    int * b = malloc(size * sizeof(int));
+    get_pnm_type(f);
+    cr_assert(eq(int, read_pnm_header(f, image.type, NULL, NULL, NULL), size));
+    cr_assert(eq(int, read_pnm_data(f, image.type, b, size), size));
+    const long file_size = ftell(f);
+    fclose(f);
+
+    char * text;
+    size_t text_size;
+    FILE * mem = open_memstream(&text, &text_size);
+    const int written = write_pnm_file(mem, image.type, b, image.width, image.height, 255);
+    fclose(mem);
+    free(text);
+    free(b);
+
+    set_pnm_stats_callback(NULL, NULL);
+
+    pnm_stats_t stats;
+    get_pnm_stats(&stats);
+  #ifdef PLUMBLISM_STATS
+    cr_expect(eq(int, calls, 3));
+    cr_expect(eq(int, (int)stats.calls, 3));
+    cr_expect(eq(int, (int)stats.samples_read, size));
+    cr_expect(eq(int, (int)stats.bytes_read, (int)file_size - 2)); // but the magic
+    cr_expect(eq(int, (int)stats.comment_bytes, (int)strlen("# Created by GIMP version 3.2.0 PNM plug-in\n")));
+    cr_expect(eq(int, (int)stats.samples_written, size));
+    cr_expect(eq(int, (int)stats.bytes_written, written));
+  #else
+    (void)file_size;
+    (void)written;
+    cr_expect(eq(int, calls, 0));
+    cr_expect(eq(int, (int)stats.calls, 0));
+  #endif
+}
@@ -1,5 +1,40 @@
 #include <plumblism.h>
+#include <plumblism.hpp>
+
+// Decoded by the compiler
+constexpr std::string_view icon = "P2\n# icon\n3 2\n255\n0 64 128\n192 255 7\n";
+constexpr auto icon_header = pnm::parse_header(icon);
+static_assert(icon_header && icon_header->w == 3 && icon_header->h == 2);
+
+constexpr auto icon_pixels = pnm::embed<pnm::P2, uint8_t, icon_header->samples()>(icon);
+static_assert(icon_pixels && (*icon_pixels)[2] == 128 && (*icon_pixels)[5] == 7);
+
+constexpr std::string_view mask = "P4 10 1\n\xA5\xC0";
+constexpr auto mask_pixels = pnm::embed<pnm::P4, uint8_t, 10>(mask);
+static_assert(mask_pixels && (*mask_pixels)[0] == 1 && (*mask_pixels)[1] == 0 && (*mask_pixels)[9] == 1);
+
+// Wrong format, does not fit the samples
+static_assert(!pnm::reader<pnm::P3, uint8_t>::parse(icon));
+static_assert(!pnm::embed<pnm::P3, uint8_t, 2>("P3 1 1 65535 0 0 65535\n"));
+static_assert(!pnm::embed<pnm::P2, uint8_t, 1>("P2 1 1 1000 7\n"));
 
 signed main(void) {
+    FILE * f = tmpfile();
+    if (!f) { return 1; }
+
+    pnm::image<uint16_t> out(2, 1, 3, 1000);
+    for (int i = 0; i < 6; i++) { out.samples()[i] = i * 200; }
+    if (pnm::writer<pnm::P6, uint16_t>::write(f, out) <= 0) { return 1; }
+
+    rewind(f);
+    const auto in = pnm::reader<pnm::P6, uint16_t>::load(f);
+    fclose(f);
+
+    if (!in
+    ||  in->maxval() != 1000
+    ||  in->row(0)[5] != 1000) {
+        return 1;
+    }
+
     return 0;
 }
@@ -0,0 +1,265 @@
+#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <plumblism.h>
+
+/* Allocations are counted by wrapping the allocator at link time:
+ *  -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc
+ * (see the `bench` target of the Makefile).
+ */
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t n, size_t size);
+void * __real_realloc(void * p, size_t size);
+
+static long allocations = 0;
+
+void * __wrap_malloc(size_t size) {
+    ++allocations;
+    return __real_malloc(size);
+}
+void * __wrap_calloc(size_t n, size_t size) {
+    ++allocations;
+    return __real_calloc(n, size);
+}
+void * __wrap_realloc(void * p, size_t size) {
+    ++allocations;
+    return __real_realloc(p, size);
+}
+
+double min_time       = 0.25;
+int    min_iterations = 3;
+const char * write_file_name = "/dev/null";
+
+static
+void usage(void) {
+    puts(
+        "\n"
+        "Usage:\n"
+        "bench [options] <file>+\n"
+        "\n"
+        "Times reading and writing each file, one tab separated line per operation.\n"
+        "\n"
+        "Options:\n"
+        "    -h:                   Print this help.\n"
+        "    -t <seconds> : Minimum time spent on each operation (default:0.25).\n"
+        "    -n <num>     : Minimum number of iterations of each operation (default:3).\n"
+        "    -w <file>    : Where the writes go (default:/dev/null).\n"
+        "\n"
+    );
+}
+
+static
+void parse_opts(int argc, char * * argv) {
+    static struct option long_options[] = {
+        { "help",       no_argument,       0, 'h' },
+        { "time",       required_argument, 0, 't' },
+        { "iterations", required_argument, 0, 'n' },
+        { "write-to",   required_argument, 0, 'w' },
+        { 0, 0, 0, 0 }
+    };
+
+    int opt;
+    int opt_index = 0;
+
+    while ((opt = getopt_long(argc, argv, "ht:n:w:", long_options, &opt_index)) != -1) {
+        switch (opt) {
+            case 'h': {
+                usage();
+            } exit(0);
+            case 't': {
+                min_time = atof(optarg);
+            } break;
+            case 'n': {
+                min_iterations = atoi(optarg);
+            } break;
+            case 'w': {
+                write_file_name = optarg;
+            } break;
+            case '?':
+            default: {
+                fprintf(stderr, "Error: Unknown command-line option.\n");
+            } exit(1);
+        }
+    }
+
+    if (optind == argc) {
+        usage();
+        exit(1);
+    }
+}
+
+static
+double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+typedef struct {
+    const char * file;
+    pnm_type_t type;
+    int w;
+    int h;
+    int intensity;
+    long size;      // of the file, in bytes
+    long header;    // size of the header, in bytes
+} subject_t;
+
+typedef struct {
+    double seconds;     // per iteration
+    long bytes;         // per iteration
+    double allocations; // per iteration
+} measurement_t;
+
+typedef enum {
+    READ_HEADER,
+    READ_DATA,
+    WRITE_FILE,
+} operation_t;
+
+static const char * const operation_names[] = {
+    [READ_HEADER] = "read_pnm_header",
+    [READ_DATA]   = "read_pnm_data",
+    [WRITE_FILE]  = "write_pnm_file",
+};
+
+/* Only the operation itself is timed, seeking back and such are not.
+ */
+static
+int run_once(operation_t op, FILE * f, FILE * out, const subject_t * s, int * b, int size, double * seconds) {
+    rewind(f);
+    if (op == WRITE_FILE) { rewind(out); }
+
+    double start = now();
+
+    get_pnm_type(f);
+    const int r = read_pnm_header(f, s->type, NULL, NULL, NULL);
+    if (r != size) { return -1; }
+
+    switch (op) {
+        case READ_HEADER: {
+        } break;
+        case READ_DATA: {
+            start = now();
+            if (read_pnm_data(f, s->type, b, size) != size) { return -1; }
+        } break;
+        case WRITE_FILE: {
+            start = now();
+            if (write_pnm_file(out, s->type, b, s->w, s->h, s->intensity) <= 0) { return -1; }
+            fflush(out);
+        } break;
+    }
+
+    *seconds = now() - start;
+
+    return 0;
+}
+
+static
+int measure(operation_t op, FILE * f, FILE * out, const subject_t * s, int * b, int size, measurement_t * m) {
+    double total = 0;
+    double best  = -1;
+    int iterations = 0;
+
+    const long allocations_before = allocations;
+    while (iterations < min_iterations
+    ||     total < min_time) {
+        double seconds;
+        if (run_once(op, f, out, s, b, size, &seconds)) { return -1; }
+
+        total += seconds;
+        if (best < 0 || seconds < best) { best = seconds; }
+        ++iterations;
+    }
+
+    m->seconds     = best;
+    m->bytes       = (op == READ_HEADER ? s->header : s->size - s->header);
+    m->allocations = (double)(allocations - allocations_before) / iterations;
+
+    return 0;
+}
+
+static
+int bench_file(const char * file_name, FILE * out) {
+    FILE * f = fopen(file_name, "r");
+    if (!f) {
+        fprintf(stderr, "Error: Failed to open '%s'.\n", file_name);
+        return 1;
+    }
+
+    subject_t s = { .file = file_name };
+    s.type = get_pnm_type(f);
+    const int size = read_pnm_header(f, s.type, &s.w, &s.h, &s.intensity);
+    s.header = ftell(f);
+    fseek(f, 0, SEEK_END);
+    s.size = ftell(f);
+
+    if (size == -1) {
+        fprintf(stderr, "Error: '%s' is not a supported image.\n", file_name);
+        fclose(f);
+        return 1;
+    }
+
+    int * b = malloc((size_t)size * sizeof(int));
+    if (!b) {
+        fprintf(stderr, "Error: Out of memory for '%s'.\n", file_name);
+        fclose(f);
+        return 1;
+    }
+
+    int r = 0;
+    // `READ_DATA` leaves the image in `b` for `WRITE_FILE`
+    for (operation_t op = READ_HEADER; op <= WRITE_FILE; op++) {
+        measurement_t m;
+        if (measure(op, f, out, &s, b, size, &m)) {
+            fprintf(stderr, "Error: %s failed on '%s'.\n", operation_names[op], file_name);
+            r = 1;
+            break;
+        }
+
+        printf("%s\tP%d\t%d\t%d\t%s\t%.9f\t%.3f\t%.0f\t%.2f\n",
+            s.file,
+            s.type,
+            s.w,
+            s.h,
+            operation_names[op],
+            m.seconds,
+            m.bytes / m.seconds / 1e6,
+            (double)s.w * s.h / m.seconds,
+            m.allocations
+        );
+        fflush(stdout);
+    }
+
+    free(b);
+    fclose(f);
+
+    return r;
+}
+
+int main(int argc, char * argv[]) {
+    parse_opts(argc, argv);
+
+    FILE * out = fopen(write_file_name, "w");
+    if (!out) {
+        fprintf(stderr, "Error: Failed to open output file '%s'.\n", write_file_name);
+        return 1;
+    }
+
+    puts("file\ttype\twidth\theight\toperation\tseconds\tMB/s\tpixels/s\tallocations");
+
+    int r = 0;
+    for (int i = optind; i < argc; i++) {
+        r |= bench_file(argv[i], out);
+    }
+
+    fclose(out);
+
+    return r;
+}
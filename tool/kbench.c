@@ -0,0 +1,374 @@
+/* Microbenchmarks of the individual kernels, over buffers in memory.
+ * The kernels are internal to the library, so it is compiled right into this file.
+ * Where `perf_event_open(2)` is allowed, cycles, instructions and branch misses
+ *  are counted in user space; otherwise only the time is.
+ */
+#include "plumblism.c"
+
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/perf_event.h>)
+#  define KBENCH_PERF
+#  include <linux/perf_event.h>
+#  include <sys/ioctl.h>
+#  include <sys/syscall.h>
+# endif
+#endif
+
+#include <time.h>
+
+double min_time = 0.2;
+int    size     = 1 << 20;  // bytes of input (or output) per run
+
+static
+void usage(void) {
+    puts(
+        "\n"
+        "Usage:\n"
+        "kbench [options] [<kernel>]*\n"
+        "\n"
+        "Runs the given kernels (default: all of them) at every SIMD level the CPU has,\n"
+        "one tab separated line per kernel and level.\n"
+        "\n"
+        "Options:\n"
+        "    -h:                   Print this help.\n"
+        "    -t <seconds> : Minimum time spent on each kernel (default:0.2).\n"
+        "    -s <bytes>   : Size of the buffer worked on (default:1048576).\n"
+        "    -l           : List the kernels.\n"
+        "\n"
+    );
+}
+
+// --- Counters
+typedef enum {
+    CYCLES,
+    INSTRUCTIONS,
+    BRANCHES,
+    BRANCH_MISSES,
+    N_COUNTERS,
+} counter_t;
+
+typedef struct {
+    int fd[N_COUNTERS];
+    bool ok;
+} counters_t;
+
+static
+void open_counters(counters_t * c) {
+    c->ok = false;
+  #ifdef KBENCH_PERF
+    static const uint64_t configs[N_COUNTERS] = {
+        [CYCLES]        = PERF_COUNT_HW_CPU_CYCLES,
+        [INSTRUCTIONS]  = PERF_COUNT_HW_INSTRUCTIONS,
+        [BRANCHES]      = PERF_COUNT_HW_BRANCH_INSTRUCTIONS,
+        [BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+    };
+
+    for (int i = 0; i < N_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size           = sizeof(attr);
+        attr.type           = PERF_TYPE_HARDWARE;
+        attr.config         = configs[i];
+        attr.disabled       = (i == 0);
+        attr.exclude_kernel = 1;
+        attr.exclude_hv     = 1;
+        attr.read_format    = PERF_FORMAT_GROUP;
+
+        c->fd[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, (i == 0 ? -1 : c->fd[0]), 0);
+        if (c->fd[i] == -1) {
+            for (int k = 0; k < i; k++) { close(c->fd[k]); }
+            return;
+        }
+    }
+    c->ok = true;
+  #endif
+}
+
+static
+void close_counters(counters_t * c) {
+    if (!c->ok) { return; }
+    for (int i = 0; i < N_COUNTERS; i++) { close(c->fd[i]); }
+}
+
+static
+void start_counters(counters_t * c) {
+  #ifdef KBENCH_PERF
+    if (!c->ok) { return; }
+    ioctl(c->fd[0], PERF_EVENT_IOC_RESET,  PERF_IOC_FLAG_GROUP);
+    ioctl(c->fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  #else
+    (void)c;
+  #endif
+}
+
+static
+void stop_counters(counters_t * c, uint64_t * values) {
+    memset(values, 0, N_COUNTERS * sizeof(uint64_t));
+  #ifdef KBENCH_PERF
+    if (!c->ok) { return; }
+    ioctl(c->fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+    uint64_t group[1 + N_COUNTERS];
+    if (read(c->fd[0], group, sizeof(group)) == (ssize_t)sizeof(group)) {
+        memcpy(values, group + 1, N_COUNTERS * sizeof(uint64_t));
+    }
+  #else
+    (void)c;
+  #endif
+}
+
+static
+double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// --- Kernels
+/* Every kernel works through `bytes` bytes of text or packed data per run,
+ *  which is what the rates are given against.
+ */
+typedef struct {
+    char    * text;     // ASCII samples, padded in front for the lexer
+    size_t    text_size;
+    int     * ints;
+    int       n_ints;
+    uint8_t * raw;
+    FILE    * stream;   // over `text`
+} buffers_t;
+
+typedef struct {
+    const char * name;
+    bool has_simd;
+    size_t (*prepare)(buffers_t * b);   // returns the bytes per run
+    void (*run)(buffers_t * b);
+} kernel_t;
+
+static
+uint32_t next_random(void) {
+    static uint64_t x = 0x9E3779B97F4A7C15ull;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return (uint32_t)(x >> 32);
+}
+
+/* Random samples below `top`, formatted the way `write_pnm_file` does.
+ */
+static
+size_t prepare_text(buffers_t * b, int top, format_row_fn format_row, int channels) {
+    const int w = 16;
+    const size_t row_max = format_row_max(w, channels);
+
+    free(b->ints);
+    b->n_ints = 0;
+    b->ints   = (int *)malloc(((size_t)size / 2 + w * channels) * sizeof(int));
+
+    free(b->text);
+    b->text = (char *)malloc(lex_pad + size + row_max + 1);
+    memset(b->text, ' ', lex_pad);
+
+    char * const base = b->text + lex_pad;
+    char * p = base;
+    while ((size_t)(p - base) < (size_t)size) {
+        int * row = b->ints + b->n_ints;
+        for (int i = 0; i < w * channels; i++) { row[i] = next_random() % top; }
+        p = format_row(p, row, w);
+        b->n_ints += w * channels;
+    }
+    b->text_size = p - base;
+
+    return b->text_size;
+}
+
+static
+size_t prepare_raw(buffers_t * b, int n_ints, size_t bytes, int mask) {
+    free(b->ints);
+    free(b->raw);
+    b->n_ints = n_ints;
+    b->ints   = (int *)malloc(n_ints * sizeof(int));
+    b->raw    = (uint8_t *)malloc(bytes + 32);
+    for (size_t i = 0; i < bytes + 32; i++) { b->raw[i] = next_random(); }
+    for (int i = 0; i < n_ints; i++) { b->ints[i] = next_random() & mask; }
+
+    return bytes;
+}
+
+static size_t prepare_lex(buffers_t * b) { return prepare_text(b, 256, format_gray_row, 1); }
+static void run_lex(buffers_t * b) {
+    const char * s = b->text + lex_pad;
+    const char * stop;
+    int r = 0;
+    lex_block_kernel()(s, s + b->text_size, b->ints, b->n_ints, &r, &stop);
+    assert(r == b->n_ints);
+}
+
+static size_t prepare_p1(buffers_t * b) {
+    const size_t r = prepare_text(b, 2, format_bit_row, 1);
+    if (b->stream) { fclose(b->stream); }
+    b->stream = fmemopen(b->text + lex_pad, b->text_size, "r");
+    return r;
+}
+static void run_p1(buffers_t * b) {
+    rewind(b->stream);
+    read_pnm_bit_ascii_data(b->stream, b->ints, b->n_ints);
+}
+
+static size_t prepare_bits(buffers_t * b) { return prepare_raw(b, size * 8, size, 0x1); }
+static void run_unpack_bits(buffers_t * b) { unpack_bits(b->ints, b->raw, b->n_ints); }
+static void run_pack_bits(buffers_t * b)   { pack_bits(b->raw, b->ints, b->n_ints); }
+
+static size_t prepare_u8(buffers_t * b) { return prepare_raw(b, size, size, 0xff); }
+static void run_widen_u8(buffers_t * b)  { widen_u8(b->ints, b->raw, b->n_ints); }
+static void run_narrow_u8(buffers_t * b) { narrow_u8(b->raw, b->ints, b->n_ints); }
+
+static size_t prepare_u16(buffers_t * b) { return prepare_raw(b, size / 2, size, 0xffff); }
+static void run_widen_u16be(buffers_t * b)  { widen_u16be(b->ints, b->raw, b->n_ints); }
+static void run_narrow_u16be(buffers_t * b) { narrow_u16be(b->raw, b->ints, b->n_ints); }
+
+static size_t prepare_format_bit(buffers_t * b)  { return prepare_text(b, 2,   format_bit_row,  1); }
+static size_t prepare_format_gray(buffers_t * b) { return prepare_text(b, 256, format_gray_row, 1); }
+static size_t prepare_format_pix(buffers_t * b)  { return prepare_text(b, 256, format_pix_row,  3); }
+
+static
+void run_format(buffers_t * b, format_row_fn format_row, int channels) {
+    const int w = 16;
+    char * p = b->text + lex_pad;
+    for (int i = 0; i < b->n_ints; i += w * channels) {
+        p = format_row(p, b->ints + i, w);
+    }
+}
+static void run_format_bit(buffers_t * b)  { run_format(b, format_bit_row,  1); }
+static void run_format_gray(buffers_t * b) { run_format(b, format_gray_row, 1); }
+static void run_format_pix(buffers_t * b)  { run_format(b, format_pix_row,  3); }
+
+static const kernel_t kernels[] = {
+    { "lex",          true,  prepare_lex,         run_lex,          },
+    { "p1_ascii",     false, prepare_p1,          run_p1,           },
+    { "unpack_bits",  true,  prepare_bits,        run_unpack_bits,  },
+    { "pack_bits",    true,  prepare_bits,        run_pack_bits,    },
+    { "widen_u8",     true,  prepare_u8,          run_widen_u8,     },
+    { "narrow_u8",    true,  prepare_u8,          run_narrow_u8,    },
+    { "widen_u16be",  true,  prepare_u16,         run_widen_u16be,  },
+    { "narrow_u16be", true,  prepare_u16,         run_narrow_u16be, },
+    { "format_bit",   false, prepare_format_bit,  run_format_bit,   },
+    { "format_gray",  false, prepare_format_gray, run_format_gray,  },
+    { "format_pix",   false, prepare_format_pix,  run_format_pix,   },
+};
+static const int n_kernels = sizeof(kernels) / sizeof(kernels[0]);
+
+static const char * const simd_names[] = {
+    [PNM_SIMD_AUTO]   = "auto",
+    [PNM_SIMD_SCALAR] = "scalar",
+    [PNM_SIMD_SSE2]   = "sse2",
+    [PNM_SIMD_AVX2]   = "avx2",
+};
+
+static
+void bench_kernel(const kernel_t * k, buffers_t * b, counters_t * c) {
+    const size_t bytes = k->prepare(b);
+
+    const pnm_simd_t top = (k->has_simd ? pnm_simd_supported() : PNM_SIMD_SCALAR);
+    for (pnm_simd_t level = PNM_SIMD_SCALAR; level <= top; level++) {
+        if (pnm_set_simd(level) != level) { continue; }
+
+        k->run(b); // warm up
+
+        long runs = 0;
+        double seconds = 0;
+        uint64_t totals[N_COUNTERS] = { 0 };
+        while (seconds < min_time) {
+            uint64_t values[N_COUNTERS];
+            const double start = now();
+            start_counters(c);
+            k->run(b);
+            stop_counters(c, values);
+            seconds += now() - start;
+            for (int i = 0; i < N_COUNTERS; i++) { totals[i] += values[i]; }
+            ++runs;
+        }
+
+        const double total_bytes = (double)bytes * runs;
+        printf("%s\t%s\t%zu\t%ld\t%.4f\t%.3f",
+            k->name,
+            (k->has_simd ? simd_names[level] : "-"),
+            bytes,
+            runs,
+            seconds * 1e9 / total_bytes,
+            total_bytes / seconds / 1e6
+        );
+        if (c->ok) {
+            printf("\t%.4f\t%.4f\t%.5f\n",
+                totals[CYCLES]       / total_bytes,
+                totals[INSTRUCTIONS] / total_bytes,
+                (totals[BRANCHES] ? (double)totals[BRANCH_MISSES] / totals[BRANCHES] : 0)
+            );
+        } else {
+            printf("\tnan\tnan\tnan\n");
+        }
+        fflush(stdout);
+    }
+
+    pnm_set_simd(PNM_SIMD_AUTO);
+}
+
+int main(int argc, char * argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "ht:s:l")) != -1) {
+        switch (opt) {
+            case 'h': {
+                usage();
+            } return 0;
+            case 't': {
+                min_time = atof(optarg);
+            } break;
+            case 's': {
+                size = atoi(optarg);
+            } break;
+            case 'l': {
+                for (int i = 0; i < n_kernels; i++) { puts(kernels[i].name); }
+            } return 0;
+            default: {
+                usage();
+            } return 1;
+        }
+    }
+
+    if (size < 64) { size = 64; }
+
+    counters_t c;
+    open_counters(&c);
+    if (!c.ok) {
+        fprintf(stderr, "Note: perf_event_open is not available, only timing.\n");
+    }
+
+    puts("kernel\tsimd\tbytes\truns\tns/byte\tMB/s\tcycles/byte\tinstructions/byte\tbranch_miss_rate");
+
+    buffers_t b;
+    memset(&b, 0, sizeof(b));
+
+    int r = 0;
+    for (int i = 0; i < n_kernels; i++) {
+        bool wanted = (optind == argc);
+        for (int k = optind; k < argc; k++) {
+            if (!strcmp(argv[k], kernels[i].name)) { wanted = true; }
+        }
+        if (wanted) { bench_kernel(&kernels[i], &b, &c); }
+    }
+    for (int k = optind; k < argc; k++) {
+        bool known = false;
+        for (int i = 0; i < n_kernels; i++) { known |= !strcmp(argv[k], kernels[i].name); }
+        if (!known) {
+            fprintf(stderr, "Error: Unknown kernel '%s'.\n", argv[k]);
+            r = 1;
+        }
+    }
+
+    if (b.stream) { fclose(b.stream); }
+    free(b.text);
+    free(b.ints);
+    free(b.raw);
+    close_counters(&c);
+
+    return r;
+}
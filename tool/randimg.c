@@ -6,11 +6,17 @@
 #include <stdbool.h>
 #include <math.h>
 #include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <plumblism.h>
 
 #define W_DEFAULT 256
 #define H_DEFAULT 256
+#define BAND_SAMPLES (8 << 20)
+#define BAND_TEXT    (64 << 20)
+#define SAMPLE_MAX    10    // digits; the widest the parser takes without overflowing
+#define SEPARATOR_MAX 24
 
 char * output_file_name = NULL;
 
@@ -18,17 +24,59 @@ typedef enum {
     PBM = 1,
     PGM,
     PPM,
+    PFM,
 } basetype_t;
 
+typedef enum {
+    RANDOM,
+    GRADIENT,
+    CHECKERBOARD,
+} pattern_t;
+
+/* How ASCII samples (and the header of any type) are laid out.
+ */
+typedef enum {
+    PLAIN,      // as `write_pnm_file` would
+    WIDE,       // every number zero padded to `SAMPLE_MAX` digits
+    DENSE,      // a single space between numbers; none at all in PBM
+    SLOPPY,     // runs of spaces, tabs, CRs and LFs
+    COMMENTED,  // comments all over the header and between samples
+    GLUED,      // numbers directly followed by a comment
+} style_t;
+
+static const char * const pattern_names[] = {
+    [RANDOM]       = "random",
+    [GRADIENT]     = "gradient",
+    [CHECKERBOARD] = "checkerboard",
+};
+
+static const char * const style_names[] = {
+    [PLAIN]     = "plain",
+    [WIDE]      = "wide",
+    [DENSE]     = "dense",
+    [SLOPPY]    = "sloppy",
+    [COMMENTED] = "commented",
+    [GLUED]     = "glued",
+};
+
 bool is_ascii = false;
+bool is_rgb   = true;
 
 basetype_t basetype = PGM;
+pattern_t  pattern  = RANDOM;
+style_t    style    = PLAIN;
 
 FILE * output_file;
 
 int w = W_DEFAULT;
 int h = H_DEFAULT;
 
+int maxval = 255;
+int cell   = 8;
+
+uint64_t seed    = 1;
+int      threads = 0;
+
 static
 void usage(void) {
     puts(
@@ -38,20 +86,47 @@ void usage(void) {
         "\n"
         "Options:\n"
         "    -h:                            Print this help.\n"
-        "    --pbm        : Generate a PBM image with random content (default).\n"
-        "    --pgm        : Generate a PGM image with random content.\n"
+        "    --pbm        : Generate a PBM image with random content.\n"
+        "    --pgm        : Generate a PGM image with random content (default).\n"
         "    --ppm        : Generate a PPM image with random content.\n"
         "    --pfm        : Generate a PFM image with random content.\n"
-        "    --ascii      : Emit PNM image in the ASCII format (default).\n"
-        "    --binary     : Emit PNM image in the binary format.\n"
+        "    --ascii      : Emit PNM image in the ASCII format.\n"
+        "    --binary     : Emit PNM image in the binary format (default).\n"
         "    --rgb        : Emit a color PFM image (default).\n"
         "    --greyscale  : Emit a greyscale PFM image.\n"
         "    -x <num>     : Value for the x-dimension of the image (default:256).\n"
         "    -y <num>     : Value for the y-dimension of the image (default:256).\n"
+        "    --maxval <num> : Maximum sample value of PGM and PPM images (default:255).\n"
+        "    --seed <num> : Seed; equal seeds give equal images (default:1).\n"
+        "    -j <num>     : Number of threads (default:one per CPU).\n"
+        "\n"
+        "    --pattern <name> : What the image shows:\n"
+        "        random       : Uniform noise (default).\n"
+        "        gradient     : Smooth ramps; dithered for PBM.\n"
+        "        checkerboard : Alternating cells of --cell <num> pixels (default:8).\n"
+        "    --style <name>   : How numbers are laid out; samples in ASCII images, the header in any:\n"
+        "        plain        : As the library writes them (default).\n"
+        "        wide         : Zero padded to 10 digits.\n"
+        "        dense        : A single space between numbers; none in PBM.\n"
+        "        sloppy       : Runs of spaces, tabs, CRs and LFs.\n"
+        "        commented    : Comments in the header and between samples.\n"
+        "        glued        : Numbers directly followed by a comment.\n"
+        "    (commented and glued go beyond the Netpbm specification;\n"
+        "     plumblism reads the former, but rejects the latter)\n"
         "\n"
     );
 }
 
+static
+int parse_name(const char * const * names, int n, const char * s) {
+    for (int i = 0; i < n; i++) {
+        if (!strcmp(names[i], s)) { return i; }
+    }
+
+    fprintf(stderr, "Error: Unknown name '%s'.\n", s);
+    exit(1);
+}
+
 static
 void parse_opts(int argc, char * * argv) {
     static struct option long_options[] = {
@@ -62,8 +137,17 @@ void parse_opts(int argc, char * * argv) {
         { "pbm",        no_argument,       0, PBM },
         { "pgm",        no_argument,       0, PGM },
         { "ppm",        no_argument,       0, PPM },
+        { "pfm",        no_argument,       0, PFM },
+        { "rgb",        no_argument,       0, 'c' },
+        { "greyscale",  no_argument,       0, 'g' },
         { "ascii",      no_argument,       0, 'a' },
         { "binary",     no_argument,       0, 'b' },
+        { "seed",       required_argument, 0, 's' },
+        { "threads",    required_argument, 0, 'j' },
+        { "maxval",     required_argument, 0, 'm' },
+        { "pattern",    required_argument, 0, 'p' },
+        { "style",      required_argument, 0, 't' },
+        { "cell",       required_argument, 0, 'l' },
         { 0, 0, 0, 0 }
     };
 
@@ -75,16 +159,23 @@ void parse_opts(int argc, char * * argv) {
         exit(1);
     }
 
-    while ((opt = getopt_long(argc, argv, "hx:y:o:", long_options, &opt_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hx:y:o:j:", long_options, &opt_index)) != -1) {
         switch (opt) {
             case 'h': {
                 usage();
             } exit(0);
             case PBM:
             case PGM:
-            case PPM: {
+            case PPM:
+            case PFM: {
                 basetype = opt;
             } break;
+            case 'c': {
+                is_rgb = true;
+            } break;
+            case 'g': {
+                is_rgb = false;
+            } break;
             case 'a': {
                 is_ascii = true;
             } break;
@@ -100,6 +191,24 @@ void parse_opts(int argc, char * * argv) {
             case 'o': {
                 output_file_name = strdup(optarg);
             } break;
+            case 's': {
+                seed = strtoull(optarg, NULL, 0);
+            } break;
+            case 'j': {
+                threads = atoi(optarg);
+            } break;
+            case 'm': {
+                maxval = atoi(optarg);
+            } break;
+            case 'p': {
+                pattern = parse_name(pattern_names, sizeof(pattern_names) / sizeof(*pattern_names), optarg);
+            } break;
+            case 't': {
+                style = parse_name(style_names, sizeof(style_names) / sizeof(*style_names), optarg);
+            } break;
+            case 'l': {
+                cell = atoi(optarg);
+            } break;
             case '?':
             default: {
                 fprintf(stderr, "Error: Unknown command-line option.\n");
@@ -111,68 +220,453 @@ void parse_opts(int argc, char * * argv) {
         fprintf(stderr, "Error: No output file name provided.\n");
         exit(1);
     }
+
+    if (maxval < 1 || maxval > 65535) {
+        fprintf(stderr, "Error: --maxval has to be within 1..65535.\n");
+        exit(1);
+    }
+
+    if (cell < 1) {
+        fprintf(stderr, "Error: --cell has to be positive.\n");
+        exit(1);
+    }
+
+    if (basetype == PBM) { maxval = 1; }
 }
 
-typedef void (*fill_fn)(int * b);
+/* Every row has a generator of its own, seeded from `--seed` and the row index,
+ *  so the output does not depend on how the rows are split between threads.
+ * Samples and formatting draw from separate streams,
+ *  so the style does not change the content.
+ */
+typedef struct {
+    uint64_t s[4];
+} rng_t;
 
-void fill_PBM(int * b) {
-	b[0] = rand() & 0x1;
+typedef enum {
+    SAMPLE_STREAM,
+    FORMAT_STREAM,
+} stream_t;
+
+static
+uint64_t splitmix64(uint64_t * x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
 }
-void fill_PGM(int * b) {
-    b[0] = rand() & 0xff;
+
+static
+void seed_rng(rng_t * r, uint64_t row, stream_t stream) {
+    uint64_t x = seed ^ (row * 0xD1B54A32D192ED03ull) ^ ((uint64_t)stream << 63);
+    for (int i = 0; i < 4; i++) {
+        r->s[i] = splitmix64(&x);
+    }
 }
-void fill_PPM(int * b) {
-	b[0] = rand() & 0xff;
-	b[1] = rand() & 0xff;
-	b[2] = rand() & 0xff;
+
+static inline
+uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
 }
 
-int main(int argc, char * argv[]) {
-    int * buffer = NULL;
+// xoshiro256**
+static inline
+uint64_t next_rng(rng_t * r) {
+    uint64_t * s = r->s;
+    const uint64_t result = rotl(s[1] * 5, 7) * 9;
+    const uint64_t t = s[1] << 17;
 
-    // Init
-    parse_opts(argc, argv);
- 
-    size_t size = w * h * sizeof(int);
-    if (basetype == PPM) {
-        size *= 3;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+
+    return result;
+}
+
+// --- Patterns
+static const int bayer[4][4] = {
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 },
+};
+
+static inline
+int ramp(int i, int n, int top) {
+    return (n > 1 ? (int)((int64_t)i * top / (n - 1)) : 0);
+}
+
+/* Channel `c` of the pixel at (`x`, `y`), for the patterns which are not random.
+ */
+static
+int pattern_sample(int x, int y, int c, int channels, int top) {
+    if (pattern == CHECKERBOARD) {
+        return ((x / cell + y / cell) & 1 ? top : 0);
     }
 
-    buffer = malloc(size);
+    if (basetype == PBM) {
+        // Ordered dither; the bit is the black one
+        return ramp(x, w, 16) > bayer[y & 3][x & 3];
+    }
+
+    // Red and green along the axes, blue (and grey) along the diagonal
+    switch (c) {
+        case 0:  return (channels == 3 ? ramp(x, w, top) : ramp(x + y, w + h - 1, top));
+        case 1:  return ramp(y, h, top);
+        default: return ramp(x + y, w + h - 1, top);
+    }
+}
 
-    // Fill
-    fill_fn filler = NULL;
-    switch (basetype) {
-      #define CASE(x) \
-        case x: \
-        filler = fill_ ## x; \
-        break
-        CASE(PBM);
-        CASE(PGM);
-        CASE(PPM);
-      #undef CASE
+static
+void fill_row(int * b, int y, int row_size, int channels) {
+    if (pattern != RANDOM) {
+        for (int i = 0; i < row_size; i++) {
+            b[i] = pattern_sample(i / channels, y, i % channels, channels, maxval);
+        }
+        return;
     }
-    
-    for (int i = 0; i < w*h; i++) {
-        filler(buffer + i);
+
+    rng_t r;
+    seed_rng(&r, y, SAMPLE_STREAM);
+
+    // Each draw is cut up into as many samples as it has bits for
+    const int      bits     = (maxval == 1 ? 1 : maxval < 256 ? 8 : 16);
+    const int      per_draw = 64 / bits;
+    const uint64_t mask     = (1ull << bits) - 1;
+    const bool     exact    = (uint64_t)maxval == mask;
+    for (int i = 0; i < row_size; ) {
+        uint64_t v = next_rng(&r);
+        for (int k = 0; k < per_draw && i < row_size; k++, i++) {
+            b[i] = (exact ? v & mask : (v & mask) % (maxval + 1));
+            v >>= bits;
+        }
     }
+}
 
-    // Write
-    FILE * output_file = fopen(output_file_name, "w");
+static
+void fill_float_row(float * b, int y, int row_size, int channels) {
+    if (pattern != RANDOM) {
+        for (int i = 0; i < row_size; i++) {
+            b[i] = pattern_sample(i / channels, y, i % channels, channels, 1 << 24) * (1.0f / (1 << 24));
+        }
+        return;
+    }
+
+    rng_t r;
+    seed_rng(&r, y, SAMPLE_STREAM);
+
+    for (int i = 0; i < row_size; i++) {
+        b[i] = (next_rng(&r) >> 40) * (1.0f / (1 << 24));
+    }
+}
+
+// --- Styles
+static
+char * put_number(char * p, int v, int width) {
+    char t[SAMPLE_MAX];
+    int n = 0;
+    do {
+        t[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+
+    for (; width > n; width--) { *p++ = '0'; }
+    while (n) { *p++ = t[--n]; }
+
+    return p;
+}
+
+static
+char * put_comment(char * p, uint64_t v) {
+    *p++ = '\n';
+    *p++ = '#';
+    *p++ = ' ';
+    for (int n = v & 0xf; n; n--) {
+        v >>= 4;
+        *p++ = 'a' + (v & 0xf);
+    }
+    *p++ = '\n';
+
+    return p;
+}
+
+/* What goes between two numbers; at most `SEPARATOR_MAX` bytes.
+ * In the header every separator of the commenting styles gets its comment.
+ */
+static
+char * put_separator(char * p, rng_t * r, bool is_header) {
+    uint64_t v = next_rng(r);
+
+    switch (style) {
+        case PLAIN:
+        case WIDE: {
+            *p++ = ' ';
+        } break;
+        case DENSE: {
+            if (is_header || basetype != PBM) { *p++ = ' '; }
+        } break;
+        case SLOPPY: {
+            for (int n = 1 + (v & 0x7); n; n--) {
+                v >>= 2;
+                *p++ = " \t\r\n"[v & 0x3];
+            }
+        } break;
+        case COMMENTED: {
+            if (is_header || (v & 0x3) == 0) {
+                p = put_comment(p, v >> 2);
+            } else {
+                *p++ = ' ';
+            }
+        } break;
+        case GLUED: {
+            if (is_header || (v & 0x3) == 0) {
+                memcpy(p, "#c\n", 3);
+                p += 3;
+            } else {
+                *p++ = ' ';
+            }
+        } break;
+    }
 
+    return p;
+}
+
+static
+char * format_styled_row(char * p, const int * b, int y, int row_size) {
+    rng_t r;
+    seed_rng(&r, y, FORMAT_STREAM);
+
+    const int width = (style == WIDE && basetype != PBM ? SAMPLE_MAX : 1);
+    for (int i = 0; i < row_size; i++) {
+        p = put_number(p, b[i], width);
+        p = put_separator(p, &r, false);
+    }
+
+    return p;
+}
+
+static
+int write_styled_header(FILE * f, pnm_type_t type) {
+    rng_t r;
+    seed_rng(&r, (uint64_t)-1, FORMAT_STREAM);
+
+    const int width = (style == WIDE ? SAMPLE_MAX : 1);
+    const int fields[] = { w, h, maxval };
+    const int n_fields = (basetype == PBM ? 2 : 3);
+
+    char header[8 + 3 * (SAMPLE_MAX + 4 * SEPARATOR_MAX)];
+    char * p = header;
+    *p++ = 'P';
+    *p++ = '0' + type;
+    for (int i = 0; i < n_fields; i++) {
+        const int n_separators = (style == COMMENTED ? 4 : 1);
+        for (int k = 0; k < n_separators; k++) {
+            p = put_separator(p, &r, true);
+        }
+        p = put_number(p, fields[i], width);
+    }
+    // Exactly one whitespace before the raster
+    *p++ = '\n';
+
+    return fwrite(header, 1, p - header, f);
+}
+
+// --- Generation
+typedef struct {
+    void * b;
+    int y;          // of the first row
+    int rows;
+    int row_size;   // in samples
+    int channels;
+    bool is_float;
+    char * text;    // formatted rows, unless NULL
+    size_t length;
+} fill_job_t;
+
+static
+void * fill_rows(void * arg) {
+    fill_job_t * job = arg;
+
+    char * p = job->text;
+    for (int y = 0; y < job->rows; y++) {
+        if (job->is_float) {
+            fill_float_row((float *)job->b + (size_t)y * job->row_size, job->y + y, job->row_size, job->channels);
+            continue;
+        }
+
+        int * b = (int *)job->b + (size_t)y * job->row_size;
+        fill_row(b, job->y + y, job->row_size, job->channels);
+        if (p) { p = format_styled_row(p, b, job->y + y, job->row_size); }
+    }
+    job->length = (p ? p - job->text : 0);
+
+    return NULL;
+}
+
+/* Fill `rows` rows starting at `y` into `b`, split between the threads.
+ * With `texts` (one buffer per thread), the rows are also formatted and written to `f`.
+ */
+static
+int fill_band(void * b, int y, int rows, int row_size, int channels, bool is_float, char ** texts, FILE * f) {
+    int n = (threads < rows ? threads : rows);
+    if (n < 1) { n = 1; }
+
+    fill_job_t jobs[n];
+    pthread_t  workers[n];
+
+    const size_t sample_size = (is_float ? sizeof(float) : sizeof(int));
+    for (int i = 0, done = 0; i < n; i++) {
+        const int share = rows / n + (i < rows % n);
+        jobs[i] = (fill_job_t) {
+            .b        = (char *)b + (size_t)done * row_size * sample_size,
+            .y        = y + done,
+            .rows     = share,
+            .row_size = row_size,
+            .channels = channels,
+            .is_float = is_float,
+            .text     = (texts ? texts[i] : NULL),
+        };
+        done += share;
+    }
+
+    int started = 1;
+    for (; started < n; started++) {
+        if (pthread_create(&workers[started], NULL, fill_rows, &jobs[started])) { break; }
+    }
+    fill_rows(&jobs[0]);
+    for (int i = started; i < n; i++) { fill_rows(&jobs[i]); }
+    for (int i = 1; i < started; i++) { pthread_join(workers[i], NULL); }
+
+    if (texts) {
+        for (int i = 0; i < n; i++) {
+            if (fwrite(jobs[i].text, 1, jobs[i].length, f) != jobs[i].length) { return -1; }
+        }
+    }
+
+    return 0;
+}
+
+static
+int write_random_pfm(FILE * f) {
+    const pnm_type_t type = (is_rgb ? PNM_PIX_FLOAT : PNM_GRE_FLOAT);
+    const int channels = (is_rgb ? 3 : 1);
+    const int row_size = w * channels;
+
+    // `write_pfm_file` takes whole images, so these are not streamed
+    float * buffer = malloc((size_t)row_size * h * sizeof(float));
+    if (!buffer) { return -1; }
+
+    fill_band(buffer, 0, h, row_size, channels, true, NULL, NULL);
+
+    int r = write_pfm_file(f, type, buffer, w, h, 1.0f);
+
+    free(buffer);
+
+    return r;
+}
+
+/* Rows are generated and written a band at a time,
+ *  so images far larger than memory can be made.
+ */
+static
+int write_random_pnm(FILE * f) {
+    pnm_type_t type = (pnm_type_t)basetype;
+    if (!is_ascii) { type += 3; }
+
+    const int    channels     = (basetype == PPM ? 3 : 1);
+    const int    row_size     = w * channels;
+    const bool   is_styled    = (is_ascii && style != PLAIN);
+    const size_t row_text_max = (size_t)row_size * (SAMPLE_MAX + SEPARATOR_MAX);
+
+    int band_rows = BAND_SAMPLES / row_size;
+    if (is_styled && (size_t)band_rows * row_text_max > BAND_TEXT) { band_rows = BAND_TEXT / row_text_max; }
+    if (band_rows < 1) { band_rows = 1; }
+    if (band_rows > h) { band_rows = h; }
+
+    int * buffer = malloc((size_t)band_rows * row_size * sizeof(int));
+    if (!buffer) { return -1; }
+
+    char ** texts = NULL;
+    const int n_texts = (threads < band_rows ? threads : band_rows);
+    if (is_styled) {
+        texts = calloc(n_texts, sizeof(char *));
+        for (int i = 0; texts && i < n_texts; i++) {
+            texts[i] = malloc(((band_rows + n_texts - 1) / n_texts) * row_text_max);
+            if (!texts[i]) { goto fail; }
+        }
+        if (!texts) { goto fail; }
+    }
+
+    // The library writes plain headers; anything else is done here,
+    //  with the stream only taking care of the (binary) rows
+    pnm_stream_t s;
+    if (style == PLAIN) {
+        open_pnm_writer(&s, f, type, w, h, maxval);
+    } else {
+        write_styled_header(f, type);
+        s = (pnm_stream_t) {
+            .f         = f,
+            .type      = type,
+            .w         = w,
+            .h         = h,
+            .intensity = maxval,
+            .y         = 0,
+        };
+    }
+
+    int r = 0;
+    for (int y = 0; y < h; y += band_rows) {
+        const int rows = (h - y < band_rows ? h - y : band_rows);
+        if (fill_band(buffer, y, rows, row_size, channels, false, texts, f)) {
+            r = -1;
+            break;
+        }
+        if (!is_styled
+        &&  write_pnm_rows_parallel(&s, buffer, rows, threads) != rows) {
+            r = -1;
+            break;
+        }
+    }
+
+    for (int i = 0; texts && i < n_texts; i++) { free(texts[i]); }
+    free(texts);
+    free(buffer);
+
+    return r;
+
+  fail:
+    for (int i = 0; texts && i < n_texts; i++) { free(texts[i]); }
+    free(texts);
+    free(buffer);
+    return -1;
+}
+
+int main(int argc, char * argv[]) {
+    // Init
+    parse_opts(argc, argv);
+
+    if (threads < 1) {
+        const long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (n > 0 ? n : 1);
+    }
+
+    FILE * output_file = fopen(output_file_name, "w");
     if (!output_file) {
         fprintf(stderr, "Error: Failed to open output file '%s'.\n", output_file_name);
         return 1;
     }
 
-    pnm_type_t real_type = (pnm_type_t)basetype;
-    if (is_ascii) { real_type += 3; }
-
-    write_pnm_file(output_file, real_type, buffer, w, h, 255);
+    // Fill & Write
+    const int r = (basetype == PFM ? write_random_pfm(output_file) : write_random_pnm(output_file));
 
     // Deinit
-    fclose(output_file);
-    free(buffer);
+    if (fclose(output_file) || r < 0) {
+        fprintf(stderr, "Error: Failed to write '%s'.\n", output_file_name);
+        return 1;
+    }
 
     return 0;
 }